@@ -0,0 +1,666 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <thread_pool.h>
+#include <raycaster.h>
+#include <render_job.h>
+#include <perf_counters.h>
+#include <arena.h>
+#include <bvh.h>
+
+/*
+ * Reproducible benchmark over a fixed set of canonical scenes.
+ * Every scene is generated from a fixed seed that also seeds the samples
+ * (RayCastConfig::seed), so every run of the same build traces exactly the
+ * same rays, whatever --threads is. Results are written as JSON:
+ *
+ *   raytracer_bench [--runs N] [--threads N] [--scene NAME] [--out FILE] [--perf]
+ *                   [--cancel] [--arena] [--large-pages] [--bvh-spheres N]
+ *
+ * --perf adds hardware counters per bounce where the kernel allows it.
+ * --arena puts the scene and bvh in one arena and takes every render's
+ * tiles and buffers from another, --large-pages also asks for 2 MB pages.
+ * --cancel also cancels one render per run after a few milliseconds and
+ * reports how long the workers took to stop.
+ *
+ * Every scene also reports what scene_update costs after a camera edit,
+ * a material edit, moving a single sphere and adding a sphere. Scenes of
+ * more than SCENE_MAX_DIRTY_SPHERES spheres also move all of them, once as
+ * a full refit (refit_all) and once as the linear rebuild a `dynamic` scene
+ * does instead (dynamic_rebuild). Instanced
+ * scenes put their spheres into one object that is placed `instances`
+ * times, they move an instance instead and report their memory next to
+ * what the same spheres would take flattened.
+ *
+ * bvh_build (also a --scene name) times the SAH and the linear builder on
+ * --bvh-spheres random spheres (2^20 by default, 0 skips it) on the pool and
+ * reports ms per million spheres.
+ *
+ * retrace_check (also a --scene name) switches a sphere of an all matt
+ * scene to metal in a finished progressive render, re-traces the tiles
+ * that hit it and reports how many pixels differ from a fresh render of the
+ * edited scene, which should be none. It does the same again with the edit
+ * arriving while the render is still running.
+ */
+
+struct BenchScene {
+	const char *name;
+	u32 seed;
+	u32 sphere_count;
+	f32 spread;
+	f32 radius;
+	f32 metal_fraction;
+	u32 width;
+	u32 height;
+	u32 rays_per_pixel;
+	u32 max_bounces;
+	u32 instances;
+};
+
+static BenchScene bench_scenes[] = {
+	/* name              seed        spheres spread  radius metal  width  height rpp bounces instances */
+	{ "few_spheres",      0x1234567u, 16,     3.0f,   0.6f,  0.4f,  400,   300,   32, 8,      0    },
+	{ "spheres_10k",      0x2345678u, 10000,  12.0f,  0.08f, 0.4f,  160,   120,   2,  4,      0    },
+	{ "metal_heavy",      0x3456789u, 64,     4.0f,   0.4f,  1.0f,  320,   240,   16, 8,      0    },
+	{ "deep_bounces",     0x456789Au, 32,     3.0f,   0.5f,  0.5f,  200,   150,   16, 64,     0    },
+	{ "large_resolution", 0x56789ABu, 16,     3.0f,   0.6f,  0.4f,  1920,  1080,  2,  4,      0    },
+	// 256 spheres in a cluster, placed 4096 times: about a million spheres
+	{ "instanced_1m",     0x6789ABCu, 256,    0.5f,   0.04f, 0.4f,  320,   240,   4,  4,      4096 },
+};
+
+struct BenchResult {
+	BenchScene *scene;
+	std::vector<f64> rays_per_sec;
+	std::vector<f64> samples_per_sec;
+	std::vector<f64> time_ms;
+	std::vector<f64> cancel_latency_ms;
+	std::vector<f64> update_ms[SCENE_UPDATE_REBUILD + 1];
+	std::vector<f64> refit_all_ms;
+	std::vector<f64> dynamic_rebuild_ms;
+	std::vector<f64> perf_per_bounce[PERF_COUNTER_COUNT];
+	u32 perf_available;
+	u64 bounces;
+	bool large_pages;
+
+	// instanced scenes only
+	u64 instanced_bytes;
+	u64 flattened_bytes;
+};
+
+static void build_scene(BenchScene *desc, Scene *scene, Arena *arena) {
+	Random random = { desc->seed };
+	u32 n = desc->sphere_count;
+
+	// one spare sphere for measure_update
+	if (arena) {
+		scene->arena = arena;
+		scene->spheres = ARENA_PUSH_ARRAY(arena, Sphere, n + 1);
+		scene->materials = ARENA_PUSH_ARRAY(arena, Material, n + 1);
+		scene->planes = ARENA_PUSH_ARRAY(arena, Plane, 1);
+	} else {
+		scene->spheres = (Sphere *) malloc((n + 1) * sizeof(Sphere));
+		scene->materials = (Material *) malloc((n + 1) * sizeof(Material));
+		scene->planes = (Plane *) malloc(sizeof(Plane));
+	}
+
+	for (u32 i = 0; i < n; ++i) {
+		f32 x = randomf2(&random) * desc->spread;
+		f32 y = randomf2(&random) * desc->spread;
+		v3 albedo = vec3(randomf(&random), randomf(&random), randomf(&random));
+
+		if (randomf(&random) < desc->metal_fraction) {
+			scene->materials[i] = make_metallic(albedo);
+		} else {
+			scene->materials[i] = make_matt(albedo);
+		}
+
+		scene->spheres[i] = make_sphere(vec3(x, y, desc->radius), desc->radius, i);
+	}
+
+	scene->materials[n] = make_matt(vec3(0.5f));
+	scene->planes[0] = make_plane(0, n);
+
+	scene->num_spheres = n;
+	scene->num_materials = n + 1;
+	scene->num_planes = 1;
+
+	if (!desc->instances) {
+		return;
+	}
+
+	// the spheres become the object, the instances cover a square behind
+	// the origin that grows with their count
+	u32 count = desc->instances;
+	u32 side = (u32) ceilf(sqrtf((f32) count));
+	f32 spacing = desc->spread * 2.5f;
+
+	scene->objects = (Object *) malloc(sizeof(Object));
+	scene->objects[0] = make_object(scene->spheres, n);
+	scene->num_objects = 1;
+	scene->spheres = 0;
+	scene->num_spheres = 0;
+
+	scene->instances = (Instance *) malloc(count * sizeof(Instance));
+	scene->num_instances = count;
+
+	for (u32 i = 0; i < count; ++i) {
+		v3 position = vec3(((f32) (i % side) - side * 0.5f) * spacing, 2.0f - (f32) (i / side) * spacing, 0);
+		f32 angle = randomf(&random) * 6.2831853f;
+		f32 scale = 0.8f + randomf(&random) * 0.4f;
+
+		scene->instances[i] = make_instance(0, position, angle, scale);
+	}
+}
+
+static void free_scene(Scene *scene) {
+	free_scene_bvh(scene);
+
+	Sphere *spheres = scene->num_objects ? scene->objects[0].spheres : scene->spheres;
+	if (scene->num_objects) {
+		free(scene->objects);
+		free(scene->instances);
+	}
+
+	if (!scene->arena) {
+		free(spheres);
+		free(scene->materials);
+		free(scene->planes);
+	}
+}
+
+static u64 bvh_bytes(Bvh *bvh) {
+	return sizeof(Bvh) + bvh->node_count * (sizeof(BvhNode) + sizeof(u32)) + 2 * bvh->prim_count * sizeof(u32);
+}
+
+static void measure_update(BenchResult *result, Scene *scene, ThreadPool *pool) {
+	SceneUpdateStats stats;
+
+	scene->camera.pos.x += 0.01f;
+	scene_mark_dirty(scene, SCENE_DIRTY_CAMERA);
+	scene_update(scene, &stats);
+	result->update_ms[stats.kind].push_back((f64) stats.time_us / 1000.0);
+
+	scene->materials[0].albedo.x *= 0.5f;
+	scene_mark_dirty(scene, SCENE_DIRTY_MATERIALS);
+	scene_update(scene, &stats);
+	result->update_ms[stats.kind].push_back((f64) stats.time_us / 1000.0);
+
+	if (scene->num_instances) {
+		Instance *instance = &scene->instances[scene->num_instances / 2];
+		instance->position.z += 0.1f;
+		instance_set_transform(instance, instance->x, instance->y, instance->z, instance->position);
+		scene_mark_dirty(scene, SCENE_DIRTY_INSTANCES);
+		scene_update(scene, &stats);
+		result->update_ms[stats.kind].push_back((f64) stats.time_us / 1000.0);
+
+		instance->position.z -= 0.1f;
+		instance_set_transform(instance, instance->x, instance->y, instance->z, instance->position);
+		scene_mark_dirty(scene, SCENE_DIRTY_INSTANCES);
+		scene_update(scene);
+		return;
+	}
+
+	u32 index = scene->num_spheres / 2;
+	scene->spheres[index].center.z += 0.1f;
+	scene_mark_sphere_dirty(scene, index);
+	scene_update(scene, &stats);
+	result->update_ms[stats.kind].push_back((f64) stats.time_us / 1000.0);
+
+	// the sphere array always has room for one more, see build_scene
+	scene->spheres[scene->num_spheres] = scene->spheres[index];
+	scene->num_spheres++;
+	scene_mark_dirty(scene, SCENE_DIRTY_TOPOLOGY);
+	scene_update(scene, &stats);
+	result->update_ms[stats.kind].push_back((f64) stats.time_us / 1000.0);
+
+	scene->num_spheres--;
+	scene->spheres[index].center.z -= 0.1f;
+	scene_mark_dirty(scene, SCENE_DIRTY_TOPOLOGY);
+	scene_update(scene);
+
+	// every sphere moves, fewer are refit one by one in either case
+	if (scene->num_spheres <= SCENE_MAX_DIRTY_SPHERES) {
+		return;
+	}
+
+	for (u32 dynamic = 0; dynamic < 2; ++dynamic) {
+		scene->dynamic = dynamic;
+
+		f32 offset = dynamic ? -0.1f : 0.1f;
+		for (u32 i = 0; i < scene->num_spheres; ++i) {
+			scene->spheres[i].center.z += offset;
+			scene_mark_sphere_dirty(scene, i);
+		}
+
+		scene_update(scene, &stats, pool);
+		(dynamic ? result->dynamic_rebuild_ms : result->refit_all_ms).push_back((f64) stats.time_us / 1000.0);
+	}
+
+	// back to the SAH tree the renders use
+	scene->dynamic = false;
+	scene_mark_dirty(scene, SCENE_DIRTY_TOPOLOGY);
+	scene_update(scene);
+}
+
+static f64 percentile(std::vector<f64> values, f64 p) {
+	std::sort(values.begin(), values.end());
+
+	f64 rank = p * (f64)(values.size() - 1);
+	u32 lo = (u32) rank;
+	u32 hi = min(lo + 1, (u32) values.size() - 1);
+	f64 frac = rank - (f64) lo;
+
+	return values[lo] + (values[hi] - values[lo]) * frac;
+}
+
+static void write_summary(FILE *out, const char *key, std::vector<f64> &values, bool last) {
+	fprintf(out, "      \"%s\": { \"median\": %.3f, \"p10\": %.3f, \"p90\": %.3f, \"min\": %.3f, \"max\": %.3f }%s\n",
+		key,
+		percentile(values, 0.5), percentile(values, 0.1), percentile(values, 0.9),
+		percentile(values, 0.0), percentile(values, 1.0),
+		last ? "" : ",");
+}
+
+struct BuildResult {
+	u32 spheres;
+	std::vector<f64> sah_ms;
+	std::vector<f64> linear_ms;
+};
+
+static BuildResult run_bvh_build(u32 count, u32 threads, u32 runs) {
+	BuildResult result;
+	result.spheres = count;
+
+	Random random = { 0x789ABCDu };
+	Sphere *spheres = (Sphere *) malloc(count * sizeof(Sphere));
+	f32 spread = 1.0f + sqrtf((f32) count) * 0.5f;
+	for (u32 i = 0; i < count; ++i) {
+		v3 center = vec3(randomf2(&random) * spread, randomf2(&random) * spread, randomf(&random) * 4.0f);
+		spheres[i] = make_sphere(center, 0.2f + randomf(&random) * 0.3f, 0);
+	}
+
+	ThreadPool pool;
+	thread_pool_init(&pool, threads - 1);
+
+	for (u32 i = 0; i < runs; ++i) {
+		Bvh bvh;
+
+		u64 before = get_real_time();
+		bvh_build(&bvh, spheres, count);
+		result.sah_ms.push_back((f64) (get_real_time() - before) / 1000.0);
+		bvh_free(&bvh);
+
+		before = get_real_time();
+		bvh_build_linear(&bvh, spheres, count, &pool);
+		result.linear_ms.push_back((f64) (get_real_time() - before) / 1000.0);
+		bvh_free(&bvh);
+
+		fprintf(stderr, "bvh_build run %u/%u: sah %.1f ms, linear %.1f ms\n", i + 1, runs, result.sah_ms.back(), result.linear_ms.back());
+	}
+
+	thread_pool_destroy(&pool);
+	free(spheres);
+
+	return result;
+}
+
+struct RetraceResult {
+	u32 tiles;
+	u32 retraced_tiles;
+	u32 differing_pixels;
+	// the same edit while the job is half way through
+	u32 differing_pixels_running;
+};
+
+static void wait_for_job(RenderJob *job) {
+	while (!job->finished) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+// pixels of the re-traced job that differ from a fresh one on the edited scene
+static u32 retrace_differences(BenchScene *desc, RayCastConfig *config, bool running, RetraceResult *result) {
+	Scene scene = {};
+	build_scene(desc, &scene, 0);
+	scene.camera = make_camera_default(config);
+
+	RenderJob *job = render_job_start(&scene, config);
+
+	if (running) {
+		// until half the tiles have come in, cancelling some in their pass
+		u32 updates = 0;
+		while (!job->finished && updates < job->queue.tile_count / 2) {
+			render_job_updates(job, [&](Tile *tile, u32 *pixels, u32 stride) {
+				updates++;
+			});
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+	} else {
+		wait_for_job(job);
+	}
+
+	// one sphere, so most tiles keep their samples, and a half done one among
+	// them shows up if it got its pass twice
+	u32 edited = 0;
+	scene.materials[edited] = make_metallic(scene.materials[edited].albedo);
+
+	u32 pixels = config->width * config->height;
+	u32 differences = pixels;
+
+	result->tiles = job->queue.tile_count;
+
+	if (render_job_retrace(job, &scene, &edited, 1)) {
+		wait_for_job(job);
+		if (!running) {
+			result->retraced_tiles = job->retraced_tiles;
+		}
+
+		RenderJob *fresh = render_job_start(&scene, config);
+		wait_for_job(fresh);
+
+		differences = 0;
+		for (u32 i = 0; i < pixels; ++i) {
+			differences += job->data[i] != fresh->data[i];
+		}
+
+		render_job_free(fresh);
+	}
+
+	render_job_free(job);
+	free_scene(&scene);
+
+	return differences;
+}
+
+static RetraceResult run_retrace_check(u32 threads) {
+	// only matt at first, so the edit changes which tile loops are used
+	BenchScene desc = { "retrace_check", 0x789ABCDu, 16, 3.0f, 0.6f, 0.0f, 128, 96, 8, 4, 0 };
+
+	// the job itself takes a worker, the bench thread only polls it
+	ThreadPool pool;
+	thread_pool_init(&pool, threads > 1 ? threads - 1 : 1);
+
+	RayCastConfig config = ray_cast_config_default();
+	config.cores = threads;
+	config.width = desc.width;
+	config.height = desc.height;
+	config.rays_per_pixel = desc.rays_per_pixel;
+	config.max_bounces = desc.max_bounces;
+	config.seed = desc.seed;
+	config.pool = &pool;
+	config.tile_size = 16;
+	config.record_tile_hits = true;
+
+	RetraceResult result = {};
+	result.differing_pixels = retrace_differences(&desc, &config, false, &result);
+	result.differing_pixels_running = retrace_differences(&desc, &config, true, &result);
+
+	fprintf(stderr, "retrace_check: %u/%u tiles re-traced, %u pixels differ, %u when edited while running\n",
+		result.retraced_tiles, result.tiles, result.differing_pixels, result.differing_pixels_running);
+
+	thread_pool_destroy(&pool);
+
+	return result;
+}
+
+static BenchResult run_scene(BenchScene *desc, u32 threads, u32 runs, bool perf, bool cancel, bool arena, bool large_pages) {
+	BenchResult result;
+	result.scene = desc;
+	result.bounces = 0;
+	result.perf_available = 0;
+	result.large_pages = false;
+	result.instanced_bytes = 0;
+	result.flattened_bytes = 0;
+
+	RayCastConfig config = ray_cast_config_default();
+	config.cores = threads;
+	config.width = desc->width;
+	config.height = desc->height;
+	config.rays_per_pixel = desc->rays_per_pixel;
+	config.max_bounces = desc->max_bounces;
+	config.verbose = false;
+	config.perf_counters = perf;
+	config.seed = desc->seed;
+
+	u32 n = desc->sphere_count + 1;
+	u64 pixels = (u64) config.width * config.height;
+	Arena scene_arena = {};
+	Arena scratch = {};
+	if (arena) {
+		scene_arena = make_arena(n * (sizeof(Sphere) + sizeof(Material)) + sizeof(Plane) + sizeof(Bvh) + bvh_arena_size(n) + 4096, large_pages);
+		scratch = make_arena(pixels * (sizeof(v3) + sizeof(u32)) + ARENA_LARGE_PAGE_SIZE, large_pages);
+		config.scratch = &scratch;
+		result.large_pages = scene_arena.large_pages && scratch.large_pages;
+	}
+
+	Scene scene = {};
+	build_scene(desc, &scene, arena ? &scene_arena : 0);
+	scene.camera = make_camera_default(&config);
+
+	u32 *data = (u32 *) malloc(pixels * sizeof(u32));
+
+	// warmup, not recorded
+	raytrace_data(&scene, data, &config);
+
+	if (scene.num_instances) {
+		// flattened, every instance would carry a copy of the spheres and a
+		// bvh the size of the object's
+		Object *object = &scene.objects[0];
+		u64 object_bytes = object->num_spheres * sizeof(Sphere) + bvh_bytes(object->bvh);
+
+		result.instanced_bytes = object_bytes +
+			scene.num_instances * (sizeof(Instance) + sizeof(Sphere)) + bvh_bytes(scene.instance_bvh);
+		result.flattened_bytes = scene.num_instances * object_bytes;
+	}
+
+	for (u32 i = 0; i < runs; ++i) {
+		RenderStats stats;
+
+		raytrace_data(&scene, data, &config, &stats);
+
+		f64 seconds = max((f64) stats.time_us, 1.0) / 1000000.0;
+
+		result.rays_per_sec.push_back((f64) stats.total_bounces / seconds);
+		result.samples_per_sec.push_back((f64) stats.total_samples / seconds);
+		result.time_ms.push_back((f64) stats.time_us / 1000.0);
+		result.bounces = stats.total_bounces;
+
+		result.perf_available = stats.perf_available;
+		for (u32 k = 0; k < PERF_COUNTER_COUNT; ++k) {
+			result.perf_per_bounce[k].push_back((f64) stats.perf[k] / (f64) max(stats.total_bounces, 1ull));
+		}
+
+		fprintf(stderr, "%s run %u/%u: %.1f ms\n", desc->name, i + 1, runs, (f64) stats.time_us / 1000.0);
+	}
+
+	ThreadPool pool;
+	thread_pool_init(&pool, threads - 1);
+
+	for (u32 i = 0; i < runs; ++i) {
+		measure_update(&result, &scene, &pool);
+	}
+
+	thread_pool_destroy(&pool);
+
+	for (u32 i = 0; cancel && i < runs; ++i) {
+		RenderStats stats;
+		CancelToken token;
+
+		std::thread render([&]() {
+			raytrace_data(&scene, data, &config, &stats, &token);
+		});
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		cancel_token_cancel(&token);
+		render.join();
+
+		// a render that finished before the cancel has no latency to report
+		if (stats.cancel_latency_us || stats.time_us > 20000) {
+			result.cancel_latency_ms.push_back((f64) stats.cancel_latency_us / 1000.0);
+		}
+	}
+
+	free(data);
+	free_scene(&scene);
+	free_arena(&scene_arena);
+	free_arena(&scratch);
+
+	return result;
+}
+
+int main(int argc, char *argv[]) {
+	u32 runs = 5;
+	u32 threads = std::thread::hardware_concurrency();
+	const char *only = 0;
+	const char *out_path = 0;
+	bool perf = false;
+	bool cancel = false;
+	bool arena = false;
+	bool large_pages = false;
+	u32 bvh_spheres = 1 << 20;
+
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--runs") && i + 1 < argc) {
+			runs = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--scene") && i + 1 < argc) {
+			only = argv[++i];
+		} else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+			out_path = argv[++i];
+		} else if (!strcmp(argv[i], "--perf")) {
+			perf = true;
+		} else if (!strcmp(argv[i], "--cancel")) {
+			cancel = true;
+		} else if (!strcmp(argv[i], "--arena")) {
+			arena = true;
+		} else if (!strcmp(argv[i], "--large-pages")) {
+			arena = true;
+			large_pages = true;
+		} else if (!strcmp(argv[i], "--bvh-spheres") && i + 1 < argc) {
+			bvh_spheres = atoi(argv[++i]);
+		} else {
+			fprintf(stderr, "usage: %s [--runs N] [--threads N] [--scene NAME] [--out FILE] [--perf] [--cancel] [--arena] [--large-pages] [--bvh-spheres N]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (runs == 0) runs = 1;
+	if (threads == 0) threads = 1;
+
+	std::vector<BenchResult> results;
+	for (u32 i = 0; i < ARR_LEN(bench_scenes); ++i) {
+		if (only && strcmp(only, bench_scenes[i].name)) {
+			continue;
+		}
+
+		results.push_back(run_scene(&bench_scenes[i], threads, runs, perf, cancel, arena, large_pages));
+	}
+
+	bool build = bvh_spheres && (!only || !strcmp(only, "bvh_build"));
+	BuildResult build_result = {};
+	if (build) {
+		build_result = run_bvh_build(bvh_spheres, threads, runs);
+	}
+
+	bool retrace = !only || !strcmp(only, "retrace_check");
+	RetraceResult retrace_result = {};
+	if (retrace) {
+		retrace_result = run_retrace_check(threads);
+	}
+
+	if (results.empty() && !build && !retrace) {
+		fprintf(stderr, "Unknown scene '%s'\n", only);
+		return 1;
+	}
+
+	FILE *out = stdout;
+	if (out_path) {
+		out = fopen(out_path, "w");
+		if (!out) {
+			fprintf(stderr, "Could not open '%s'\n", out_path);
+			return 1;
+		}
+	}
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"threads\": %u,\n", threads);
+	fprintf(out, "  \"runs\": %u,\n", runs);
+	fprintf(out, "  \"arena\": %s,\n", arena ? "true" : "false");
+	if (build) {
+		f64 per_million = 1000000.0 / build_result.spheres;
+		fprintf(out, "  \"bvh_build\": { \"spheres\": %u, \"sah_ms_per_million\": %.3f, \"linear_ms_per_million\": %.3f },\n",
+			build_result.spheres,
+			percentile(build_result.sah_ms, 0.5) * per_million,
+			percentile(build_result.linear_ms, 0.5) * per_million);
+	}
+	if (retrace) {
+		fprintf(out, "  \"retrace_check\": { \"tiles\": %u, \"retraced_tiles\": %u, \"differing_pixels\": %u, \"differing_pixels_running\": %u },\n",
+			retrace_result.tiles, retrace_result.retraced_tiles, retrace_result.differing_pixels, retrace_result.differing_pixels_running);
+	}
+	fprintf(out, "  \"scenes\": [\n");
+
+	for (u32 i = 0; i < results.size(); ++i) {
+		BenchResult *r = &results[i];
+		BenchScene *s = r->scene;
+
+		fprintf(out, "    {\n");
+		fprintf(out, "      \"name\": \"%s\",\n", s->name);
+		fprintf(out, "      \"spheres\": %u,\n", s->sphere_count);
+		if (s->instances) {
+			fprintf(out, "      \"instances\": %u,\n", s->instances);
+			fprintf(out, "      \"memory_bytes\": { \"instanced\": %llu, \"flattened\": %llu },\n",
+				(unsigned long long) r->instanced_bytes, (unsigned long long) r->flattened_bytes);
+		}
+		fprintf(out, "      \"width\": %u,\n", s->width);
+		fprintf(out, "      \"height\": %u,\n", s->height);
+		fprintf(out, "      \"rays_per_pixel\": %u,\n", s->rays_per_pixel);
+		fprintf(out, "      \"max_bounces\": %u,\n", s->max_bounces);
+		fprintf(out, "      \"bounces\": %llu,\n", (unsigned long long) r->bounces);
+		if (large_pages) {
+			fprintf(out, "      \"large_pages\": %s,\n", r->large_pages ? "true" : "false");
+		}
+		write_summary(out, "time_ms", r->time_ms, false);
+		write_summary(out, "samples_per_sec", r->samples_per_sec, false);
+		if (!r->cancel_latency_ms.empty()) {
+			write_summary(out, "cancel_latency_ms", r->cancel_latency_ms, false);
+		}
+		fprintf(out, "      \"update_ms\": {");
+		for (u32 k = SCENE_UPDATE_CAMERA; k <= SCENE_UPDATE_REBUILD; ++k) {
+			f64 median = r->update_ms[k].empty() ? 0 : percentile(r->update_ms[k], 0.5);
+			fprintf(out, "%s \"%s\": %.3f", k == SCENE_UPDATE_CAMERA ? "" : ",", scene_update_name(k), median);
+		}
+		if (!r->dynamic_rebuild_ms.empty()) {
+			fprintf(out, ", \"refit_all\": %.3f, \"dynamic_rebuild\": %.3f",
+				percentile(r->refit_all_ms, 0.5), percentile(r->dynamic_rebuild_ms, 0.5));
+		}
+		fprintf(out, " },\n");
+		write_summary(out, "rays_per_sec", r->rays_per_sec, !perf);
+
+		if (perf) {
+			fprintf(out, "      \"perf_per_bounce\": {");
+			bool first = true;
+			for (u32 k = 0; k < PERF_COUNTER_COUNT; ++k) {
+				if (r->perf_available & (1 << k)) {
+					fprintf(out, "%s \"%s\": %.3f", first ? "" : ",", perf_counter_name(k), percentile(r->perf_per_bounce[k], 0.5));
+					first = false;
+				}
+			}
+			fprintf(out, " }\n");
+		}
+		fprintf(out, "    }%s\n", i + 1 < results.size() ? "," : "");
+	}
+
+	fprintf(out, "  ]\n");
+	fprintf(out, "}\n");
+
+	if (out != stdout) {
+		fclose(out);
+	}
+
+	return 0;
+}
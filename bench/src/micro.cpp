@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include <raycaster.h>
+#include <bvh8.h>
+
+/*
+ * Single threaded microbenchmarks of the per-ray kernels.
+ * All inputs are generated up front from a fixed seed, so the timed loops
+ * only contain the kernel itself. Results are ns per kernel call as JSON:
+ *
+ *   raytracer_microbench [--reps N] [--out FILE] [--srgb-stride N]
+ *
+ * It also compares the table based linear_to_srgb8 with the pow based
+ * linear_to_srgb for every N-th float in [0, 1] (every 64th by default,
+ * 1 checks them all) and reports how far apart they were, in 8 bit steps.
+ */
+
+#define BATCH_SIZE 4096
+
+struct KernelResult {
+	const char *kernel;
+	char params[64];
+	std::vector<f64> ns_per_op;
+};
+
+static volatile f32 sink;
+
+static f64 now_ns() {
+	auto t = std::chrono::steady_clock::now().time_since_epoch();
+	return (f64) std::chrono::duration_cast<std::chrono::nanoseconds>(t).count();
+}
+
+static f64 median(std::vector<f64> values) {
+	std::sort(values.begin(), values.end());
+	return values[values.size() / 2];
+}
+
+static void build_spheres(Scene *scene, u32 n, Random *random) {
+	scene->spheres = (Sphere *) malloc(n * sizeof(Sphere));
+	scene->materials = (Material *) malloc((n + 1) * sizeof(Material));
+	scene->planes = (Plane *) malloc(sizeof(Plane));
+
+	f32 spread = 1.0f + sqrtf((f32) n) * 0.5f;
+	for (u32 i = 0; i < n; ++i) {
+		f32 x = randomf2(random) * spread;
+		f32 y = randomf2(random) * spread;
+
+		scene->materials[i] = make_matt(vec3(randomf(random), randomf(random), randomf(random)));
+		scene->spheres[i] = make_sphere(vec3(x, y, 0.4f), 0.4f, i);
+	}
+
+	scene->materials[n] = make_matt(vec3(0.5f));
+	scene->planes[0] = make_plane(0, n);
+
+	scene->num_spheres = n;
+	scene->num_materials = n + 1;
+	scene->num_planes = 1;
+}
+
+static void free_spheres(Scene *scene) {
+	free(scene->spheres);
+	free(scene->materials);
+	free(scene->planes);
+	free_scene_bvh(scene);
+}
+
+/* Runs fn over the whole batch `reps` times and records ns per element. */
+template <typename F>
+static void measure(KernelResult *result, u32 reps, u32 iterations, F fn) {
+	fn(); // warmup
+
+	for (u32 r = 0; r < reps; ++r) {
+		f64 before = now_ns();
+		for (u32 i = 0; i < iterations; ++i) {
+			fn();
+		}
+		f64 after = now_ns();
+
+		result->ns_per_op.push_back((after - before) / ((f64) iterations * BATCH_SIZE));
+	}
+}
+
+int main(int argc, char *argv[]) {
+	u32 reps = 7;
+	u32 srgb_stride = 64;
+	const char *out_path = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--reps") && i + 1 < argc) {
+			reps = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+			out_path = argv[++i];
+		} else if (!strcmp(argv[i], "--srgb-stride") && i + 1 < argc) {
+			srgb_stride = max(atoi(argv[++i]), 1);
+		} else {
+			fprintf(stderr, "usage: %s [--reps N] [--out FILE] [--srgb-stride N]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (reps == 0) reps = 1;
+
+	Random random = { 0x9E3779B9u };
+	std::vector<KernelResult> results;
+
+	RayCastConfig config = ray_cast_config_default();
+	Camera camera = make_camera_default(&config);
+
+	/* primary rays through random pixels, shared by scan_hit and scatter */
+	std::vector<Ray> rays(BATCH_SIZE);
+	std::vector<f32> ss(BATCH_SIZE);
+	std::vector<f32> ts(BATCH_SIZE);
+	for (u32 i = 0; i < BATCH_SIZE; ++i) {
+		ss[i] = randomf(&random);
+		ts[i] = randomf(&random);
+		rays[i] = camera_get_ray(&camera, ss[i], ts[i], &random);
+	}
+
+	{
+		KernelResult result = { "camera_get_ray" };
+		snprintf(result.params, sizeof(result.params), "lens_radius=%.3f", camera.lens_radius);
+
+		Random r = random;
+		measure(&result, reps, 64, [&]() {
+			f32 acc = 0;
+			for (u32 i = 0; i < BATCH_SIZE; ++i) {
+				Ray ray = camera_get_ray(&camera, ss[i], ts[i], &r);
+				acc += ray.dir.x;
+			}
+			sink = acc;
+		});
+
+		results.push_back(result);
+	}
+
+	u32 sphere_counts[] = { 1, 16, 256, 4096 };
+	for (u32 c = 0; c < ARR_LEN(sphere_counts); ++c) {
+		u32 n = sphere_counts[c];
+
+		Scene scene = {};
+		build_spheres(&scene, n, &random);
+
+		/*
+		 * linear scan first, then the same scene through the binary bvh and
+		 * the 8 wide one collapsed from it, which is built here even where
+		 * scene_update would not (without AVX2)
+		 */
+		const char *accel_names[] = { "linear", "bvh", "bvh8" };
+		Bvh8 *wide = 0;
+
+		for (u32 accel = 0; accel < ARR_LEN(accel_names); ++accel) {
+			if (accel == 1) {
+				scene_update(&scene);
+				wide = scene.wide_bvh;
+				scene.wide_bvh = 0;
+			} else if (accel == 2) {
+				if (!wide) {
+					wide = (Bvh8 *)calloc(1, sizeof(Bvh8));
+					bvh8_build(wide, scene.bvh);
+				}
+				scene.wide_bvh = wide;
+			}
+
+			KernelResult result = { "scan_hit" };
+			snprintf(result.params, sizeof(result.params), "spheres=%u,accel=%s", n, accel_names[accel]);
+
+			u32 iterations = accel ? 16 : max(1u, 4096u / n);
+			measure(&result, reps, iterations, [&]() {
+				f32 acc = 0;
+				for (u32 i = 0; i < BATCH_SIZE; ++i) {
+					Hit hit = scan_hit(&scene, &rays[i]);
+					acc += hit.t;
+
+					// what trace_path does with every hit
+					if (hit.t < MAX_DIST) {
+						acc += hit_surface(&scene, &rays[i], &hit).n.z;
+					}
+				}
+				sink = acc;
+			});
+
+			results.push_back(result);
+		}
+
+		free_spheres(&scene);
+	}
+
+	{
+		/* hit points on a 16 sphere scene feed the scatter kernels */
+		Scene scene = {};
+		build_spheres(&scene, 16, &random);
+
+		std::vector<v3> points(BATCH_SIZE);
+		std::vector<v3> normals(BATCH_SIZE);
+		for (u32 i = 0; i < BATCH_SIZE; ++i) {
+			Hit hit = scan_hit(&scene, &rays[i]);
+			if (hit.t < MAX_DIST) {
+				Surface surface = hit_surface(&scene, &rays[i], &hit);
+				points[i] = surface.p;
+				normals[i] = surface.n;
+			} else {
+				points[i] = rays[i].origin + rays[i].dir;
+				normals[i] = vec3(0, 0, 1);
+			}
+		}
+
+		const char *kind_names[] = { "matt", "metallic", "dialectric" };
+		u32 kinds[] = { MATT, METALLIC, DIALECTRIC };
+
+		for (u32 k = 0; k < ARR_LEN(kinds); ++k) {
+			Material material = make_matt(vec3(0.8f, 0.6f, 0.4f));
+			material.kind = kinds[k];
+
+			KernelResult result = { "scatter" };
+			snprintf(result.params, sizeof(result.params), "material=%s", kind_names[k]);
+
+			Random r = random;
+			measure(&result, reps, 64, [&]() {
+				f32 acc = 0;
+				for (u32 i = 0; i < BATCH_SIZE; ++i) {
+					Ray ray = rays[i];
+					v3 attenuation;
+					if (scatter(material, &ray, points[i], normals[i], &attenuation, &r)) {
+						acc += ray.dir.z;
+					}
+				}
+				sink = acc;
+			});
+
+			results.push_back(result);
+		}
+
+		free_spheres(&scene);
+	}
+
+	/* colors slightly past 1 so the clamp path is exercised as well */
+	std::vector<v3> colors(BATCH_SIZE);
+	for (u32 i = 0; i < BATCH_SIZE; ++i) {
+		colors[i] = 1.2f * vec3(randomf(&random), randomf(&random), randomf(&random));
+	}
+
+	{
+		KernelResult result = { "linear_to_srgb" };
+		snprintf(result.params, sizeof(result.params), "channels=3");
+
+		measure(&result, reps, 64, [&]() {
+			f32 acc = 0;
+			for (u32 i = 0; i < BATCH_SIZE; ++i) {
+				v3 s = linear_to_srgb(colors[i]);
+				acc += s.g;
+			}
+			sink = acc;
+		});
+
+		results.push_back(result);
+	}
+
+	{
+		std::vector<v3> srgb(BATCH_SIZE);
+		for (u32 i = 0; i < BATCH_SIZE; ++i) {
+			srgb[i] = linear_to_srgb(colors[i]);
+		}
+
+		KernelResult result = { "rgb_to_hex" };
+		snprintf(result.params, sizeof(result.params), "channels=3");
+
+		measure(&result, reps, 256, [&]() {
+			u32 acc = 0;
+			for (u32 i = 0; i < BATCH_SIZE; ++i) {
+				acc ^= rgb_to_hex(srgb[i]);
+			}
+			sink = (f32) acc;
+		});
+
+		results.push_back(result);
+	}
+
+	{
+		/* the whole resolve of a pixel, clamp to packed 8 bit sRGB */
+		KernelResult reference = { "resolve_pixel" };
+		snprintf(reference.params, sizeof(reference.params), "pow");
+
+		measure(&reference, reps, 64, [&]() {
+			u32 acc = 0;
+			for (u32 i = 0; i < BATCH_SIZE; ++i) {
+				acc ^= rgb_to_hex(linear_to_srgb(clamp(colors[i], 0.0f, 1.0f)));
+			}
+			sink = (f32) acc;
+		});
+
+		results.push_back(reference);
+
+		KernelResult scalar = { "resolve_pixel" };
+		snprintf(scalar.params, sizeof(scalar.params), "table");
+
+		measure(&scalar, reps, 256, [&]() {
+			u32 acc = 0;
+			for (u32 i = 0; i < BATCH_SIZE; ++i) {
+				acc ^= linear_to_pixel(colors[i]);
+			}
+			sink = (f32) acc;
+		});
+
+		results.push_back(scalar);
+
+		std::vector<u32> pixels(BATCH_SIZE);
+		KernelResult batch = { "resolve_pixel" };
+		snprintf(batch.params, sizeof(batch.params), "table,batch");
+
+		measure(&batch, reps, 256, [&]() {
+			linear_to_pixels(colors.data(), pixels.data(), BATCH_SIZE);
+			sink = (f32) pixels[BATCH_SIZE - 1];
+		});
+
+		results.push_back(batch);
+	}
+
+	/* every stride-th float in [0, 1], bit patterns order like the values */
+	u64 srgb_checked = 0;
+	u64 srgb_mismatches = 0;
+	u32 srgb_max_error = 0;
+	for (u64 bits = 0; bits <= 0x3F800000u; bits += srgb_stride) {
+		u32 b = (u32) bits;
+		f32 l;
+		memcpy(&l, &b, sizeof(l));
+
+		u32 fast = linear_to_srgb8(l);
+		u32 reference = (u32)(linear_to_srgb(l) * 255.9);
+		u32 error = fast > reference ? fast - reference : reference - fast;
+
+		srgb_checked++;
+		srgb_mismatches += error != 0;
+		srgb_max_error = max(srgb_max_error, error);
+	}
+
+	/* the batch version against the scalar one, out of range values included */
+	std::vector<v3> edge_colors(BATCH_SIZE);
+	std::vector<u32> edge_pixels(BATCH_SIZE);
+	for (u32 i = 0; i < BATCH_SIZE; ++i) {
+		edge_colors[i] = 3.0f * vec3(randomf2(&random), randomf2(&random), randomf2(&random));
+	}
+	edge_colors[0] = vec3(NAN, INFINITY, -INFINITY);
+	linear_to_pixels(edge_colors.data(), edge_pixels.data(), BATCH_SIZE);
+	for (u32 i = 0; i < BATCH_SIZE; ++i) {
+		srgb_mismatches += edge_pixels[i] != linear_to_pixel(edge_colors[i]);
+	}
+
+	FILE *out = stdout;
+	if (out_path) {
+		out = fopen(out_path, "w");
+		if (!out) {
+			fprintf(stderr, "Could not open '%s'\n", out_path);
+			return 1;
+		}
+	}
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"batch_size\": %u,\n", BATCH_SIZE);
+	fprintf(out, "  \"reps\": %u,\n", reps);
+	fprintf(out, "  \"srgb8_check\": { \"floats\": %llu, \"stride\": %u, \"mismatches\": %llu, \"max_error\": %u },\n",
+		(unsigned long long) srgb_checked, srgb_stride, (unsigned long long) srgb_mismatches, srgb_max_error);
+	fprintf(out, "  \"kernels\": [\n");
+
+	for (u32 i = 0; i < results.size(); ++i) {
+		KernelResult *r = &results[i];
+		std::vector<f64> sorted = r->ns_per_op;
+		std::sort(sorted.begin(), sorted.end());
+
+		fprintf(out, "    { \"kernel\": \"%s\", \"params\": \"%s\", \"ns_per_op\": { \"median\": %.3f, \"min\": %.3f, \"max\": %.3f } }%s\n",
+			r->kernel, r->params, median(r->ns_per_op), sorted.front(), sorted.back(),
+			i + 1 < results.size() ? "," : "");
+	}
+
+	fprintf(out, "  ]\n");
+	fprintf(out, "}\n");
+
+	if (out != stdout) {
+		fclose(out);
+	}
+
+	return 0;
+}
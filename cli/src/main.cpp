@@ -1,35 +1,498 @@
-#include <raycaster.h>
-
 #include <stdio.h>
+#include <string.h>
 #include <thread>
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+#include <thread_pool.h>
+#include <raycaster.h>
+#include <image_writer.h>
+#include <render_farm.h>
+#include <checkpoint.h>
+#include <arena.h>
+
+static bool encode_png_band(void *user, u32 *pixels, u32 first_row, u32 rows) {
+	png_parallel_encode_strip((PngParallel *)user, pixels, first_row);
+	return true;
+}
+
+// strips of the png are filtered and deflated on the render threads as soon
+// as their tiles are done, so only the last ones are left after the render
+void file_mode(Scene *scene, RayCastConfig *config, const char *out_path) {
+	u32 *data = (u32 *)malloc((u64)config->width * config->height * sizeof(u32));
+	bool ok;
+
+	if (config->time_budget_ms || config->checkpoint_path) {
+		raytrace_data(scene, data, config);
+
+		u64 before = get_real_time();
+		ok = write_png(out_path, data, config->width, config->height, true, config->pool, config->cores);
+
+		if (config->verbose) {
+			printf("Encoding took %llu ms\n", (unsigned long long)((get_real_time() - before) / 1000));
+		}
+	} else {
+		u32 band_rows = config->tile_size ? config->tile_size : RAYTRACE_BAND_TILE_SIZE;
+
+		PngParallel png = {};
+		png_parallel_begin(&png, config->width, config->height, band_rows, true);
+
+		raytrace_bands(scene, config, data, encode_png_band, &png);
+		ok = png_parallel_finish(&png, out_path);
+		png_parallel_free(&png);
+	}
+
+	if (!ok) {
+		fprintf(stderr, "Could not write %s\n", out_path);
+	}
+
+	free(data);
+}
+
+static bool has_extension(const char *path, const char *extension) {
+	size_t length = strlen(path);
+	size_t ext_length = strlen(extension);
+	return length >= ext_length && !strcmp(path + length - ext_length, extension);
+}
+
+// .exr, .hdr and .pfm keep the linear radiance, everything else is an 8 bit png
+static bool is_hdr_path(const char *path) {
+	return has_extension(path, ".exr") || has_extension(path, ".hdr") || has_extension(path, ".pfm");
+}
+
+static void write_linear(RayCastConfig *config, const char *out_path, v3 *pixels, bool exr_float) {
+	u64 before = get_real_time();
+	bool ok;
+
+	if (has_extension(out_path, ".exr")) {
+		ok = write_exr(out_path, pixels, config->width, config->height, !exr_float, config->pool, config->cores);
+	} else if (has_extension(out_path, ".hdr")) {
+		ok = write_hdr(out_path, pixels, config->width, config->height);
+	} else {
+		ok = write_pfm(out_path, pixels, config->width, config->height);
+	}
+
+	if (!ok) {
+		fprintf(stderr, "Could not write %s\n", out_path);
+	} else if (config->verbose) {
+		printf("Writing %s took %llu ms\n", out_path, (unsigned long long)((get_real_time() - before) / 1000));
+	}
+}
+
+void hdr_mode(Scene *scene, RayCastConfig *config, const char *out_path, bool exr_float) {
+	v3 *pixels = (v3 *)malloc((u64)config->width * config->height * sizeof(v3));
+	raytrace_linear(scene, pixels, config);
+
+	write_linear(config, out_path, pixels, exr_float);
+
+	free(pixels);
+}
+
+// .slice files keep the unnormalized sums of a sample range for --merge
+static bool is_slice_path(const char *path) {
+	return has_extension(path, ".slice");
+}
+
+void slice_mode(Scene *scene, RayCastConfig *config, const char *out_path) {
+	SampleSlice slice;
+	slice.render_hash = hash_slice(scene, config);
+	slice.first_sample = config->sample_offset;
+	slice.sample_count = config->rays_per_pixel;
+	slice.fb = make_framebuffer(config->width, config->height);
+
+	raytrace_sums(scene, &slice.fb, config);
+
+	if (!write_sample_slice(out_path, &slice)) {
+		fprintf(stderr, "Could not write %s\n", out_path);
+	}
+
+	free_framebuffer(&slice.fb);
+}
+
+// adds up slices of disjoint sample ranges and writes the result in the
+// format of out_path, which may be another slice
+void merge_mode(RayCastConfig *config, const char **inputs, u32 count, const char *out_path, bool exr_float) {
+	SampleSlice *slices = (SampleSlice *)malloc(count * sizeof(SampleSlice));
+	u32 read = 0;
+
+	for (u32 i = 0; i < count; ++i) {
+		if (!read_sample_slice(inputs[i], &slices[read])) {
+			fprintf(stderr, "Could not read sample slice %s\n", inputs[i]);
+			continue;
+		}
+		read++;
+	}
+
+	qsort(slices, read, sizeof(SampleSlice), [](const void *a, const void *b) {
+		u32 first_a = ((SampleSlice *)a)->first_sample;
+		u32 first_b = ((SampleSlice *)b)->first_sample;
+		return first_a < first_b ? -1 : (first_a > first_b ? 1 : 0);
+	});
+
+	bool ok = read == count && read > 0;
+
+	for (u32 i = 1; ok && i < read; ++i) {
+		if (!merge_sample_slice(&slices[0], &slices[i])) {
+			fprintf(stderr, "Samples %u..%u are from another render or overlap the others\n",
+				slices[i].first_sample, slices[i].first_sample + slices[i].sample_count);
+			ok = false;
+		}
+	}
+
+	if (ok) {
+		Framebuffer *fb = &slices[0].fb;
+
+		RayCastConfig out_config = *config;
+		out_config.width = fb->width;
+		out_config.height = fb->height;
+
+		if (config->verbose) {
+			printf("Merged %u slices, samples %u..%u\n", read, slices[0].first_sample, slices[0].first_sample + slices[0].sample_count);
+		}
+
+		if (is_slice_path(out_path)) {
+			ok = write_sample_slice(out_path, &slices[0]);
+		} else if (is_hdr_path(out_path)) {
+			resolve_framebuffer_linear(fb, fb->color);
+			write_linear(&out_config, out_path, fb->color, exr_float);
+		} else {
+			u32 *data = (u32 *)malloc((u64)fb->width * fb->height * sizeof(u32));
+			resolve_framebuffer(fb, data);
+			ok = write_png(out_path, data, fb->width, fb->height, true, config->pool, config->cores);
+			free(data);
+		}
+
+		if (!ok) {
+			fprintf(stderr, "Could not write %s\n", out_path);
+		}
+	}
+
+	for (u32 i = 0; i < read; ++i) {
+		free_framebuffer(&slices[i].fb);
+	}
+	free(slices);
+}
+
+// tiles are traced by the workers that connect to `address`, the merged
+// framebuffer is written like a local render
+void farm_mode(Scene *scene, RayCastConfig *config, const char *address, const char *out_path, bool exr_float) {
+	if (config->time_budget_ms || config->checkpoint_path) {
+		fprintf(stderr, "--farm renders every tile in one go, time budget and checkpoints are ignored\n");
+	}
+
+	Framebuffer fb = make_framebuffer(config->width, config->height);
+
+	if (farm_coordinate(scene, config, address, &fb)) {
+		if (is_hdr_path(out_path)) {
+			resolve_framebuffer_linear(&fb, fb.color);
+			write_linear(config, out_path, fb.color, exr_float);
+		} else {
+			u32 *data = (u32 *)malloc((u64)config->width * config->height * sizeof(u32));
+			resolve_framebuffer(&fb, data);
+
+			if (!write_png(out_path, data, config->width, config->height, true, config->pool, config->cores)) {
+				fprintf(stderr, "Could not write %s\n", out_path);
+			}
+			free(data);
+		}
+	}
+
+	free_framebuffer(&fb);
+}
+
+static bool write_png_band(void *user, u32 *pixels, u32 first_row, u32 rows) {
+	return png_stream_write_rows((PngStream *)user, pixels, rows);
+}
+
+// for images too large to keep in memory, every band of tiles is encoded and
+// dropped as soon as it is rendered
+void stream_mode(Scene *scene, RayCastConfig *config, const char *out_path) {
+	if (config->time_budget_ms || config->checkpoint_path) {
+		fprintf(stderr, "--stream renders every tile in one go, time budget and checkpoints are ignored\n");
+	}
+
+	PngStream png;
+	if (!png_stream_open(&png, out_path, config->width, config->height, true)) {
+		fprintf(stderr, "Could not open %s\n", out_path);
+		return;
+	}
+
+	raytrace_bands(scene, config, 0, write_png_band, &png);
+
+	if (!png_stream_close(&png)) {
+		fprintf(stderr, "Could not write %s\n", out_path);
+	}
+}
+
+// rigid rotation of the camera around the world z axis
+static Camera rotate_camera(Camera *camera, f32 angle) {
+	f32 c = cosf(angle);
+	f32 s = sinf(angle);
+
+	auto rotate = [c, s](v3 p) {
+		return vec3(c * p.x - s * p.y, s * p.x + c * p.y, p.z);
+	};
+
+	Camera rotated = *camera;
+	rotated.pos = rotate(camera->pos);
+	rotated.hori = rotate(camera->hori);
+	rotated.vert = rotate(camera->vert);
+	rotated.llc = rotate(camera->llc);
+	rotated.u = rotate(camera->u);
+	rotated.v = rotate(camera->v);
+	return rotated;
+}
+
+// out.png becomes out_0000.png .. unless the path has its own printf pattern
+static void frame_path(char *buffer, u32 size, const char *pattern, u32 frame) {
+	if (strchr(pattern, '%')) {
+		snprintf(buffer, size, pattern, frame);
+		return;
+	}
+
+	const char *dot = strrchr(pattern, '.');
+	s32 stem = dot ? (s32)(dot - pattern) : (s32)strlen(pattern);
+	snprintf(buffer, size, "%.*s_%04u%s", stem, pattern, frame, dot ? dot : "");
+}
+
+struct FrameSlot {
+	PngParallel png;
+	char path[1024];
+	bool ok;
+	TaskGroup group;
+};
+
+// Renders `frames` frames while the camera orbits the z axis by orbit_degrees
+// over the sequence. A frame's strips are encoded as its bands finish and the
+// file is written by a pool task, which overlaps with the next frame's
+// tracing. Two slots of encoder buffers alternate, the image buffer is shared.
+void animation_mode(Scene *scene, RayCastConfig *config, const char *out_pattern, u32 frames, f32 orbit_degrees) {
+	if (config->time_budget_ms || config->checkpoint_path) {
+		fprintf(stderr, "--frames renders every frame in one go, time budget and checkpoints are ignored\n");
+	}
+
+	RayCastConfig frame_config = *config;
+	frame_config.verbose = false;
+
+	u32 band_rows = config->tile_size ? config->tile_size : RAYTRACE_BAND_TILE_SIZE;
+	u32 *image = (u32 *)malloc((u64)config->width * config->height * sizeof(u32));
+
+	FrameSlot slots[2];
+	for (u32 i = 0; i < ARR_LEN(slots); ++i) {
+		slots[i].png = {};
+		slots[i].ok = true;
+	}
+
+	Camera start = scene->camera;
+	bool ok = true;
+	u64 before = get_real_time();
+
+	for (u32 f = 0; f < frames; ++f) {
+		FrameSlot *slot = &slots[f % ARR_LEN(slots)];
+
+		// the file of the frame that used this slot before has to be out
+		thread_pool_wait(config->pool, &slot->group);
+		ok = slot->ok && ok;
+
+		f32 angle = orbit_degrees / 180.0f * 3.1415926535f * f / frames;
+		scene->camera = rotate_camera(&start, angle);
+		scene_mark_dirty(scene, SCENE_DIRTY_CAMERA);
+
+		u64 frame_start = get_real_time();
+
+		png_parallel_begin(&slot->png, config->width, config->height, band_rows, true);
+		raytrace_bands(scene, &frame_config, image, encode_png_band, &slot->png);
+
+		frame_path(slot->path, sizeof(slot->path), out_pattern, f);
+		thread_pool_submit(config->pool, &slot->group, [slot]() {
+			slot->ok = png_parallel_finish(&slot->png, slot->path);
+			if (!slot->ok) {
+				fprintf(stderr, "Could not write %s\n", slot->path);
+			}
+		});
+
+		if (config->verbose) {
+			printf("Frame %u/%u %s: %llu ms\n", f + 1, frames, slot->path, (unsigned long long)((get_real_time() - frame_start) / 1000));
+		}
+	}
+
+	for (u32 i = 0; i < ARR_LEN(slots); ++i) {
+		thread_pool_wait(config->pool, &slots[i].group);
+		ok = slots[i].ok && ok;
+		png_parallel_free(&slots[i].png);
+	}
+
+	scene->camera = start;
+	free(image);
+
+	if (config->verbose) {
+		f32 seconds = (get_real_time() - before) / 1000000.0f;
+		printf("%u frames in %.2f s, %.2f fps\n", frames, seconds, frames / seconds);
+	}
+
+	if (!ok) {
+		fprintf(stderr, "Not all frames could be written\n");
+	}
+}
+
+static void print_usage(const char *program) {
+	fprintf(stderr, "usage: %s [threads] [--size WxH] [--out FILE] [--stream] [--exr-float]\n"
+		"    [--frames N] [--orbit DEG] [--seed N]\n"
+		"    [--farm ADDR] [--farm-local N] [--farm-worker ADDR]\n"
+		"    [--samples [FIRST:]COUNT] [--merge FILE.slice ...]\n"
+		"    [--time-budget MS] [--checkpoint FILE] [--checkpoint-interval S] [--resume]\n"
+		"    [--large-pages] [--instances N]\n", program);
+}
 
-void file_mode(Scene *scene, RayCastConfig *config) {
-    u32 *data = raytrace(scene, config);
+// the thread count is the only argument without a flag, digits and above 0
+static bool parse_thread_count(const char *arg, u32 *count) {
+	if (!*arg) {
+		return false;
+	}
 
-    stbi_flip_vertically_on_write(1);
-    stbi_write_png("out.png", config->width, config->height, 4, data, 4 * config->width);
+	for (const char *c = arg; *c; ++c) {
+		if (*c < '0' || *c > '9') {
+			return false;
+		}
+	}
+
+	*count = atoi(arg);
+	return *count > 0;
 }
 
 f32 random_float() {
     return (f32)rand() / (f32)RAND_MAX;
 }
 
+// A cluster of small spheres repeated `count` times on a grid behind the
+// others, every other one in a single material. Only the one cluster is
+// stored, however many there are.
+static void place_instances(Scene *scene, Arena *arena, u32 count) {
+	u32 ring = 6;
+
+	Sphere *spheres = ARENA_PUSH_ARRAY(arena, Sphere, ring + 1);
+	spheres[0] = make_sphere(vec3(0, 0, 0.3f), 0.3f, 0);
+	for (u32 i = 0; i < ring; ++i) {
+		f32 angle = 2 * 3.1415926535f * i / ring;
+		spheres[i + 1] = make_sphere(vec3(cosf(angle) * 0.45f, sinf(angle) * 0.45f, 0.15f), 0.15f, (i + 1) % (scene->num_materials - 1));
+	}
+
+	scene->objects = ARENA_PUSH_ARRAY(arena, Object, 1);
+	scene->objects[0] = make_object(spheres, ring + 1);
+	scene->num_objects = 1;
+
+	scene->instances = ARENA_PUSH_ARRAY(arena, Instance, count);
+	scene->num_instances = count;
+
+	u32 side = (u32)ceilf(sqrtf((f32)count));
+	for (u32 i = 0; i < count; ++i) {
+		v3 position = vec3(((f32)(i % side) - side * 0.5f) * 1.5f, -13.0f - (i / side) * 1.5f, 0);
+		u32 material = i % 2 ? random_float() * (scene->num_materials - 1) : INSTANCE_OBJECT_MATERIALS;
+
+		scene->instances[i] = make_instance(0, position, random_float() * 3.1415926535f, 0.75f + random_float() * 0.5f, material);
+	}
+}
+
 int main(int argc, char *argv[]) {
 	u32 num_threads = 8;
-	if (argc > 1) {
-		num_threads = atoi(argv[1]);
+	u32 time_budget_ms = 0;
+	const char *checkpoint_path = 0;
+	u32 checkpoint_interval = 10;
+	bool resume = false;
+	bool stream = false;
+	bool exr_float = false;
+	bool large_pages = false;
+	u32 instances = 0;
+	u32 frames = 0;
+	u32 seed = 0;
+	const char *farm_address = 0;
+	const char *farm_worker = 0;
+	u32 farm_local = 0;
+	u32 rays_per_pixel = 128;
+	u32 sample_offset = 0;
+	const char *merge_inputs[256];
+	u32 merge_count = 0;
+	f32 orbit_degrees = 360;
+	u32 width = 0;
+	u32 height = 0;
+	const char *out_path = "out.png";
+
+	for (int a = 1; a < argc; ++a) {
+		if (!strcmp(argv[a], "--size") && a + 1 < argc) {
+			sscanf(argv[++a], "%ux%u", &width, &height);
+		} else if (!strcmp(argv[a], "--out") && a + 1 < argc) {
+			out_path = argv[++a];
+		} else if (!strcmp(argv[a], "--stream")) {
+			stream = true;
+		} else if (!strcmp(argv[a], "--samples") && a + 1 < argc) {
+			// FIRST:COUNT or just COUNT
+			if (sscanf(argv[++a], "%u:%u", &sample_offset, &rays_per_pixel) != 2) {
+				sample_offset = 0;
+				rays_per_pixel = atoi(argv[a]);
+			}
+		} else if (!strcmp(argv[a], "--merge") && a + 1 < argc) {
+			if (merge_count == ARR_LEN(merge_inputs)) {
+				fprintf(stderr, "At most %u slices can be merged\n", (u32)ARR_LEN(merge_inputs));
+				return 1;
+			}
+			merge_inputs[merge_count++] = argv[++a];
+		} else if (!strcmp(argv[a], "--seed") && a + 1 < argc) {
+			seed = atoi(argv[++a]);
+		} else if (!strcmp(argv[a], "--farm") && a + 1 < argc) {
+			farm_address = argv[++a];
+		} else if (!strcmp(argv[a], "--farm-worker") && a + 1 < argc) {
+			farm_worker = argv[++a];
+		} else if (!strcmp(argv[a], "--farm-local") && a + 1 < argc) {
+			farm_local = atoi(argv[++a]);
+		} else if (!strcmp(argv[a], "--frames") && a + 1 < argc) {
+			frames = atoi(argv[++a]);
+		} else if (!strcmp(argv[a], "--orbit") && a + 1 < argc) {
+			orbit_degrees = atof(argv[++a]);
+		} else if (!strcmp(argv[a], "--exr-float")) {
+			exr_float = true;
+		} else if (!strcmp(argv[a], "--large-pages")) {
+			large_pages = true;
+		} else if (!strcmp(argv[a], "--instances") && a + 1 < argc) {
+			instances = atoi(argv[++a]);
+		} else if (!strcmp(argv[a], "--time-budget") && a + 1 < argc) {
+			time_budget_ms = atoi(argv[++a]);
+		} else if (!strcmp(argv[a], "--checkpoint") && a + 1 < argc) {
+			checkpoint_path = argv[++a];
+		} else if (!strcmp(argv[a], "--checkpoint-interval") && a + 1 < argc) {
+			checkpoint_interval = atoi(argv[++a]);
+		} else if (!strcmp(argv[a], "--resume")) {
+			resume = true;
+		} else if (!parse_thread_count(argv[a], &num_threads)) {
+			print_usage(argv[0]);
+			return 1;
+		}
 	}
 
-    Scene scene;
+	if (resume && !checkpoint_path) {
+		checkpoint_path = "out.ckpt";
+	}
+
+	// a worker gets its scene from the coordinator
+	if (farm_worker) {
+		return farm_work(farm_worker, num_threads, true) ? 0 : 1;
+	}
 
-    u32 n = 200;
+	char local_address[128];
+	if (farm_local && !farm_address) {
+		farm_local_address(local_address, sizeof(local_address));
+		farm_address = local_address;
+	}
+
+	// the scene and its bvh in one arena, torn down with it at the end
+	Arena scene_arena = make_arena(ARENA_LARGE_PAGE_SIZE + (u64)instances * sizeof(Instance), large_pages);
+
+    Scene scene = {};
+	scene.arena = &scene_arena;
+
+    u32 n = 16;
     u32 i = 0;
     
-    scene.spheres = (Sphere *) malloc(n * sizeof(Sphere));
-    scene.materials = (Material *) malloc(n * sizeof(Material));
+    scene.spheres = ARENA_PUSH_ARRAY(&scene_arena, Sphere, n);
+    scene.materials = ARENA_PUSH_ARRAY(&scene_arena, Material, n + 1);
+    scene.planes = ARENA_PUSH_ARRAY(&scene_arena, Plane, 1);
    
    /* for (s32 j = -11; j < 10; ++j) {
         for (s32 k = -13; k < 4; ++k) {*/
@@ -52,22 +515,90 @@ int main(int argc, char *argv[]) {
     }
 
     scene.num_spheres = i;
-    scene.num_materials = i;
+	// the floor's material comes last
+    scene.num_materials = i + 1;
 
     scene.materials[i] = make_matt(vec3(0.5));
-    Plane floor = make_plane(0, i);
-	scene.planes = &floor;
+    scene.planes[0] = make_plane(0, i);
     scene.num_planes = 1;
 
+	if (instances) {
+		place_instances(&scene, &scene_arena, instances);
+	}
+
 
 	RayCastConfig config = ray_cast_config_default();
-	config.rays_per_pixel = 128;
+	config.rays_per_pixel = rays_per_pixel;
+	config.sample_offset = sample_offset;
 	config.max_bounces = 8;
 	config.cores = num_threads;
+	if (!seed && (sample_offset || is_slice_path(out_path))) {
+		// without one every process would draw the same samples
+		fprintf(stderr, "Sample ranges only add up with a seed, using --seed 1\n");
+		seed = 1;
+	}
+	config.seed = seed;
+	config.time_budget_ms = time_budget_ms;
+	config.checkpoint_path = checkpoint_path;
+	config.checkpoint_interval_ms = checkpoint_interval * 1000;
+	config.resume = resume;
+	if (width && height) {
+		config.width = width;
+		config.height = height;
+	}
 
     scene.camera = make_camera_default(&config);
+
+	// tiles and accumulation buffers of every render, reused from one to the next
+	u64 pixels = (u64)config.width * config.height;
+	Arena scratch = make_arena(pixels * (sizeof(v3) + 2 * sizeof(u32)) + ARENA_LARGE_PAGE_SIZE, large_pages);
+	config.scratch = &scratch;
+
+	if (large_pages && config.verbose) {
+		printf("Large pages: %s\n", scratch.hugetlb ? "hugetlb" : scratch.large_pages ? "transparent" : "not available");
+	}
+
+	// before the pool exists, forking a process with running threads is asking for trouble
+	if (farm_local) {
+		farm_spawn_workers(farm_address, farm_local, max(num_threads / farm_local, 1));
+	}
+
+	// shared by rendering and encoding, the main thread helps while waiting
+	ThreadPool pool;
+	thread_pool_init(&pool, num_threads > 1 ? num_threads - 1 : 0);
+	config.pool = &pool;
     
-    file_mode(&scene, &config);
+	if (merge_count) {
+		merge_mode(&config, merge_inputs, merge_count, out_path, exr_float);
+	} else if (farm_address) {
+		farm_mode(&scene, &config, farm_address, out_path, exr_float);
+	} else if (is_slice_path(out_path)) {
+		slice_mode(&scene, &config, out_path);
+	} else if (frames && is_hdr_path(out_path)) {
+		fprintf(stderr, "--frames only writes png sequences\n");
+	} else if (frames) {
+		if (stream) {
+			fprintf(stderr, "--frames keeps whole frames, --stream is ignored\n");
+		}
+		animation_mode(&scene, &config, out_path, frames, orbit_degrees);
+	} else if (is_hdr_path(out_path)) {
+		if (stream) {
+			fprintf(stderr, "--stream only writes png, rendering %s in one piece\n", out_path);
+		}
+		hdr_mode(&scene, &config, out_path, exr_float);
+	} else if (stream) {
+		stream_mode(&scene, &config, out_path);
+	} else {
+		file_mode(&scene, &config, out_path);
+	}
+
+	thread_pool_destroy(&pool);
+	free_arena(&scratch);
+	free_arena(&scene_arena);
+
+	if (farm_local) {
+		farm_wait_workers();
+	}
 
     return 0;
 }
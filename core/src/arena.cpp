@@ -0,0 +1,69 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "arena.h"
+
+Arena make_arena(u64 capacity, bool large_pages) {
+	Arena arena = {};
+
+	// whole large pages, so the tail can be backed by one as well
+	capacity = (capacity + ARENA_LARGE_PAGE_SIZE - 1) & ~(ARENA_LARGE_PAGE_SIZE - 1);
+
+#ifdef _WIN32
+	// committed up front, Windows only hands out pages it can back
+	arena.base = (u8 *)VirtualAlloc(0, capacity, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	void *base = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if (large_pages) {
+		// only succeeds if huge pages were set aside (vm.nr_hugepages), and
+		// without MAP_NORESERVE it claims them now instead of faulting later
+		base = mmap(0, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		arena.hugetlb = base != MAP_FAILED;
+		arena.large_pages = arena.hugetlb;
+	}
+#endif
+
+	if (base == MAP_FAILED) {
+		base = mmap(0, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+#ifdef MADV_HUGEPAGE
+		if (large_pages && base != MAP_FAILED) {
+			arena.large_pages = madvise(base, capacity, MADV_HUGEPAGE) == 0;
+		}
+#endif
+	}
+
+	arena.base = base == MAP_FAILED ? 0 : (u8 *)base;
+#endif
+
+	arena.capacity = arena.base ? capacity : 0;
+	return arena;
+}
+
+void free_arena(Arena *arena) {
+	if (arena->base) {
+#ifdef _WIN32
+		VirtualFree(arena->base, 0, MEM_RELEASE);
+#else
+		munmap(arena->base, arena->capacity);
+#endif
+	}
+
+	*arena = {};
+}
+
+void *arena_push(Arena *arena, u64 size, u64 align) {
+	u64 start = (arena->used + align - 1) & ~(align - 1);
+
+	if (start + size > arena->capacity) {
+		return 0;
+	}
+
+	arena->used = start + size;
+	return arena->base + start;
+}
@@ -0,0 +1,54 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "raycaster.h"
+
+/*
+ * Linear allocator over one reservation of address space. Pushing is a
+ * pointer bump, and memory is only given back all at once (free_arena,
+ * arena_clear) or down to an earlier mark (arena_reset), so a scene or a
+ * render's scratch memory is torn down in O(1) and sits next to each other.
+ *
+ * The reservation is not backed until it is touched, reserve generously.
+ * With large_pages the arena asks for 2 MB pages: explicit huge pages if
+ * the system has some set aside, transparent huge pages otherwise. Linux
+ * only, elsewhere large_pages is ignored.
+ */
+struct Arena {
+	u8 *base;
+	u64 used;
+	u64 capacity;
+
+	// whether the kernel agreed to large pages, see make_arena
+	bool large_pages;
+	bool hugetlb;
+};
+
+#define ARENA_DEFAULT_ALIGN 16
+#define ARENA_LARGE_PAGE_SIZE (2ull << 20)
+
+Arena make_arena(u64 capacity, bool large_pages);
+void free_arena(Arena *arena);
+
+// uninitialized memory, null once the reservation is used up
+void *arena_push(Arena *arena, u64 size, u64 align = ARENA_DEFAULT_ALIGN);
+#define ARENA_PUSH_ARRAY(arena, type, count) ((type *)arena_push((arena), (u64)(count) * sizeof(type), alignof(type) > ARENA_DEFAULT_ALIGN ? alignof(type) : ARENA_DEFAULT_ALIGN))
+
+inline u64 arena_mark(Arena *arena) {
+	return arena->used;
+}
+
+// drops everything pushed since `mark`
+inline void arena_reset(Arena *arena, u64 mark) {
+	arena->used = mark;
+}
+
+inline void arena_clear(Arena *arena) {
+	arena->used = 0;
+}
+
+inline bool arena_owns(Arena *arena, void *pointer) {
+	return (u8 *)pointer >= arena->base && (u8 *)pointer < arena->base + arena->capacity;
+}
+
+#endif
@@ -0,0 +1,655 @@
+#include "thread_pool.h"
+
+#include "bvh.h"
+#include "arena.h"
+
+#define BVH_BINS 12
+
+static AABB empty_aabb() {
+	AABB box;
+	box.min = vec3(INFINITY);
+	box.max = vec3(-INFINITY);
+	return box;
+}
+
+static void grow(AABB *box, AABB other) {
+	box->min = vec3(min(box->min.x, other.min.x), min(box->min.y, other.min.y), min(box->min.z, other.min.z));
+	box->max = vec3(max(box->max.x, other.max.x), max(box->max.y, other.max.y), max(box->max.z, other.max.z));
+}
+
+static void grow(AABB *box, v3 p) {
+	box->min = vec3(min(box->min.x, p.x), min(box->min.y, p.y), min(box->min.z, p.z));
+	box->max = vec3(max(box->max.x, p.x), max(box->max.y, p.y), max(box->max.z, p.z));
+}
+
+static f32 axis(v3 v, u32 a) {
+	return a == 0 ? v.x : (a == 1 ? v.y : v.z);
+}
+
+AABB sphere_bounds(Sphere *sphere) {
+	f32 r = fabsf(sphere->radius);
+
+	AABB box;
+	box.min = sphere->center - vec3(r);
+	box.max = sphere->center + vec3(r);
+	return box;
+}
+
+f32 aabb_area(AABB *box) {
+	v3 e = box->max - box->min;
+	if (e.x < 0) {
+		return 0;
+	}
+	return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+static void update_leaf_bounds(Bvh *bvh, Sphere *spheres, BvhNode *node) {
+	node->bounds = empty_aabb();
+	for (u32 i = 0; i < node->count; ++i) {
+		grow(&node->bounds, sphere_bounds(&spheres[bvh->indices[node->left_first + i]]));
+	}
+}
+
+static void make_leaf(Bvh *bvh, u32 node_index, u32 first, u32 count) {
+	BvhNode *node = &bvh->nodes[node_index];
+	node->left_first = first;
+	node->count = count;
+
+	for (u32 i = 0; i < count; ++i) {
+		bvh->sphere_leaf[bvh->indices[first + i]] = node_index;
+	}
+}
+
+static void build_node(Bvh *bvh, Sphere *spheres, u32 node_index, u32 first, u32 count, u32 depth) {
+	BvhNode *node = &bvh->nodes[node_index];
+
+	AABB centroids = empty_aabb();
+	node->bounds = empty_aabb();
+
+	for (u32 i = 0; i < count; ++i) {
+		Sphere *sphere = &spheres[bvh->indices[first + i]];
+		grow(&node->bounds, sphere_bounds(sphere));
+		grow(&centroids, sphere->center);
+	}
+
+	if (count <= 2 || depth >= BVH_MAX_DEPTH) {
+		make_leaf(bvh, node_index, first, count);
+		return;
+	}
+
+	// binned SAH: pick the axis and bin boundary with the lowest cost
+	f32 best_cost = INFINITY;
+	u32 best_axis = 0;
+	u32 best_split = 0;
+
+	for (u32 a = 0; a < 3; ++a) {
+		f32 lo = axis(centroids.min, a);
+		f32 hi = axis(centroids.max, a);
+		if (hi <= lo) {
+			continue;
+		}
+
+		AABB bins[BVH_BINS];
+		u32 counts[BVH_BINS] = {};
+		for (u32 b = 0; b < BVH_BINS; ++b) {
+			bins[b] = empty_aabb();
+		}
+
+		f32 scale = BVH_BINS / (hi - lo);
+		for (u32 i = 0; i < count; ++i) {
+			Sphere *sphere = &spheres[bvh->indices[first + i]];
+			u32 b = min((u32)((axis(sphere->center, a) - lo) * scale), BVH_BINS - 1);
+			counts[b]++;
+			grow(&bins[b], sphere_bounds(sphere));
+		}
+
+		// sweep from the right to get the area of every right side
+		f32 right_area[BVH_BINS];
+		u32 right_count[BVH_BINS];
+		AABB right = empty_aabb();
+		u32 rc = 0;
+		for (u32 b = BVH_BINS - 1; b > 0; --b) {
+			grow(&right, bins[b]);
+			rc += counts[b];
+			right_area[b] = aabb_area(&right);
+			right_count[b] = rc;
+		}
+
+		AABB left = empty_aabb();
+		u32 lc = 0;
+		for (u32 b = 0; b < BVH_BINS - 1; ++b) {
+			grow(&left, bins[b]);
+			lc += counts[b];
+
+			u32 split = b + 1;
+			if (lc == 0 || right_count[split] == 0) {
+				continue;
+			}
+
+			f32 cost = lc * aabb_area(&left) + right_count[split] * right_area[split];
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = a;
+				best_split = split;
+			}
+		}
+	}
+
+	f32 leaf_cost = count * aabb_area(&node->bounds);
+
+	if (best_cost == INFINITY || (best_cost >= leaf_cost && count <= BVH_MAX_LEAF_SIZE)) {
+		make_leaf(bvh, node_index, first, count);
+		return;
+	}
+
+	f32 lo = axis(centroids.min, best_axis);
+	f32 scale = BVH_BINS / (axis(centroids.max, best_axis) - lo);
+
+	u32 *indices = bvh->indices + first;
+	u32 i = 0;
+	u32 j = count;
+	while (i < j) {
+		u32 b = min((u32)((axis(spheres[indices[i]].center, best_axis) - lo) * scale), BVH_BINS - 1);
+		if (b < best_split) {
+			i++;
+		} else {
+			u32 tmp = indices[i];
+			indices[i] = indices[--j];
+			indices[j] = tmp;
+		}
+	}
+
+	u32 left_index = bvh->node_count;
+	bvh->node_count += 2;
+
+	node->left_first = left_index;
+	node->count = 0;
+
+	bvh->parents[left_index] = node_index;
+	bvh->parents[left_index + 1] = node_index;
+
+	build_node(bvh, spheres, left_index, first, i, depth + 1);
+	build_node(bvh, spheres, left_index + 1, first + i, count - i, depth + 1);
+}
+
+static void bvh_alloc(Bvh *bvh, u32 count, Arena *arena) {
+	u32 max_nodes = count ? 2 * count - 1 : 0;
+
+	bvh->in_arena = false;
+
+	if (arena) {
+		u64 mark = arena_mark(arena);
+
+		// siblings start at odd indices, shifting the 32 byte nodes by one
+		// puts every pair of them on a cache line of its own
+		BvhNode *nodes = (BvhNode *)arena_push(arena, (max_nodes + 1) * sizeof(BvhNode), 64);
+		bvh->nodes = nodes + 1;
+		bvh->indices = ARENA_PUSH_ARRAY(arena, u32, count);
+		bvh->parents = ARENA_PUSH_ARRAY(arena, u32, max_nodes);
+		bvh->sphere_leaf = ARENA_PUSH_ARRAY(arena, u32, count);
+		bvh->in_arena = nodes && bvh->indices && bvh->parents && bvh->sphere_leaf;
+
+		// too small, the tree goes to the heap like without an arena
+		if (!bvh->in_arena) {
+			arena_reset(arena, mark);
+		}
+	}
+
+	if (!bvh->in_arena) {
+		bvh->nodes = (BvhNode *)malloc(max_nodes * sizeof(BvhNode));
+		bvh->parents = (u32 *)malloc(max_nodes * sizeof(u32));
+		bvh->indices = (u32 *)malloc(count * sizeof(u32));
+		bvh->sphere_leaf = (u32 *)malloc(count * sizeof(u32));
+	}
+	bvh->prim_count = count;
+	bvh->node_count = 0;
+	bvh->linear = false;
+}
+
+void bvh_build(Bvh *bvh, Sphere *spheres, u32 count, Arena *arena) {
+	bvh_alloc(bvh, count, arena);
+
+	if (!count) {
+		return;
+	}
+
+	for (u32 i = 0; i < count; ++i) {
+		bvh->indices[i] = i;
+	}
+
+	bvh->node_count = 1;
+	bvh->parents[0] = u32_max;
+
+	build_node(bvh, spheres, 0, 0, count, 0);
+}
+
+/*
+ * Linear builder: the sphere centers are put on a Morton curve, sorted by
+ * their code and split top down where the codes first differ, which is a
+ * binary search instead of a SAH sweep. Every step runs on the pool.
+ */
+
+#define LBVH_LEAF_SIZE 4
+// 10 bits per axis up to here, 21 past it, where 2^30 cells start to get crowded
+#define LBVH_SHORT_CODES_MAX (1u << 20)
+// subtrees smaller than this are built by whoever split them off
+#define LBVH_TASK_SIZE 16384
+// smaller inputs are not worth waking the pool for
+#define LBVH_PARALLEL_MIN 65536
+#define LBVH_RADIX_BITS 8
+#define LBVH_RADIX_SIZE (1 << LBVH_RADIX_BITS)
+
+struct LbvhBuild {
+	Bvh *bvh;
+	Sphere *spheres;
+	u64 *codes;
+	ThreadPool *pool;
+	std::atomic<u32> node_count;
+};
+
+static inline u32 leading_zeros(u64 x) {
+#ifdef _MSC_VER
+	unsigned long index;
+	return _BitScanReverse64(&index, x) ? 63 - (u32)index : 64;
+#else
+	return x ? (u32)__builtin_clzll(x) : 64;
+#endif
+}
+
+// spreads the low 10 (21) bits of x out to every third bit
+static inline u64 expand_bits10(u64 x) {
+	x = (x | (x << 16)) & 0x030000FFull;
+	x = (x | (x << 8)) & 0x0300F00Full;
+	x = (x | (x << 4)) & 0x030C30C3ull;
+	x = (x | (x << 2)) & 0x09249249ull;
+	return x;
+}
+
+static inline u64 expand_bits21(u64 x) {
+	x = (x | (x << 32)) & 0x001F00000000FFFFull;
+	x = (x | (x << 16)) & 0x001F0000FF0000FFull;
+	x = (x | (x << 8)) & 0x100F00F00F00F00Full;
+	x = (x | (x << 4)) & 0x10C30C30C30C30C3ull;
+	x = (x | (x << 2)) & 0x1249249249249249ull;
+	return x;
+}
+
+// fn(first, count) over `tasks` contiguous pieces of [0, count)
+template <typename F>
+static void lbvh_for(ThreadPool *pool, u32 tasks, u32 count, F fn) {
+	u32 chunk = (count + tasks - 1) / tasks;
+
+	if (tasks == 1) {
+		fn(0u, 0u, count);
+		return;
+	}
+
+	thread_pool_run(pool, tasks, [&](u32 task) {
+		u32 first = min(task * chunk, count);
+		u32 last = min(first + chunk, count);
+		fn(task, first, last - first);
+	});
+}
+
+// Least significant digit first, every pass counts the digits of each
+// task's piece, turns the counts into where every task writes each digit
+// and scatters, which keeps equal keys in order. Passes where all keys share
+// the digit are skipped. The result ends up in keys/values.
+static void radix_sort(ThreadPool *pool, u32 tasks, u64 *keys, u32 *values, u64 *keys_tmp, u32 *values_tmp, u32 count, u32 key_bits) {
+	u32 *offsets = (u32 *)malloc(tasks * LBVH_RADIX_SIZE * sizeof(u32));
+	u64 *keys_out = keys;
+	u32 *values_out = values;
+
+	for (u32 shift = 0; shift < key_bits; shift += LBVH_RADIX_BITS) {
+		memset(offsets, 0, tasks * LBVH_RADIX_SIZE * sizeof(u32));
+
+		lbvh_for(pool, tasks, count, [&](u32 task, u32 first, u32 n) {
+			u32 *counts = offsets + task * LBVH_RADIX_SIZE;
+			for (u32 i = first; i < first + n; ++i) {
+				counts[(keys[i] >> shift) & (LBVH_RADIX_SIZE - 1)]++;
+			}
+		});
+
+		bool skip = false;
+		u32 sum = 0;
+		for (u32 d = 0; d < LBVH_RADIX_SIZE; ++d) {
+			u32 digit_count = 0;
+			for (u32 t = 0; t < tasks; ++t) {
+				u32 c = offsets[t * LBVH_RADIX_SIZE + d];
+				offsets[t * LBVH_RADIX_SIZE + d] = sum;
+				sum += c;
+				digit_count += c;
+			}
+			skip |= digit_count == count;
+		}
+
+		if (skip) {
+			continue;
+		}
+
+		lbvh_for(pool, tasks, count, [&](u32 task, u32 first, u32 n) {
+			u32 *next = offsets + task * LBVH_RADIX_SIZE;
+			for (u32 i = first; i < first + n; ++i) {
+				u32 to = next[(keys[i] >> shift) & (LBVH_RADIX_SIZE - 1)]++;
+				keys_tmp[to] = keys[i];
+				values_tmp[to] = values[i];
+			}
+		});
+
+		u64 *k = keys;
+		keys = keys_tmp;
+		keys_tmp = k;
+
+		u32 *v = values;
+		values = values_tmp;
+		values_tmp = v;
+	}
+
+	// an odd number of passes left the result in the other buffers
+	if (keys != keys_out) {
+		memcpy(keys_out, keys, count * sizeof(u64));
+		memcpy(values_out, values, count * sizeof(u32));
+	}
+
+	free(offsets);
+}
+
+// last index of the left half: the last code that still has the bit set
+// where codes[first] and codes[last] first differ cleared, the middle if
+// they are all the same
+static u32 lbvh_split(u64 *codes, u32 first, u32 last) {
+	u64 first_code = codes[first];
+	u64 last_code = codes[last];
+
+	if (first_code == last_code) {
+		return (first + last) >> 1;
+	}
+
+	u32 prefix = leading_zeros(first_code ^ last_code);
+	u32 split = first;
+	u32 step = last - first;
+
+	do {
+		step = (step + 1) >> 1;
+		u32 candidate = split + step;
+		if (candidate < last && leading_zeros(first_code ^ codes[candidate]) > prefix) {
+			split = candidate;
+		}
+	} while (step > 1);
+
+	return split;
+}
+
+static void lbvh_node(LbvhBuild *build, u32 node_index, u32 first, u32 count, u32 depth) {
+	Bvh *bvh = build->bvh;
+	BvhNode *node = &bvh->nodes[node_index];
+
+	if (count <= LBVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH) {
+		make_leaf(bvh, node_index, first, count);
+		update_leaf_bounds(bvh, build->spheres, node);
+		return;
+	}
+
+	u32 split = lbvh_split(build->codes, first, first + count - 1) + 1 - first;
+	u32 left_index = build->node_count.fetch_add(2);
+
+	node->left_first = left_index;
+	node->count = 0;
+
+	bvh->parents[left_index] = node_index;
+	bvh->parents[left_index + 1] = node_index;
+
+	// the left half goes to the pool, this thread goes on with the right
+	if (build->pool && count >= LBVH_TASK_SIZE) {
+		TaskGroup group;
+		thread_pool_submit(build->pool, &group, [=]() {
+			lbvh_node(build, left_index, first, split, depth + 1);
+		});
+		lbvh_node(build, left_index + 1, first + split, count - split, depth + 1);
+		thread_pool_wait(build->pool, &group);
+	} else {
+		lbvh_node(build, left_index, first, split, depth + 1);
+		lbvh_node(build, left_index + 1, first + split, count - split, depth + 1);
+	}
+
+	node->bounds = bvh->nodes[left_index].bounds;
+	grow(&node->bounds, bvh->nodes[left_index + 1].bounds);
+}
+
+void bvh_build_linear(Bvh *bvh, Sphere *spheres, u32 count, ThreadPool *pool, Arena *arena) {
+	bvh_alloc(bvh, count, arena);
+	bvh->linear = true;
+
+	if (!count) {
+		return;
+	}
+
+	// the calling thread helps while waiting on the pool
+	u32 tasks = pool && count >= LBVH_PARALLEL_MIN ? (u32)pool->threads.size() + 1 : 1;
+	if (tasks == 1) {
+		pool = 0;
+	}
+
+	AABB *task_bounds = (AABB *)malloc(tasks * sizeof(AABB));
+	lbvh_for(pool, tasks, count, [&](u32 task, u32 first, u32 n) {
+		AABB centroids = empty_aabb();
+		for (u32 i = first; i < first + n; ++i) {
+			grow(&centroids, spheres[i].center);
+		}
+		task_bounds[task] = centroids;
+	});
+
+	AABB centroids = empty_aabb();
+	for (u32 t = 0; t < tasks; ++t) {
+		grow(&centroids, task_bounds[t]);
+	}
+	free(task_bounds);
+
+	bool short_codes = count <= LBVH_SHORT_CODES_MAX;
+	u32 axis_bits = short_codes ? 10 : 21;
+	f32 cells = (f32)((1u << axis_bits) - 1);
+
+	v3 extent = centroids.max - centroids.min;
+	v3 scale = vec3(extent.x > 0 ? cells / extent.x : 0, extent.y > 0 ? cells / extent.y : 0, extent.z > 0 ? cells / extent.z : 0);
+
+	u64 *codes = (u64 *)malloc(2 * (u64)count * sizeof(u64));
+	u32 *values_tmp = (u32 *)malloc(count * sizeof(u32));
+
+	lbvh_for(pool, tasks, count, [&](u32 task, u32 first, u32 n) {
+		for (u32 i = first; i < first + n; ++i) {
+			v3 p = (spheres[i].center - centroids.min) * scale;
+			u64 x = (u64)min(max(p.x, 0.0f), cells);
+			u64 y = (u64)min(max(p.y, 0.0f), cells);
+			u64 z = (u64)min(max(p.z, 0.0f), cells);
+
+			if (short_codes) {
+				codes[i] = (expand_bits10(x) << 2) | (expand_bits10(y) << 1) | expand_bits10(z);
+			} else {
+				codes[i] = (expand_bits21(x) << 2) | (expand_bits21(y) << 1) | expand_bits21(z);
+			}
+			bvh->indices[i] = i;
+		}
+	});
+
+	radix_sort(pool, tasks, codes, bvh->indices, codes + count, values_tmp, count, 3 * axis_bits);
+	free(values_tmp);
+
+	LbvhBuild build;
+	build.bvh = bvh;
+	build.spheres = spheres;
+	build.codes = codes;
+	build.pool = pool;
+	build.node_count = 1;
+
+	bvh->parents[0] = u32_max;
+	lbvh_node(&build, 0, 0, count, 0);
+	bvh->node_count = build.node_count;
+
+	free(codes);
+}
+
+u64 bvh_arena_size(u32 count) {
+	u64 max_nodes = count ? 2 * (u64)count - 1 : 0;
+	return (max_nodes + 1) * sizeof(BvhNode) + (2 * count + max_nodes) * sizeof(u32) + 64 + 3 * ARENA_DEFAULT_ALIGN;
+}
+
+void bvh_free(Bvh *bvh) {
+	if (!bvh->in_arena) {
+		free(bvh->nodes);
+		free(bvh->parents);
+		free(bvh->indices);
+		free(bvh->sphere_leaf);
+	}
+
+	*bvh = {};
+}
+
+Bvh bvh_copy(Bvh *bvh) {
+	Bvh copy = *bvh;
+	copy.in_arena = false;
+
+	copy.nodes = (BvhNode *)malloc(bvh->node_count * sizeof(BvhNode));
+	copy.parents = (u32 *)malloc(bvh->node_count * sizeof(u32));
+	copy.indices = (u32 *)malloc(bvh->prim_count * sizeof(u32));
+	copy.sphere_leaf = (u32 *)malloc(bvh->prim_count * sizeof(u32));
+
+	memcpy(copy.nodes, bvh->nodes, bvh->node_count * sizeof(BvhNode));
+	memcpy(copy.parents, bvh->parents, bvh->node_count * sizeof(u32));
+	memcpy(copy.indices, bvh->indices, bvh->prim_count * sizeof(u32));
+	memcpy(copy.sphere_leaf, bvh->sphere_leaf, bvh->prim_count * sizeof(u32));
+
+	return copy;
+}
+
+void bvh_refit_sphere(Bvh *bvh, Sphere *spheres, u32 sphere_index) {
+	u32 node_index = bvh->sphere_leaf[sphere_index];
+	update_leaf_bounds(bvh, spheres, &bvh->nodes[node_index]);
+
+	node_index = bvh->parents[node_index];
+	while (node_index != u32_max) {
+		BvhNode *node = &bvh->nodes[node_index];
+
+		node->bounds = bvh->nodes[node->left_first].bounds;
+		grow(&node->bounds, bvh->nodes[node->left_first + 1].bounds);
+
+		node_index = bvh->parents[node_index];
+	}
+}
+
+void bvh_refit(Bvh *bvh, Sphere *spheres) {
+	// children are always allocated after their parent
+	for (u32 i = bvh->node_count; i-- > 0;) {
+		BvhNode *node = &bvh->nodes[i];
+
+		if (node->count) {
+			update_leaf_bounds(bvh, spheres, node);
+		} else {
+			node->bounds = bvh->nodes[node->left_first].bounds;
+			grow(&node->bounds, bvh->nodes[node->left_first + 1].bounds);
+		}
+	}
+}
+
+// entry distance of the ray into the box, INFINITY on a miss or beyond t_max
+static inline f32 intersect_aabb(AABB *box, v3 ro, v3 inv_rd, f32 t_max) {
+	f32 tx0 = (box->min.x - ro.x) * inv_rd.x;
+	f32 tx1 = (box->max.x - ro.x) * inv_rd.x;
+	f32 ty0 = (box->min.y - ro.y) * inv_rd.y;
+	f32 ty1 = (box->max.y - ro.y) * inv_rd.y;
+	f32 tz0 = (box->min.z - ro.z) * inv_rd.z;
+	f32 tz1 = (box->max.z - ro.z) * inv_rd.z;
+
+	f32 t_enter = max(max(min(tx0, tx1), min(ty0, ty1)), min(tz0, tz1));
+	f32 t_exit = min(min(max(tx0, tx1), max(ty0, ty1)), max(tz0, tz1));
+
+	if (t_exit < t_enter || t_exit < 0 || t_enter >= t_max) {
+		return INFINITY;
+	}
+
+	return t_enter;
+}
+
+// front to back over the leaves the ray reaches before *t, leaf(index)
+// tests one primitive and lowers *t if it is closer
+template <typename F>
+static bool bvh_traverse(Bvh *bvh, v3 ro, v3 rd, f32 *t, F leaf) {
+	if (!bvh->node_count) {
+		return false;
+	}
+
+	v3 inv_rd = vec3(1.0f / rd.x, 1.0f / rd.y, 1.0f / rd.z);
+	bool found = false;
+
+	if (intersect_aabb(&bvh->nodes[0].bounds, ro, inv_rd, *t) == INFINITY) {
+		return false;
+	}
+
+	u32 stack[BVH_MAX_DEPTH + 4];
+	u32 sp = 0;
+	u32 node_index = 0;
+
+	for (;;) {
+		BvhNode *node = &bvh->nodes[node_index];
+
+		if (node->count) {
+			for (u32 i = 0; i < node->count; ++i) {
+				found |= leaf(bvh->indices[node->left_first + i]);
+			}
+		} else {
+			u32 near = node->left_first;
+			u32 far = near + 1;
+
+			f32 t_near = intersect_aabb(&bvh->nodes[near].bounds, ro, inv_rd, *t);
+			f32 t_far = intersect_aabb(&bvh->nodes[far].bounds, ro, inv_rd, *t);
+
+			if (t_far < t_near) {
+				f32 tt = t_near; t_near = t_far; t_far = tt;
+				u32 tn = near; near = far; far = tn;
+			}
+
+			if (t_near != INFINITY) {
+				if (t_far != INFINITY) {
+					stack[sp++] = far;
+				}
+				node_index = near;
+				continue;
+			}
+		}
+
+		if (sp == 0) {
+			break;
+		}
+		node_index = stack[--sp];
+	}
+
+	return found;
+}
+
+bool bvh_intersect(Bvh *bvh, Sphere *spheres, v3 ro, v3 rd, f32 *t, u32 *sphere_index) {
+	return bvh_traverse(bvh, ro, rd, t, [&](u32 index) {
+		f32 ts;
+		if (intersect_sphere(&spheres[index], ro, rd, &ts) && ts > MIN_DIST && ts < *t) {
+			*t = ts;
+			*sphere_index = index;
+			return true;
+		}
+		return false;
+	});
+}
+
+bool bvh_intersect_instances(Scene *scene, v3 ro, v3 rd, f32 *t, u32 *instance_index, u32 *sphere_index) {
+	return bvh_traverse(scene->instance_bvh, ro, rd, t, [&](u32 index) {
+		Instance *instance = &scene->instances[index];
+		Object *object = &scene->objects[instance->object];
+
+		// not normalized, so t means the same in both spaces
+		v3 oro = instance->inv_x * ro.x + instance->inv_y * ro.y + instance->inv_z * ro.z + instance->inv_position;
+		v3 ord = instance->inv_x * rd.x + instance->inv_y * rd.y + instance->inv_z * rd.z;
+
+		if (bvh_intersect(object->bvh, object->spheres, oro, ord, t, sphere_index)) {
+			*instance_index = index;
+			return true;
+		}
+		return false;
+	});
+}
@@ -0,0 +1,72 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "raycaster.h"
+
+/*
+ * Binary bounding volume hierarchy over Scene::spheres (or an object's, or
+ * the bounding spheres of the instances), built with binned SAH or along a
+ * Morton curve (bvh_build_linear).
+ * Siblings are stored next to each other, so an interior node only keeps the
+ * index of its left child. Leaves reference a range of `indices`, which maps
+ * back into the sphere array, the spheres themselves are never reordered.
+ */
+
+#define BVH_MAX_DEPTH 60
+#define BVH_MAX_LEAF_SIZE 8
+
+struct AABB {
+	v3 min;
+	v3 max;
+};
+
+struct BvhNode {
+	AABB bounds;
+	u32 left_first; // left child for interior nodes, first index for leaves
+	u32 count;      // 0 for interior nodes
+};
+
+struct Bvh {
+	BvhNode *nodes;
+	u32 node_count;
+
+	u32 *indices;
+	u32 prim_count;
+
+	// for refitting single spheres without touching the rest of the tree
+	u32 *parents;
+	u32 *sphere_leaf;
+
+	// the arrays belong to an arena, bvh_free leaves them alone
+	bool in_arena;
+	// built by bvh_build_linear
+	bool linear;
+};
+
+// the arrays come from `arena` if it is set
+void bvh_build(Bvh *bvh, Sphere *spheres, u32 count, Arena *arena = 0);
+// Morton code order instead of SAH, a fraction of the build time for
+// somewhat slower traversal. Parallel on `pool` if it is set, for scenes
+// that are rebuilt every frame or have to show something quickly.
+void bvh_build_linear(Bvh *bvh, Sphere *spheres, u32 count, ThreadPool *pool, Arena *arena = 0);
+// what either build pushes for `count` spheres, alignment included
+u64 bvh_arena_size(u32 count);
+void bvh_free(Bvh *bvh);
+Bvh bvh_copy(Bvh *bvh);
+
+// updates the bounds on the path from the sphere's leaf to the root
+void bvh_refit_sphere(Bvh *bvh, Sphere *spheres, u32 sphere_index);
+void bvh_refit(Bvh *bvh, Sphere *spheres);
+
+AABB sphere_bounds(Sphere *sphere);
+f32 aabb_area(AABB *box);
+
+// closest hit of the ray against the spheres in the hierarchy, t stays
+// untouched and false is returned if nothing is closer than *t
+bool bvh_intersect(Bvh *bvh, Sphere *spheres, v3 ro, v3 rd, f32 *t, u32 *sphere_index);
+
+// the same through Scene::instance_bvh and each instance's object, the ray
+// goes into object space for the spheres, t is the same along it in both
+bool bvh_intersect_instances(Scene *scene, v3 ro, v3 rd, f32 *t, u32 *instance_index, u32 *sphere_index);
+
+#endif
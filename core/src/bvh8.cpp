@@ -0,0 +1,315 @@
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "bvh8.h"
+
+static_assert(sizeof(Bvh8Node) == 96, "a wide node should stay at two cache lines");
+
+static Bvh8Node *alloc_nodes(u32 count) {
+	u64 size = (u64)count * sizeof(Bvh8Node);
+#ifdef _WIN32
+	return (Bvh8Node *)_aligned_malloc(size, alignof(Bvh8Node));
+#else
+	return (Bvh8Node *)aligned_alloc(alignof(Bvh8Node), size);
+#endif
+}
+
+static void free_nodes(Bvh8Node *nodes) {
+#ifdef _WIN32
+	_aligned_free(nodes);
+#else
+	free(nodes);
+#endif
+}
+
+static f32 axis_of(v3 v, u32 a) {
+	return a == 0 ? v.x : (a == 1 ? v.y : v.z);
+}
+
+static inline f32 exp2_of(s32 exponent) {
+	u32 bits = (u32)(exponent + 127) << 23;
+	f32 f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+// smallest step that covers `extent` in 255 of them, within normal floats
+static s8 step_exponent(f32 extent) {
+	s32 exponent = -126;
+	if (extent > 0) {
+		frexpf(extent / 255.0f, &exponent);
+	}
+	return (s8)min(max(exponent, -126), 127);
+}
+
+static void quantize_child(Bvh8Node *node, u32 slot, AABB *box) {
+	for (u32 a = 0; a < 3; ++a) {
+		f32 origin = axis_of(node->origin, a);
+		f32 step = exp2_of(node->exponent[a]);
+		f32 lo = axis_of(box->min, a);
+		f32 hi = axis_of(box->max, a);
+
+		s32 qlo = (s32)floorf((lo - origin) / step);
+		s32 qhi = (s32)ceilf((hi - origin) / step);
+		qlo = min(max(qlo, 0), 255);
+		qhi = min(max(qhi, 0), 255);
+
+		// the division may have rounded inwards
+		while (qlo > 0 && origin + qlo * step > lo) {
+			qlo--;
+		}
+		while (qhi < 255 && origin + qhi * step < hi) {
+			qhi++;
+		}
+
+		node->bounds[a][slot] = (u8)qlo;
+		node->bounds[a + 3][slot] = (u8)qhi;
+	}
+}
+
+// Opens the binary children with the largest area until eight are
+// collected or only leaves are left, children come after their parent.
+static u32 collapse(Bvh8 *wide, Bvh *bvh, u32 binary_index) {
+	u32 node_index = wide->node_count++;
+	BvhNode *binary = &bvh->nodes[binary_index];
+
+	u32 slots[BVH8_WIDTH];
+	u32 count = 0;
+
+	if (binary->count) {
+		slots[count++] = binary_index;
+	} else {
+		slots[count++] = binary->left_first;
+		slots[count++] = binary->left_first + 1;
+	}
+
+	while (count < BVH8_WIDTH) {
+		s32 best = -1;
+		f32 best_area = -1;
+
+		for (u32 i = 0; i < count; ++i) {
+			BvhNode *child = &bvh->nodes[slots[i]];
+			f32 area = aabb_area(&child->bounds);
+			if (!child->count && area > best_area) {
+				best = i;
+				best_area = area;
+			}
+		}
+
+		if (best < 0) {
+			break;
+		}
+
+		u32 left = bvh->nodes[slots[best]].left_first;
+		slots[best] = left;
+		slots[count++] = left + 1;
+	}
+
+	Bvh8Node *node = &wide->nodes[node_index];
+	AABB *bounds = &binary->bounds;
+	v3 extent = bounds->max - bounds->min;
+
+	node->origin = bounds->min;
+	node->exponent[0] = step_exponent(extent.x);
+	node->exponent[1] = step_exponent(extent.y);
+	node->exponent[2] = step_exponent(extent.z);
+	node->child_count = (u8)count;
+
+	for (u32 i = 0; i < BVH8_WIDTH; ++i) {
+		if (i >= count) {
+			// never tested, child_count masks them out
+			for (u32 p = 0; p < 6; ++p) {
+				node->bounds[p][i] = 0;
+			}
+			node->children[i] = BVH8_LEAF;
+			continue;
+		}
+
+		quantize_child(node, i, &bvh->nodes[slots[i]].bounds);
+	}
+
+	for (u32 i = 0; i < count; ++i) {
+		u32 slot = slots[i];
+		u32 child = bvh->nodes[slot].count ? BVH8_LEAF | slot : collapse(wide, bvh, slot);
+		// the recursion does not reallocate, the pointer is still good
+		wide->nodes[node_index].children[i] = child;
+	}
+
+	return node_index;
+}
+
+void bvh8_build(Bvh8 *wide, Bvh *bvh) {
+	// every wide node uses up at least one binary interior node
+	u32 interior = bvh->node_count / 2;
+	u32 capacity = max(interior, 1u);
+
+	if (capacity > wide->capacity) {
+		free_nodes(wide->nodes);
+		wide->nodes = alloc_nodes(capacity);
+		wide->capacity = capacity;
+	}
+
+	wide->node_count = 0;
+
+	if (bvh->node_count) {
+		collapse(wide, bvh, 0);
+	}
+}
+
+void bvh8_free(Bvh8 *wide) {
+	free_nodes(wide->nodes);
+	*wide = {};
+}
+
+Bvh8 bvh8_copy(Bvh8 *wide) {
+	Bvh8 copy = *wide;
+	copy.capacity = max(wide->node_count, 1u);
+	copy.nodes = alloc_nodes(copy.capacity);
+	memcpy(copy.nodes, wide->nodes, wide->node_count * sizeof(Bvh8Node));
+	return copy;
+}
+
+struct Bvh8Ray {
+	v3 ro;
+	v3 inv_rd;
+	// which row of Bvh8Node::bounds holds the near and far plane per axis
+	u32 near[3];
+	u32 far[3];
+};
+
+// entry distances of the children the ray reaches before t_max, as a bit mask
+static inline u32 intersect_children(Bvh8Node *node, Bvh8Ray *ray, f32 t_max, f32 *t_enter) {
+#ifdef __AVX2__
+	__m256 enter = _mm256_setzero_ps();
+	__m256 exit = _mm256_set1_ps(INFINITY);
+
+	for (u32 a = 0; a < 3; ++a) {
+		__m256 step = _mm256_set1_ps(exp2_of(node->exponent[a]));
+		__m256 offset = _mm256_set1_ps(axis_of(node->origin, a) - axis_of(ray->ro, a));
+		__m256 inv = _mm256_set1_ps(axis_of(ray->inv_rd, a));
+
+		__m256 qn = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)node->bounds[ray->near[a]])));
+		__m256 qf = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)node->bounds[ray->far[a]])));
+
+		__m256 tn = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(qn, step), offset), inv);
+		__m256 tf = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(qf, step), offset), inv);
+
+		enter = _mm256_max_ps(enter, tn);
+		exit = _mm256_min_ps(exit, tf);
+	}
+
+	// the same conditions as the binary tree's box test, entry clamped at 0
+	__m256 hit = _mm256_and_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ), _mm256_cmp_ps(enter, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+	_mm256_storeu_ps(t_enter, enter);
+
+	return (u32)_mm256_movemask_ps(hit) & ((1u << node->child_count) - 1);
+#else
+	u32 mask = 0;
+
+	for (u32 i = 0; i < node->child_count; ++i) {
+		f32 enter = 0;
+		f32 exit = INFINITY;
+
+		for (u32 a = 0; a < 3; ++a) {
+			f32 step = exp2_of(node->exponent[a]);
+			f32 offset = axis_of(node->origin, a) - axis_of(ray->ro, a);
+			f32 inv = axis_of(ray->inv_rd, a);
+
+			f32 tn = (node->bounds[ray->near[a]][i] * step + offset) * inv;
+			f32 tf = (node->bounds[ray->far[a]][i] * step + offset) * inv;
+
+			enter = max(enter, tn);
+			exit = min(exit, tf);
+		}
+
+		t_enter[i] = enter;
+		if (enter <= exit && enter < t_max) {
+			mask |= 1u << i;
+		}
+	}
+
+	return mask;
+#endif
+}
+
+static inline u32 lowest_bit(u32 mask) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (u32)index;
+#else
+	return (u32)__builtin_ctz(mask);
+#endif
+}
+
+struct Bvh8Entry {
+	u32 child;
+	f32 t;
+};
+
+bool bvh8_intersect(Bvh8 *wide, Bvh *bvh, Sphere *spheres, v3 ro, v3 rd, f32 *t, u32 *sphere_index) {
+	if (!wide->node_count) {
+		return false;
+	}
+
+	Bvh8Ray ray;
+	ray.ro = ro;
+	ray.inv_rd = vec3(1.0f / rd.x, 1.0f / rd.y, 1.0f / rd.z);
+	for (u32 a = 0; a < 3; ++a) {
+		bool negative = axis_of(ray.inv_rd, a) < 0;
+		ray.near[a] = negative ? a + 3 : a;
+		ray.far[a] = negative ? a : a + 3;
+	}
+
+	// every level leaves at most seven siblings behind
+	Bvh8Entry stack[(BVH8_WIDTH - 1) * BVH_MAX_DEPTH + BVH8_WIDTH];
+	u32 sp = 0;
+	stack[sp++] = { 0, 0 };
+
+	bool found = false;
+
+	while (sp) {
+		Bvh8Entry entry = stack[--sp];
+		if (entry.t >= *t) {
+			continue;
+		}
+
+		if (entry.child & BVH8_LEAF) {
+			BvhNode *leaf = &bvh->nodes[entry.child & ~BVH8_LEAF];
+
+			for (u32 i = 0; i < leaf->count; ++i) {
+				u32 index = bvh->indices[leaf->left_first + i];
+				f32 ts;
+
+				if (intersect_sphere(&spheres[index], ro, rd, &ts) && ts > MIN_DIST && ts < *t) {
+					*t = ts;
+					*sphere_index = index;
+					found = true;
+				}
+			}
+			continue;
+		}
+
+		Bvh8Node *node = &wide->nodes[entry.child];
+		alignas(32) f32 t_enter[BVH8_WIDTH];
+		u32 mask = intersect_children(node, &ray, *t, t_enter);
+
+		// far to near, so the nearest child is popped next
+		u32 first = sp;
+		while (mask) {
+			u32 i = lowest_bit(mask);
+			mask &= mask - 1;
+
+			Bvh8Entry child = { node->children[i], t_enter[i] };
+			u32 j = sp++;
+			while (j > first && stack[j - 1].t < child.t) {
+				stack[j] = stack[j - 1];
+				j--;
+			}
+			stack[j] = child;
+		}
+	}
+
+	return found;
+}
@@ -0,0 +1,57 @@
+#ifndef BVH8_H
+#define BVH8_H
+
+#include "bvh.h"
+
+/*
+ * Eight wide bounding volume hierarchy collapsed from a binary Bvh. A node
+ * keeps the boxes of up to eight children in 8 bits per plane, as steps of
+ * a power of two from the corner of its own box, so the whole node is 96
+ * bytes and two cache lines. Rounding is always outwards, a quantized box
+ * contains the exact one.
+ *
+ * With AVX2 (-mavx2) all children are tested at once, otherwise in a loop.
+ * Leaves are the binary tree's, children reference them and the spheres
+ * are found through its `indices`, so it has to stay alive and unchanged
+ * while the wide tree is used.
+ */
+
+#define BVH8_WIDTH 8
+
+// Only with AVX2 is the wide tree faster than the binary one, scene_update
+// builds it then for scenes of at least this many spheres. The collapse
+// runs again after every rebuild and refit, it is linear in the tree size.
+#ifdef __AVX2__
+#define BVH8_SCENES 1
+#endif
+#define BVH8_MIN_SPHERES 64
+// set on a child that is a leaf of the binary tree, the rest is its node index
+#define BVH8_LEAF 0x80000000u
+
+struct alignas(32) Bvh8Node {
+	v3 origin;
+	// a quantization step is 2^exponent along each axis
+	s8 exponent[3];
+	u8 child_count;
+
+	// lo x, y, z then hi x, y, z of every child
+	u8 bounds[6][BVH8_WIDTH];
+	u32 children[BVH8_WIDTH];
+};
+
+struct Bvh8 {
+	Bvh8Node *nodes;
+	u32 node_count;
+	u32 capacity;
+};
+
+// collapses `bvh` again after every rebuild or refit of it, the nodes are
+// reused if there is room
+void bvh8_build(Bvh8 *wide, Bvh *bvh);
+void bvh8_free(Bvh8 *wide);
+Bvh8 bvh8_copy(Bvh8 *wide);
+
+// same contract as bvh_intersect, `bvh` is the tree it was collapsed from
+bool bvh8_intersect(Bvh8 *wide, Bvh *bvh, Sphere *spheres, v3 ro, v3 rd, f32 *t, u32 *sphere_index);
+
+#endif
@@ -0,0 +1,281 @@
+#include "checkpoint.h"
+
+#define CHECKPOINT_MAGIC 0x50435452 // "RTCP"
+#define CHECKPOINT_VERSION 1
+
+#define CHECKPOINT_PER_PIXEL_SAMPLES 1
+
+#define SLICE_MAGIC 0x534C5452 // "RTLS"
+#define SLICE_VERSION 1
+
+// stored in native byte order, checkpoints are not meant to move between machines
+struct CheckpointHeader {
+	u32 magic;
+	u32 version;
+	u64 scene_hash;
+
+	u32 width;
+	u32 height;
+	u32 tile_count;
+	u32 samples_done;
+	u32 passes;
+	u32 flags;
+};
+
+static u64 fnv1a(u64 hash, const void *data, u64 size) {
+	const u8 *bytes = (const u8 *)data;
+
+	for (u64 i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ull;
+	}
+
+	return hash;
+}
+
+u64 hash_render(Scene *scene, RayCastConfig *config) {
+	u64 hash = 0xCBF29CE484222325ull;
+
+	hash = fnv1a(hash, scene->spheres, scene->num_spheres * sizeof(Sphere));
+	hash = fnv1a(hash, scene->planes, scene->num_planes * sizeof(Plane));
+
+	// nothing for scenes without instances, their hashes stay what they were
+	for (u32 i = 0; i < scene->num_objects; ++i) {
+		hash = fnv1a(hash, scene->objects[i].spheres, scene->objects[i].num_spheres * sizeof(Sphere));
+	}
+	for (u32 i = 0; i < scene->num_instances; ++i) {
+		Instance *instance = &scene->instances[i];
+		hash = fnv1a(hash, &instance->object, sizeof(u32));
+		hash = fnv1a(hash, &instance->material_index, sizeof(u32));
+		hash = fnv1a(hash, &instance->x, 4 * sizeof(v3));
+	}
+
+	for (u32 i = 0; i < scene->num_materials; ++i) {
+		hash = fnv1a(hash, &scene->materials[i].kind, sizeof(u32));
+		hash = fnv1a(hash, &scene->materials[i].albedo, sizeof(v3));
+	}
+
+	hash = fnv1a(hash, &scene->camera, sizeof(Camera));
+
+	hash = fnv1a(hash, &config->width, sizeof(u32));
+	hash = fnv1a(hash, &config->height, sizeof(u32));
+	hash = fnv1a(hash, &config->rays_per_pixel, sizeof(u32));
+	hash = fnv1a(hash, &config->max_bounces, sizeof(u32));
+	hash = fnv1a(hash, &config->samples_per_pass, sizeof(u32));
+	hash = fnv1a(hash, &config->sky_color, sizeof(v3));
+	hash = fnv1a(hash, &config->seed, sizeof(u32));
+	hash = fnv1a(hash, &config->sample_offset, sizeof(u32));
+
+	return hash;
+}
+
+u64 hash_slice(Scene *scene, RayCastConfig *config) {
+	RayCastConfig key = *config;
+	key.rays_per_pixel = 0;
+	key.samples_per_pass = 0;
+	key.sample_offset = 0;
+
+	return hash_render(scene, &key);
+}
+
+Checkpoint make_checkpoint(u32 width, u32 height, u32 tile_count) {
+	Checkpoint checkpoint;
+
+	checkpoint.scene_hash = 0;
+	checkpoint.width = width;
+	checkpoint.height = height;
+	checkpoint.tile_count = tile_count;
+	checkpoint.samples_done = 0;
+	checkpoint.passes = 0;
+
+	checkpoint.tile_randoms = (Random *)malloc(tile_count * sizeof(Random));
+	checkpoint.color = (v3 *)malloc(width * height * sizeof(v3));
+	checkpoint.samples = (u32 *)malloc(width * height * sizeof(u32));
+
+	return checkpoint;
+}
+
+void free_checkpoint(Checkpoint *checkpoint) {
+	free(checkpoint->tile_randoms);
+	free(checkpoint->color);
+	free(checkpoint->samples);
+
+	checkpoint->tile_randoms = 0;
+	checkpoint->color = 0;
+	checkpoint->samples = 0;
+}
+
+bool write_checkpoint(const char *path, Checkpoint *checkpoint) {
+	u32 pixels = checkpoint->width * checkpoint->height;
+
+	CheckpointHeader header;
+	header.magic = CHECKPOINT_MAGIC;
+	header.version = CHECKPOINT_VERSION;
+	header.scene_hash = checkpoint->scene_hash;
+	header.width = checkpoint->width;
+	header.height = checkpoint->height;
+	header.tile_count = checkpoint->tile_count;
+	header.samples_done = checkpoint->samples_done;
+	header.passes = checkpoint->passes;
+	header.flags = 0;
+
+	// between full passes every pixel has the same count, no need to store it
+	for (u32 i = 0; i < pixels; ++i) {
+		if (checkpoint->samples[i] != checkpoint->samples_done) {
+			header.flags |= CHECKPOINT_PER_PIXEL_SAMPLES;
+			break;
+		}
+	}
+
+	char tmp_path[1024];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	FILE *file = fopen(tmp_path, "wb");
+	if (!file) {
+		return false;
+	}
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && fwrite(checkpoint->tile_randoms, sizeof(Random), checkpoint->tile_count, file) == checkpoint->tile_count;
+	ok = ok && fwrite(checkpoint->color, sizeof(v3), pixels, file) == pixels;
+
+	if (header.flags & CHECKPOINT_PER_PIXEL_SAMPLES) {
+		ok = ok && fwrite(checkpoint->samples, sizeof(u32), pixels, file) == pixels;
+	}
+
+	ok = (fclose(file) == 0) && ok;
+	ok = ok && rename(tmp_path, path) == 0;
+
+	if (!ok) {
+		remove(tmp_path);
+	}
+
+	return ok;
+}
+
+bool read_checkpoint(const char *path, Checkpoint *checkpoint) {
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		return false;
+	}
+
+	CheckpointHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+		header.magic != CHECKPOINT_MAGIC ||
+		header.version != CHECKPOINT_VERSION) {
+		fclose(file);
+		return false;
+	}
+
+	*checkpoint = make_checkpoint(header.width, header.height, header.tile_count);
+	checkpoint->scene_hash = header.scene_hash;
+	checkpoint->samples_done = header.samples_done;
+	checkpoint->passes = header.passes;
+
+	u32 pixels = header.width * header.height;
+
+	bool ok = fread(checkpoint->tile_randoms, sizeof(Random), header.tile_count, file) == header.tile_count;
+	ok = ok && fread(checkpoint->color, sizeof(v3), pixels, file) == pixels;
+
+	if (header.flags & CHECKPOINT_PER_PIXEL_SAMPLES) {
+		ok = ok && fread(checkpoint->samples, sizeof(u32), pixels, file) == pixels;
+	} else {
+		for (u32 i = 0; i < pixels; ++i) {
+			checkpoint->samples[i] = header.samples_done;
+		}
+	}
+
+	fclose(file);
+
+	if (!ok) {
+		free_checkpoint(checkpoint);
+	}
+
+	return ok;
+}
+
+struct SliceHeader {
+	u32 magic;
+	u32 version;
+	u64 render_hash;
+
+	u32 width;
+	u32 height;
+	u32 first_sample;
+	u32 sample_count;
+};
+
+bool write_sample_slice(const char *path, SampleSlice *slice) {
+	u32 pixels = slice->fb.width * slice->fb.height;
+
+	SliceHeader header;
+	header.magic = SLICE_MAGIC;
+	header.version = SLICE_VERSION;
+	header.render_hash = slice->render_hash;
+	header.width = slice->fb.width;
+	header.height = slice->fb.height;
+	header.first_sample = slice->first_sample;
+	header.sample_count = slice->sample_count;
+
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		return false;
+	}
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && fwrite(slice->fb.color, sizeof(v3), pixels, file) == pixels;
+	ok = ok && fwrite(slice->fb.samples, sizeof(u32), pixels, file) == pixels;
+
+	ok = (fclose(file) == 0) && ok;
+	return ok;
+}
+
+bool read_sample_slice(const char *path, SampleSlice *slice) {
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		return false;
+	}
+
+	SliceHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+		header.magic != SLICE_MAGIC ||
+		header.version != SLICE_VERSION) {
+		fclose(file);
+		return false;
+	}
+
+	slice->render_hash = header.render_hash;
+	slice->first_sample = header.first_sample;
+	slice->sample_count = header.sample_count;
+	slice->fb = make_framebuffer(header.width, header.height);
+
+	u32 pixels = header.width * header.height;
+
+	bool ok = fread(slice->fb.color, sizeof(v3), pixels, file) == pixels;
+	ok = ok && fread(slice->fb.samples, sizeof(u32), pixels, file) == pixels;
+
+	fclose(file);
+
+	if (!ok) {
+		free_framebuffer(&slice->fb);
+	}
+
+	return ok;
+}
+
+bool merge_sample_slice(SampleSlice *into, SampleSlice *from) {
+	if (into->render_hash != from->render_hash ||
+		into->fb.width != from->fb.width || into->fb.height != from->fb.height) {
+		return false;
+	}
+
+	u32 end = into->first_sample + into->sample_count;
+	if (from->first_sample < end) {
+		return false;
+	}
+
+	merge_framebuffer(&into->fb, &from->fb);
+	into->sample_count = from->first_sample + from->sample_count - into->first_sample;
+
+	return true;
+}
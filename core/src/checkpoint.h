@@ -0,0 +1,65 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "raycaster.h"
+
+/*
+ * Snapshot of a progressive render taken between two passes.
+ * Together with the scene it is everything needed to continue the render
+ * and end up with exactly the same image as an uninterrupted run.
+ */
+struct Checkpoint {
+	u64 scene_hash;
+
+	u32 width;
+	u32 height;
+	u32 tile_count;
+
+	u32 samples_done;
+	u32 passes;
+
+	Random *tile_randoms;
+	v3 *color;
+	u32 *samples;
+};
+
+// hash over everything that influences the rendered pixels
+u64 hash_render(Scene *scene, RayCastConfig *config);
+
+Checkpoint make_checkpoint(u32 width, u32 height, u32 tile_count);
+void free_checkpoint(Checkpoint *checkpoint);
+
+// writes to `path`.tmp and renames, so a kill never leaves a torn file behind
+bool write_checkpoint(const char *path, Checkpoint *checkpoint);
+
+// allocates the arrays of `checkpoint`, false if missing or malformed
+bool read_checkpoint(const char *path, Checkpoint *checkpoint);
+
+/*
+ * Summed colors and sample counts of a render over the sample indices
+ * [first_sample, first_sample + sample_count), from raytrace_sums. Slices of
+ * the same render with disjoint ranges add up to the render over all of them,
+ * so a high sample count can be split over as many processes as there are.
+ */
+struct SampleSlice {
+	// hash_render of everything but the sample range
+	u64 render_hash;
+
+	u32 first_sample;
+	u32 sample_count;
+
+	Framebuffer fb;
+};
+
+u64 hash_slice(Scene *scene, RayCastConfig *config);
+
+bool write_sample_slice(const char *path, SampleSlice *slice);
+// allocates slice->fb, false if missing or malformed
+bool read_sample_slice(const char *path, SampleSlice *slice);
+
+// adds `from` to `into`, which has to start at a lower sample. False if the
+// slices are of different renders or their ranges overlap. Afterwards `into`
+// spans both ranges, gaps in between only mean fewer samples.
+bool merge_sample_slice(SampleSlice *into, SampleSlice *from);
+
+#endif
@@ -0,0 +1,916 @@
+#include <vector>
+
+#include "thread_pool.h"
+#include "image_writer.h"
+
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MAX_CHAIN 4
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+
+static const u16 length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const u8 length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const u16 dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const u8 dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static void reserve(DeflateBuffer *out, u64 extra) {
+	if (out->size + extra <= out->capacity) {
+		return;
+	}
+
+	u64 capacity = max(out->capacity * 2, out->size + extra);
+	out->data = (u8 *)realloc(out->data, capacity);
+	out->capacity = capacity;
+}
+
+// deflate packs bits starting at the least significant one
+static inline void put_bits(DeflateBuffer *out, u32 value, u32 count) {
+	out->bits |= (u64)value << out->bit_count;
+	out->bit_count += count;
+
+	while (out->bit_count >= 8) {
+		out->data[out->size++] = (u8)out->bits;
+		out->bits >>= 8;
+		out->bit_count -= 8;
+	}
+}
+
+static void align_to_byte(DeflateBuffer *out) {
+	if (out->bit_count) {
+		put_bits(out, 0, 8 - out->bit_count);
+	}
+}
+
+// Huffman codes are defined most significant bit first
+static inline u32 reverse_bits(u32 code, u32 length) {
+	u32 result = 0;
+	for (u32 i = 0; i < length; ++i) {
+		result = (result << 1) | (code & 1);
+		code >>= 1;
+	}
+	return result;
+}
+
+struct FixedCodes {
+	u16 code[288];
+	u8 length[288];
+};
+
+static FixedCodes make_fixed_codes() {
+	FixedCodes codes;
+
+	for (u32 symbol = 0; symbol < 288; ++symbol) {
+		u32 code;
+		u32 length;
+
+		if (symbol <= 143) {
+			code = 0x30 + symbol;
+			length = 8;
+		} else if (symbol <= 255) {
+			code = 0x190 + symbol - 144;
+			length = 9;
+		} else if (symbol <= 279) {
+			code = symbol - 256;
+			length = 7;
+		} else {
+			code = 0xC0 + symbol - 280;
+			length = 8;
+		}
+
+		codes.code[symbol] = (u16)reverse_bits(code, length);
+		codes.length[symbol] = (u8)length;
+	}
+
+	return codes;
+}
+
+static const FixedCodes fixed_codes = make_fixed_codes();
+
+static inline void put_symbol(DeflateBuffer *out, u32 symbol) {
+	put_bits(out, fixed_codes.code[symbol], fixed_codes.length[symbol]);
+}
+
+static inline void put_match(DeflateBuffer *out, u32 length, u32 dist) {
+	u32 l = 28;
+	while (length_base[l] > length) {
+		l--;
+	}
+	put_symbol(out, 257 + l);
+	put_bits(out, length - length_base[l], length_extra[l]);
+
+	u32 d = 29;
+	while (dist_base[d] > dist) {
+		d--;
+	}
+	put_bits(out, reverse_bits(d, 5), 5);
+	put_bits(out, dist - dist_base[d], dist_extra[d]);
+}
+
+static inline u32 hash3(const u8 *p) {
+	u32 v = (p[0] << 16) | (p[1] << 8) | p[2];
+	return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+void deflate_compress(DeflateBuffer *out, const u8 *in, u64 size, bool final) {
+	// worst case of a fixed Huffman block is 9 bits per byte, plus the flush
+	reserve(out, size + size / 8 + 16);
+
+	// one fixed Huffman block, they have no length limit
+	put_bits(out, final ? 1 : 0, 1);
+	put_bits(out, 1, 2);
+
+	u32 *head = (u32 *)malloc((1 << DEFLATE_HASH_BITS) * sizeof(u32));
+	u32 *prev = (u32 *)malloc(DEFLATE_WINDOW * sizeof(u32));
+	memset(head, 0xFF, (1 << DEFLATE_HASH_BITS) * sizeof(u32));
+
+	u32 n = (u32)size;
+	u32 i = 0;
+
+	while (i + DEFLATE_MIN_MATCH <= n) {
+		u32 h = hash3(in + i);
+		u32 candidate = head[h];
+
+		u32 best_length = 0;
+		u32 best_dist = 0;
+		u32 max_length = min(n - i, (u32)DEFLATE_MAX_MATCH);
+
+		for (u32 chain = 0; chain < DEFLATE_MAX_CHAIN && candidate != u32_max && i - candidate <= DEFLATE_WINDOW; ++chain) {
+			const u8 *a = in + candidate;
+			const u8 *b = in + i;
+
+			u32 length = 0;
+			while (length < max_length && a[length] == b[length]) {
+				length++;
+			}
+
+			if (length > best_length) {
+				best_length = length;
+				best_dist = i - candidate;
+				if (length == max_length) {
+					break;
+				}
+			}
+
+			// slots of the ring get reused, an older entry means the chain ended
+			u32 next = prev[candidate & (DEFLATE_WINDOW - 1)];
+			if (next >= candidate) {
+				break;
+			}
+			candidate = next;
+		}
+
+		u32 advance = 1;
+		if (best_length >= DEFLATE_MIN_MATCH) {
+			put_match(out, best_length, best_dist);
+			advance = best_length;
+		} else {
+			put_symbol(out, in[i]);
+		}
+
+		for (u32 end = i + advance; i < end; ++i) {
+			if (i + DEFLATE_MIN_MATCH <= n) {
+				u32 hi = hash3(in + i);
+				prev[i & (DEFLATE_WINDOW - 1)] = head[hi];
+				head[hi] = i;
+			}
+		}
+	}
+
+	for (; i < n; ++i) {
+		put_symbol(out, in[i]);
+	}
+
+	put_symbol(out, 256);
+
+	if (!final) {
+		put_bits(out, 0, 3);
+		align_to_byte(out);
+		put_bits(out, 0x0000, 16);
+		put_bits(out, 0xFFFF, 16);
+	}
+	align_to_byte(out);
+
+	free(head);
+	free(prev);
+}
+
+void free_deflate_buffer(DeflateBuffer *out) {
+	free(out->data);
+	*out = {};
+}
+
+u32 adler32(u32 adler, const u8 *data, u64 size) {
+	u32 a = adler & 0xFFFF;
+	u32 b = adler >> 16;
+
+	while (size) {
+		// largest run before b can overflow
+		u32 run = (u32)min(size, (u64)5552);
+		for (u32 i = 0; i < run; ++i) {
+			a += data[i];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+
+		data += run;
+		size -= run;
+	}
+
+	return (b << 16) | a;
+}
+
+struct Crc32Table {
+	u32 entries[256];
+};
+
+static Crc32Table make_crc32_table() {
+	Crc32Table table;
+
+	for (u32 i = 0; i < 256; ++i) {
+		u32 c = i;
+		for (u32 k = 0; k < 8; ++k) {
+			c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		}
+		table.entries[i] = c;
+	}
+
+	return table;
+}
+
+// built before main, frames are written from several pool tasks at once
+static const Crc32Table crc32_table = make_crc32_table();
+
+u32 crc32(u32 crc, const u8 *data, u64 size) {
+	crc = ~crc;
+	for (u64 i = 0; i < size; ++i) {
+		crc = crc32_table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static void put_u32_be(u8 *p, u32 v) {
+	p[0] = (u8)(v >> 24);
+	p[1] = (u8)(v >> 16);
+	p[2] = (u8)(v >> 8);
+	p[3] = (u8)v;
+}
+
+static bool write_chunk(FILE *file, const char *type, const u8 *prefix, u32 prefix_size,
+	const u8 *data, u64 size, const u8 *suffix, u32 suffix_size) {
+	u8 header[8];
+	put_u32_be(header, (u32)(prefix_size + size + suffix_size));
+	memcpy(header + 4, type, 4);
+
+	u32 crc = crc32(0, header + 4, 4);
+	crc = crc32(crc, prefix, prefix_size);
+	crc = crc32(crc, data, size);
+	crc = crc32(crc, suffix, suffix_size);
+
+	u8 footer[4];
+	put_u32_be(footer, crc);
+
+	bool ok = fwrite(header, 8, 1, file) == 1;
+	ok = ok && (!prefix_size || fwrite(prefix, prefix_size, 1, file) == 1);
+	ok = ok && (!size || fwrite(data, size, 1, file) == 1);
+	ok = ok && (!suffix_size || fwrite(suffix, suffix_size, 1, file) == 1);
+	ok = ok && fwrite(footer, 4, 1, file) == 1;
+
+	return ok;
+}
+
+static const u8 zlib_header[2] = { 0x78, 0x01 };
+
+static bool write_png_header(FILE *file, u32 width, u32 height) {
+	static const u8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	bool ok = fwrite(signature, 8, 1, file) == 1;
+
+	u8 ihdr[13];
+	put_u32_be(ihdr, width);
+	put_u32_be(ihdr + 4, height);
+	ihdr[8] = 8;  // bit depth
+	ihdr[9] = 2;  // truecolor
+	ihdr[10] = 0; // deflate
+	ihdr[11] = 0; // adaptive filtering
+	ihdr[12] = 0; // no interlace
+
+	return write_chunk(file, "IHDR", 0, 0, ihdr, 13, 0, 0) && ok;
+}
+
+bool png_stream_open(PngStream *png, const char *path, u32 width, u32 height, bool flip) {
+	*png = {};
+
+	png->file = fopen(path, "wb");
+	if (!png->file) {
+		return false;
+	}
+
+	png->width = width;
+	png->height = height;
+	png->flip = flip;
+	png->adler = 1;
+	png->prev_row = (u8 *)calloc(width * 3, 1);
+	png->ok = write_png_header(png->file, width, height);
+
+	return png->ok;
+}
+
+static inline u8 paeth(u8 a, u8 b, u8 c) {
+	s32 p = a + b - c;
+	s32 pa = abs(p - a);
+	s32 pb = abs(p - b);
+	s32 pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc) return a;
+	if (pb <= pc) return b;
+	return c;
+}
+
+static inline u8 filter_byte(u32 filter, u8 *row, u8 *prev, u32 i) {
+	u8 a = i >= 3 ? row[i - 3] : 0;
+	u8 b = prev ? prev[i] : 0;
+	u8 c = prev && i >= 3 ? prev[i - 3] : 0;
+
+	switch (filter) {
+		case 1: return row[i] - a;
+		case 2: return row[i] - b;
+		case 3: return row[i] - (u8)((a + b) >> 1);
+		case 4: return row[i] - paeth(a, b, c);
+	}
+	return row[i];
+}
+
+// keeps the filter with the smallest sum of signed bytes, the usual
+// heuristic for photographic content. Without a previous row only the
+// filters that do not look at it are tried.
+static void filter_row(u8 *out, u8 *row, u8 *prev, u32 size) {
+	u32 best = 0;
+	u64 best_cost = ~0ull;
+	u32 filter_count = prev ? 5 : 2;
+
+	for (u32 f = 0; f < filter_count; ++f) {
+		u64 cost = 0;
+		for (u32 i = 0; i < size; ++i) {
+			cost += abs((s8)filter_byte(f, row, prev, i));
+		}
+
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = f;
+		}
+	}
+
+	out[0] = (u8)best;
+	for (u32 i = 0; i < size; ++i) {
+		out[1 + i] = filter_byte(best, row, prev, i);
+	}
+}
+
+// Filters `rows` rows into `filtered` in file order, `rows` * (width * 3 + 1)
+// bytes. prev_row is the row above the first one or null if it is not known,
+// on return it holds the last row. `row` is scratch for one row.
+static void filter_png_rows(u8 *filtered, u32 *pixels, u32 width, u32 rows, bool flip, u8 *prev_row, u8 *row) {
+	u32 row_size = width * 3;
+	u8 *prev = prev_row;
+
+	for (u32 r = 0; r < rows; ++r) {
+		u32 *src = pixels + (u64)(flip ? rows - 1 - r : r) * width;
+
+		for (u32 x = 0; x < width; ++x) {
+			u32 p = src[x];
+			row[x * 3 + 0] = (u8)p;
+			row[x * 3 + 1] = (u8)(p >> 8);
+			row[x * 3 + 2] = (u8)(p >> 16);
+		}
+
+		filter_row(filtered + r * (u64)(row_size + 1), row, prev, row_size);
+
+		if (prev_row) {
+			memcpy(prev_row, row, row_size);
+		} else if (r + 1 < rows) {
+			// the first row of the block is behind us, later ones have a
+			// previous row, kept in the filtered output's unused tail
+			prev = filtered + (u64)rows * (row_size + 1);
+			memcpy(prev, row, row_size);
+		}
+	}
+}
+
+bool png_stream_write_rows(PngStream *png, u32 *pixels, u32 rows) {
+	rows = min(rows, png->height - png->rows_written);
+	if (!rows) {
+		return png->ok;
+	}
+
+	u32 row_size = png->width * 3;
+	u64 size = (u64)rows * (row_size + 1);
+
+	if (size > png->filtered_capacity) {
+		free(png->filtered);
+		png->filtered = (u8 *)malloc(size + 2 * row_size);
+		png->filtered_capacity = size;
+	}
+
+	// the unfiltered row is staged behind the filtered data
+	filter_png_rows(png->filtered, pixels, png->width, rows, png->flip, png->prev_row, png->filtered + size + row_size);
+
+	bool first = png->rows_written == 0;
+	png->rows_written += rows;
+	bool last = png->rows_written == png->height;
+
+	png->adler = adler32(png->adler, png->filtered, size);
+
+	png->deflate.size = 0;
+	deflate_compress(&png->deflate, png->filtered, size, last);
+
+	// zlib header in front of the first chunk, checksum after the last
+	u8 zlib_footer[4];
+	put_u32_be(zlib_footer, png->adler);
+
+	png->ok = write_chunk(png->file, "IDAT", zlib_header, first ? 2 : 0, png->deflate.data, png->deflate.size, zlib_footer, last ? 4 : 0) && png->ok;
+
+	return png->ok;
+}
+
+bool png_stream_close(PngStream *png) {
+	bool ok = png->ok && png->rows_written == png->height;
+
+	if (png->file) {
+		ok = write_chunk(png->file, "IEND", 0, 0, 0, 0, 0, 0) && ok;
+		ok = (fclose(png->file) == 0) && ok;
+	}
+
+	free(png->prev_row);
+	free(png->filtered);
+	free_deflate_buffer(&png->deflate);
+
+	*png = {};
+	return ok;
+}
+
+u32 adler32_combine(u32 adler1, u32 adler2, u64 size2) {
+	const u64 base = 65521;
+
+	u64 rem = size2 % base;
+	u64 sum1 = adler1 & 0xFFFF;
+	u64 sum2 = (rem * sum1) % base;
+
+	sum1 += (adler2 & 0xFFFF) + base - 1;
+	sum2 += (adler1 >> 16) + (adler2 >> 16) + base - rem;
+
+	sum1 %= base;
+	sum2 %= base;
+
+	return (u32)(sum1 | (sum2 << 16));
+}
+
+void png_parallel_begin(PngParallel *png, u32 width, u32 height, u32 strip_rows, bool flip) {
+	strip_rows = max(strip_rows, 1);
+
+	u32 strip_count = (height + strip_rows - 1) / strip_rows;
+	if (strip_count != png->strip_count) {
+		png_parallel_free(png);
+		png->strips = (PngStrip *)calloc(strip_count, sizeof(PngStrip));
+	}
+
+	png->width = width;
+	png->height = height;
+	png->strip_rows = strip_rows;
+	png->strip_count = strip_count;
+	png->flip = flip;
+}
+
+void png_parallel_encode_strip(PngParallel *png, u32 *pixels, u32 first_row) {
+	u32 index = first_row / png->strip_rows;
+	u32 rows = min(png->strip_rows, png->height - index * png->strip_rows);
+	PngStrip *strip = &png->strips[index];
+
+	// the strip that ends the file holds the final deflate block
+	bool last = png->flip ? index == 0 : index + 1 == png->strip_count;
+
+	u32 row_size = png->width * 3;
+	u64 size = (u64)rows * (row_size + 1);
+
+	// scratch per thread that lives as long as the thread, so encoding a
+	// sequence of images allocates nothing once the buffers have grown
+	static thread_local std::vector<u8> scratch;
+	if (scratch.size() < size + 2 * row_size) {
+		scratch.resize(size + 2 * row_size);
+	}
+	u8 *filtered = scratch.data();
+
+	filter_png_rows(filtered, pixels, png->width, rows, png->flip, 0, filtered + size + row_size);
+
+	strip->adler = adler32(1, filtered, size);
+	strip->size = size;
+	strip->deflate.size = 0;
+	deflate_compress(&strip->deflate, filtered, size, last);
+}
+
+bool png_parallel_finish(PngParallel *png, const char *path) {
+	FILE *file = fopen(path, "wb");
+	bool ok = file && write_png_header(file, png->width, png->height);
+
+	u32 adler = 1;
+	for (u32 i = 0; i < png->strip_count; ++i) {
+		u32 index = png->flip ? png->strip_count - 1 - i : i;
+		PngStrip *strip = &png->strips[index];
+
+		adler = adler32_combine(adler, strip->adler, strip->size);
+
+		bool first = i == 0;
+		bool last = i + 1 == png->strip_count;
+
+		u8 zlib_footer[4];
+		put_u32_be(zlib_footer, adler);
+
+		ok = ok && write_chunk(file, "IDAT", zlib_header, first ? 2 : 0, strip->deflate.data, strip->deflate.size, zlib_footer, last ? 4 : 0);
+	}
+
+	ok = ok && write_chunk(file, "IEND", 0, 0, 0, 0, 0, 0);
+	if (file) {
+		ok = (fclose(file) == 0) && ok;
+	}
+
+	return ok;
+}
+
+void png_parallel_free(PngParallel *png) {
+	for (u32 i = 0; i < png->strip_count; ++i) {
+		free_deflate_buffer(&png->strips[i].deflate);
+	}
+	free(png->strips);
+
+	*png = {};
+}
+
+bool write_png(const char *path, u32 *data, u32 width, u32 height, bool flip, ThreadPool *pool, u32 threads) {
+	PngParallel png = {};
+	png_parallel_begin(&png, width, height, PNG_STRIP_ROWS, flip);
+
+	ThreadPool local_pool;
+	if (!pool) {
+		thread_pool_init(&local_pool, threads > 1 ? threads - 1 : 0);
+		pool = &local_pool;
+	}
+
+	std::atomic<u32> next = 0;
+	thread_pool_run(pool, max(threads, 1), [&](u32 worker) {
+		for (;;) {
+			u32 index = next++;
+			if (index >= png.strip_count) {
+				break;
+			}
+
+			u32 first_row = index * png.strip_rows;
+			png_parallel_encode_strip(&png, data + (u64)first_row * width, first_row);
+		}
+	});
+
+	if (pool == &local_pool) {
+		thread_pool_destroy(&local_pool);
+	}
+
+	bool ok = png_parallel_finish(&png, path);
+	png_parallel_free(&png);
+
+	return ok;
+}
+
+u16 f32_to_f16(f32 value) {
+	u32 bits;
+	memcpy(&bits, &value, sizeof(bits));
+
+	u32 sign = (bits >> 16) & 0x8000;
+	u32 exponent = (bits >> 23) & 0xFF;
+	u32 mantissa = bits & 0x7FFFFF;
+
+	if (exponent == 0xFF) {
+		return (u16)(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+	}
+
+	s32 e = (s32)exponent - 127 + 15;
+
+	if (e >= 31) {
+		return (u16)(sign | 0x7C00);
+	}
+
+	if (e <= 0) {
+		if (e < -10) {
+			return (u16)sign;
+		}
+
+		// subnormal, the implicit one becomes part of the mantissa
+		mantissa |= 0x800000;
+		u32 shift = 14 - e;
+		u32 half = mantissa >> shift;
+		u32 rest = mantissa & ((1u << shift) - 1);
+		u32 halfway = 1u << (shift - 1);
+
+		if (rest > halfway || (rest == halfway && (half & 1))) {
+			half++;
+		}
+		return (u16)(sign | half);
+	}
+
+	u32 half = sign | (e << 10) | (mantissa >> 13);
+	u32 rest = mantissa & 0x1FFF;
+
+	// a carry out of the mantissa correctly bumps the exponent
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+		half++;
+	}
+	return (u16)half;
+}
+
+#define EXR_ZIP_ROWS 16
+
+static void put_u32_le(std::vector<u8> *out, u32 v) {
+	for (u32 i = 0; i < 4; ++i) {
+		out->push_back((u8)(v >> (i * 8)));
+	}
+}
+
+static void put_f32_le(std::vector<u8> *out, f32 v) {
+	u32 bits;
+	memcpy(&bits, &v, sizeof(bits));
+	put_u32_le(out, bits);
+}
+
+static void put_attribute(std::vector<u8> *out, const char *name, const char *type, std::vector<u8> value) {
+	out->insert(out->end(), name, name + strlen(name) + 1);
+	out->insert(out->end(), type, type + strlen(type) + 1);
+	put_u32_le(out, (u32)value.size());
+	out->insert(out->end(), value.begin(), value.end());
+}
+
+struct ExrBlock {
+	u8 *data;
+	u32 size;
+};
+
+// One block of rows as the file wants it: per row the B, G and R values of
+// every pixel, then the ZIP transform (byte split, delta) and zlib.
+// Falls back to the raw rows where compression does not pay off.
+static ExrBlock compress_exr_block(v3 *pixels, u32 width, u32 height, bool half, u32 first_row, u32 rows) {
+	u32 sample_size = half ? 2 : 4;
+	u32 size = rows * width * 3 * sample_size;
+
+	u8 *raw = (u8 *)malloc(size);
+	u8 *p = raw;
+
+	for (u32 r = 0; r < rows; ++r) {
+		// exr rows go top down
+		v3 *row = pixels + (u64)(height - 1 - (first_row + r)) * width;
+
+		for (s32 c = 2; c >= 0; --c) {
+			for (u32 x = 0; x < width; ++x) {
+				f32 v = c == 0 ? row[x].r : (c == 1 ? row[x].g : row[x].b);
+
+				if (half) {
+					u16 h = f32_to_f16(v);
+					p[0] = (u8)h;
+					p[1] = (u8)(h >> 8);
+					p += 2;
+				} else {
+					u32 bits;
+					memcpy(&bits, &v, sizeof(bits));
+					p[0] = (u8)bits;
+					p[1] = (u8)(bits >> 8);
+					p[2] = (u8)(bits >> 16);
+					p[3] = (u8)(bits >> 24);
+					p += 4;
+				}
+			}
+		}
+	}
+
+	u8 *split = (u8 *)malloc(size);
+	u32 even = (size + 1) / 2;
+	for (u32 i = 0; i < size; ++i) {
+		split[(i & 1) ? even + i / 2 : i / 2] = raw[i];
+	}
+
+	u8 previous = split[0];
+	for (u32 i = 1; i < size; ++i) {
+		u8 v = split[i];
+		split[i] = (u8)(v - previous + 128);
+		previous = v;
+	}
+
+	DeflateBuffer deflate = {};
+	reserve(&deflate, 2);
+	deflate.data[deflate.size++] = 0x78;
+	deflate.data[deflate.size++] = 0x01;
+	deflate_compress(&deflate, split, size, true);
+
+	u32 adler = adler32(1, split, size);
+	reserve(&deflate, 4);
+	for (s32 i = 3; i >= 0; --i) {
+		deflate.data[deflate.size++] = (u8)(adler >> (i * 8));
+	}
+
+	free(split);
+
+	ExrBlock block;
+	if (deflate.size < size) {
+		free(raw);
+		block.data = deflate.data;
+		block.size = (u32)deflate.size;
+	} else {
+		free_deflate_buffer(&deflate);
+		block.data = raw;
+		block.size = size;
+	}
+
+	return block;
+}
+
+bool write_exr(const char *path, v3 *pixels, u32 width, u32 height, bool half, ThreadPool *pool, u32 threads) {
+	std::vector<u8> header;
+
+	put_u32_le(&header, 20000630); // magic
+	put_u32_le(&header, 2);        // version 2, single part scanline
+
+	std::vector<u8> channels;
+	const char *names[] = { "B", "G", "R" };
+	for (u32 c = 0; c < 3; ++c) {
+		channels.push_back(names[c][0]);
+		channels.push_back(0);
+		put_u32_le(&channels, half ? 1 : 2); // pixel type
+		put_u32_le(&channels, 0);            // pLinear and reserved
+		put_u32_le(&channels, 1);            // x sampling
+		put_u32_le(&channels, 1);            // y sampling
+	}
+	channels.push_back(0);
+
+	std::vector<u8> window;
+	put_u32_le(&window, 0);
+	put_u32_le(&window, 0);
+	put_u32_le(&window, width - 1);
+	put_u32_le(&window, height - 1);
+
+	std::vector<u8> aspect;
+	put_f32_le(&aspect, 1.0f);
+
+	std::vector<u8> center;
+	put_f32_le(&center, 0.0f);
+	put_f32_le(&center, 0.0f);
+
+	put_attribute(&header, "channels", "chlist", channels);
+	put_attribute(&header, "compression", "compression", { 3 }); // ZIP
+	put_attribute(&header, "dataWindow", "box2i", window);
+	put_attribute(&header, "displayWindow", "box2i", window);
+	put_attribute(&header, "lineOrder", "lineOrder", { 0 }); // increasing y
+	put_attribute(&header, "pixelAspectRatio", "float", aspect);
+	put_attribute(&header, "screenWindowCenter", "v2f", center);
+	put_attribute(&header, "screenWindowWidth", "float", aspect);
+	header.push_back(0);
+
+	u32 block_count = (height + EXR_ZIP_ROWS - 1) / EXR_ZIP_ROWS;
+	std::vector<ExrBlock> blocks(block_count);
+
+	ThreadPool local_pool;
+	if (!pool) {
+		thread_pool_init(&local_pool, threads > 1 ? threads - 1 : 0);
+		pool = &local_pool;
+	}
+
+	std::atomic<u32> next = 0;
+	thread_pool_run(pool, max(threads, 1), [&](u32 worker) {
+		for (;;) {
+			u32 b = next++;
+			if (b >= block_count) {
+				break;
+			}
+
+			u32 first_row = b * EXR_ZIP_ROWS;
+			u32 rows = min((u32)EXR_ZIP_ROWS, height - first_row);
+			blocks[b] = compress_exr_block(pixels, width, height, half, first_row, rows);
+		}
+	});
+
+	if (pool == &local_pool) {
+		thread_pool_destroy(&local_pool);
+	}
+
+	// the offset table points at every block, right after the header
+	std::vector<u8> offsets;
+	u64 offset = header.size() + (u64)block_count * 8;
+	for (u32 b = 0; b < block_count; ++b) {
+		put_u32_le(&offsets, (u32)offset);
+		put_u32_le(&offsets, (u32)(offset >> 32));
+		offset += 8 + blocks[b].size;
+	}
+
+	FILE *file = fopen(path, "wb");
+	bool ok = file != 0;
+
+	ok = ok && fwrite(header.data(), header.size(), 1, file) == 1;
+	ok = ok && fwrite(offsets.data(), offsets.size(), 1, file) == 1;
+
+	for (u32 b = 0; b < block_count; ++b) {
+		std::vector<u8> chunk;
+		put_u32_le(&chunk, b * EXR_ZIP_ROWS);
+		put_u32_le(&chunk, blocks[b].size);
+
+		ok = ok && fwrite(chunk.data(), chunk.size(), 1, file) == 1;
+		ok = ok && fwrite(blocks[b].data, blocks[b].size, 1, file) == 1;
+
+		free(blocks[b].data);
+	}
+
+	if (file) {
+		ok = (fclose(file) == 0) && ok;
+	}
+
+	return ok;
+}
+
+bool write_hdr(const char *path, v3 *pixels, u32 width, u32 height) {
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		return false;
+	}
+
+	fprintf(file, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %u +X %u\n", height, width);
+
+	u8 *scanline = (u8 *)malloc(width * 4);
+	bool ok = true;
+
+	for (u32 y = 0; y < height && ok; ++y) {
+		v3 *row = pixels + (u64)(height - 1 - y) * width;
+
+		for (u32 x = 0; x < width; ++x) {
+			f32 r = max(row[x].r, 0.0f);
+			f32 g = max(row[x].g, 0.0f);
+			f32 b = max(row[x].b, 0.0f);
+			f32 m = max(max(r, g), b);
+
+			u8 *rgbe = scanline + x * 4;
+			if (m < 1e-32f) {
+				rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+				continue;
+			}
+
+			// shared exponent, the mantissas keep 8 bits relative to the largest
+			int e;
+			f32 scale = frexpf(m, &e) * 256.0f / m;
+
+			rgbe[0] = (u8)(r * scale);
+			rgbe[1] = (u8)(g * scale);
+			rgbe[2] = (u8)(b * scale);
+			rgbe[3] = (u8)(e + 128);
+		}
+
+		ok = fwrite(scanline, width * 4, 1, file) == 1;
+	}
+
+	free(scanline);
+	ok = (fclose(file) == 0) && ok;
+
+	return ok;
+}
+
+bool write_pfm(const char *path, v3 *pixels, u32 width, u32 height) {
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		return false;
+	}
+
+	// a negative scale marks little endian, rows are stored bottom up already
+	fprintf(file, "PF\n%u %u\n-1.0\n", width, height);
+
+	f32 *scanline = (f32 *)malloc(width * 3 * sizeof(f32));
+	bool ok = true;
+
+	for (u32 y = 0; y < height && ok; ++y) {
+		v3 *row = pixels + (u64)y * width;
+
+		for (u32 x = 0; x < width; ++x) {
+			scanline[x * 3 + 0] = row[x].r;
+			scanline[x * 3 + 1] = row[x].g;
+			scanline[x * 3 + 2] = row[x].b;
+		}
+
+		ok = fwrite(scanline, width * 3 * sizeof(f32), 1, file) == 1;
+	}
+
+	free(scanline);
+	ok = (fclose(file) == 0) && ok;
+
+	return ok;
+}
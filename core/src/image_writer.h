@@ -0,0 +1,121 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "raycaster.h"
+
+/*
+ * Image encoders that take the picture a band of rows at a time, so a
+ * render never has to hold the whole frame. Compression is our own
+ * deflate with the fixed Huffman codes and a hash chain matcher, which
+ * keeps the core free of a zlib dependency.
+ */
+
+struct DeflateBuffer {
+	u8 *data;
+	u64 size;
+	u64 capacity;
+
+	u64 bits;
+	u32 bit_count;
+};
+
+// Appends `size` bytes as deflate blocks. Matches never reach outside of
+// `in`, so independently compressed pieces can be concatenated. Unless
+// final, the output ends with an empty stored block (a zlib sync flush).
+void deflate_compress(DeflateBuffer *out, const u8 *in, u64 size, bool final);
+void free_deflate_buffer(DeflateBuffer *out);
+
+u32 adler32(u32 adler, const u8 *data, u64 size);
+// checksum of two pieces, given the checksums of both and the second's size
+u32 adler32_combine(u32 adler1, u32 adler2, u64 size2);
+u32 crc32(u32 crc, const u8 *data, u64 size);
+
+struct PngStream {
+	FILE *file;
+	u32 width;
+	u32 height;
+	u32 rows_written;
+
+	// rows arrive bottom up like the render buffers, the file is top down
+	bool flip;
+	bool ok;
+
+	u32 adler;
+	u8 *prev_row;
+	u8 *filtered;
+	u64 filtered_capacity;
+	DeflateBuffer deflate;
+};
+
+// 8 bit RGB, the alpha byte of the pixels is dropped
+bool png_stream_open(PngStream *png, const char *path, u32 width, u32 height, bool flip);
+
+// Encodes the next `rows` rows (next in file order, see flip) and writes
+// them out as one IDAT chunk. Nothing of them is kept but the last row.
+bool png_stream_write_rows(PngStream *png, u32 *pixels, u32 rows);
+
+// false if writing failed or not all rows were written
+bool png_stream_close(PngStream *png);
+
+/*
+ * PNG compressed in independent strips, so they can be filtered and deflated
+ * on all threads, even while other parts of the image are still rendering.
+ * The first row of a strip only uses filters that do not look at the row
+ * before and every strip ends byte aligned, so the deflate streams simply
+ * concatenate. Strips start at multiples of strip_rows in memory order.
+ */
+
+#define PNG_STRIP_ROWS 64
+
+struct PngStrip {
+	DeflateBuffer deflate;
+	u32 adler;
+	u64 size;
+};
+
+struct PngParallel {
+	u32 width;
+	u32 height;
+	u32 strip_rows;
+	u32 strip_count;
+	bool flip;
+
+	PngStrip *strips;
+};
+
+// png must be zeroed or used before, the strips of an earlier image of the
+// same size are reused with their buffers
+void png_parallel_begin(PngParallel *png, u32 width, u32 height, u32 strip_rows, bool flip);
+
+// encodes the strip starting at image row first_row, `pixels` points at that
+// row, safe to call from several threads for different strips
+void png_parallel_encode_strip(PngParallel *png, u32 *pixels, u32 first_row);
+
+// writes the file once every strip was encoded, the buffers stay for the next image
+bool png_parallel_finish(PngParallel *png, const char *path);
+void png_parallel_free(PngParallel *png);
+
+// the whole image at once, strips are spread over the pool (or a temporary
+// pool of `threads` if it is null)
+bool write_png(const char *path, u32 *data, u32 width, u32 height, bool flip, ThreadPool *pool, u32 threads);
+
+/*
+ * Linear float images straight from raytrace_linear, without clamping or
+ * the sRGB curve. `pixels` are bottom row first like the render buffers.
+ */
+
+// round to nearest even, overflow becomes infinity
+u16 f32_to_f16(f32 value);
+
+// Scanline OpenEXR with ZIP compressed blocks of 16 rows, in half or full
+// floats. Blocks are compressed in parallel on `pool`, or on a temporary
+// pool of `threads` if it is null.
+bool write_exr(const char *path, v3 *pixels, u32 width, u32 height, bool half, ThreadPool *pool, u32 threads);
+
+// Radiance RGBE, uncompressed scanlines
+bool write_hdr(const char *path, v3 *pixels, u32 width, u32 height);
+
+// portable float map, little endian
+bool write_pfm(const char *path, v3 *pixels, u32 width, u32 height);
+
+#endif
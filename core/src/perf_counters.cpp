@@ -0,0 +1,123 @@
+#include "perf_counters.h"
+
+const char *perf_counter_name(u32 kind) {
+	switch (kind) {
+		case PERF_CYCLES: return "cycles";
+		case PERF_INSTRUCTIONS: return "instructions";
+		case PERF_L1D_MISSES: return "l1d_misses";
+		case PERF_LLC_MISSES: return "llc_misses";
+		case PERF_BRANCH_MISSES: return "branch_misses";
+	}
+	return "unknown";
+}
+
+#ifdef __linux__
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static s32 open_counter(u32 type, u64 config) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	// pid 0, cpu -1: count the calling thread on whatever cpu it runs
+	return (s32) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+u32 perf_counters_open(PerfCounters *counters) {
+	u64 l1d = PERF_COUNT_HW_CACHE_L1D |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+	counters->fds[PERF_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	counters->fds[PERF_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	counters->fds[PERF_L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE, l1d);
+	counters->fds[PERF_LLC_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	counters->fds[PERF_BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+
+	counters->available = 0;
+	for (u32 i = 0; i < PERF_COUNTER_COUNT; ++i) {
+		counters->values[i] = 0;
+		if (counters->fds[i] >= 0) {
+			counters->available |= 1 << i;
+		}
+	}
+
+	return counters->available;
+}
+
+void perf_counters_start(PerfCounters *counters) {
+	for (u32 i = 0; i < PERF_COUNTER_COUNT; ++i) {
+		if (counters->fds[i] >= 0) {
+			ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+void perf_counters_stop(PerfCounters *counters) {
+	for (u32 i = 0; i < PERF_COUNTER_COUNT; ++i) {
+		if (counters->fds[i] < 0) {
+			continue;
+		}
+
+		ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+		// value, time enabled, time running
+		u64 data[3];
+		if (read(counters->fds[i], data, sizeof(data)) != sizeof(data) || data[2] == 0) {
+			counters->values[i] = 0;
+			counters->available &= ~(1 << i);
+			continue;
+		}
+
+		// scale up when the kernel had to multiplex the counter
+		if (data[2] < data[1]) {
+			data[0] = (u64)((f64) data[0] * (f64) data[1] / (f64) data[2]);
+		}
+
+		counters->values[i] = data[0];
+	}
+}
+
+void perf_counters_close(PerfCounters *counters) {
+	for (u32 i = 0; i < PERF_COUNTER_COUNT; ++i) {
+		if (counters->fds[i] >= 0) {
+			close(counters->fds[i]);
+			counters->fds[i] = -1;
+		}
+	}
+}
+
+#else
+
+u32 perf_counters_open(PerfCounters *counters) {
+	for (u32 i = 0; i < PERF_COUNTER_COUNT; ++i) {
+		counters->fds[i] = -1;
+		counters->values[i] = 0;
+	}
+	counters->available = 0;
+
+	return 0;
+}
+
+void perf_counters_start(PerfCounters *counters) {
+}
+
+void perf_counters_stop(PerfCounters *counters) {
+}
+
+void perf_counters_close(PerfCounters *counters) {
+}
+
+#endif
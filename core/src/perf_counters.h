@@ -0,0 +1,26 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include "raycaster.h"
+
+/*
+ * Hardware performance counters for the calling thread.
+ * Only implemented on Linux through perf_event_open, everywhere else
+ * (and when the kernel refuses, e.g. perf_event_paranoid or no PMU in a VM)
+ * perf_counters_open reports no counters and the rest are no-ops.
+ */
+struct PerfCounters {
+	s32 fds[PERF_COUNTER_COUNT];
+	u64 values[PERF_COUNTER_COUNT];
+	u32 available;
+};
+
+const char *perf_counter_name(u32 kind);
+
+// returns the mask of counters that could be opened
+u32 perf_counters_open(PerfCounters *counters);
+void perf_counters_start(PerfCounters *counters);
+void perf_counters_stop(PerfCounters *counters);
+void perf_counters_close(PerfCounters *counters);
+
+#endif
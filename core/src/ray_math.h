@@ -25,6 +25,22 @@ inline u32 random_u32(Random *random) {
 	return x;
 }
 
+// Counter based: the state is a pure function of its inputs (splitmix64 of
+// them), so any sample's stream can be made on any thread without shared
+// state. Never 0, xorshift would be stuck there.
+inline Random random_from_counter(u32 seed, u32 stream, u32 counter) {
+	uint64_t x = ((uint64_t)seed << 32 | stream) + (counter + 1) * 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	x ^= x >> 31;
+
+	u32 state = (u32)x ^ (u32)(x >> 32);
+
+	Random random;
+	random.state = state ? state : 1;
+	return random;
+}
+
 inline f32 randomf(Random *random) {
 	return (f32)random_u32(random) / (f32) u32_max;
 }
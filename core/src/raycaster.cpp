@@ -1,12 +1,21 @@
-#include "raycaster.h"
-
 #include <ctime>
 #include <stdlib.h>
 #include <thread>
 #include <vector>
 
-#define MIN_DIST 0.001f
-#define MAX_DIST 200
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RAYTRACE_SSE2 1
+#endif
+
+#include "thread_pool.h"
+#include "raycaster.h"
+#include "perf_counters.h"
+#include "checkpoint.h"
+#include "bvh.h"
+#include "bvh8.h"
+#include "arena.h"
+
 #define PI 3.1415926535f
 
 #ifdef _WIN64
@@ -17,8 +26,9 @@ u64 get_cpu_time() {
 	return __rdtsc();
 }
 
+// microseconds
 u64 get_real_time() {
-	return clock();
+	return (u64) clock() * (1000000 / CLOCKS_PER_SEC);
 }
 
 #else
@@ -26,16 +36,17 @@ u64 get_real_time() {
 
 u64 get_cpu_time() {
 	struct timespec timespec;
-	clock_gettime(_CLOCK_PROCESS_CPUTIME_ID, &timespec);
-	return timespec.tv_nsec;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &timespec);
+	return ((u64) timespec.tv_sec) * 1000000000 + timespec.tv_nsec;
 }
 
+// microseconds
 u64 get_real_time() {
 	struct timeval time;
 
 	gettimeofday(&time, 0);
 
-	return ((u64) time.tv_sec) * 1000 + (time.tv_usec / 1000);
+	return ((u64) time.tv_sec) * 1000000 + time.tv_usec;
 }
 
 #endif
@@ -88,6 +99,124 @@ v3 linear_to_srgb(v3 v) {
 	);
 }
 
+/*
+ * 8 bit sRGB without pow. The byte only grows with the linear value, so it
+ * is the number of byte thresholds at or below it. The top 16 bits of the
+ * float (exponent and 7 mantissa bits) pick a bucket, and as no bucket in
+ * [0, 1] spans more than one threshold, one compare against the next
+ * threshold finishes it. The table is made from linear_to_srgb itself, so the
+ * bytes are the same as rgb_to_hex(linear_to_srgb(l)), which the microbench
+ * checks for every float in [0, 1].
+ */
+
+#define SRGB8_BUCKET_SHIFT 16
+#define SRGB8_ONE_BITS 0x3F800000u
+#define SRGB8_BUCKETS ((SRGB8_ONE_BITS >> SRGB8_BUCKET_SHIFT) + 1)
+
+struct Srgb8Table {
+	u8 bucket[SRGB8_BUCKETS];
+	// smallest linear value of every byte, threshold[256] is never reached
+	f32 threshold[257];
+};
+
+static f32 f32_from_bits(u32 bits) {
+	f32 f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+static u32 srgb8_reference(f32 l) {
+	return (u32)(linear_to_srgb(l) * 255.9);
+}
+
+static Srgb8Table make_srgb8_table() {
+	Srgb8Table table;
+
+	for (u32 i = 0; i < SRGB8_BUCKETS; ++i) {
+		table.bucket[i] = (u8)srgb8_reference(f32_from_bits(i << SRGB8_BUCKET_SHIFT));
+	}
+
+	// positive floats order like their bits
+	for (u32 k = 0; k < 257; ++k) {
+		u32 lo = 0;
+		u32 hi = SRGB8_ONE_BITS + 1;
+
+		while (lo < hi) {
+			u32 mid = lo + (hi - lo) / 2;
+			if (srgb8_reference(f32_from_bits(mid)) >= k) {
+				hi = mid;
+			} else {
+				lo = mid + 1;
+			}
+		}
+
+		table.threshold[k] = lo <= SRGB8_ONE_BITS ? f32_from_bits(lo) : INFINITY;
+	}
+
+	return table;
+}
+
+static Srgb8Table srgb8_table = make_srgb8_table();
+
+u32 linear_to_srgb8(f32 l) {
+	// written so NaN ends up 0 like in the SIMD version
+	l = l > 0.0f ? l : 0.0f;
+	l = l < 1.0f ? l : 1.0f;
+
+	u32 bits;
+	memcpy(&bits, &l, sizeof(bits));
+
+	u32 byte = srgb8_table.bucket[bits >> SRGB8_BUCKET_SHIFT];
+	return byte + (l >= srgb8_table.threshold[byte + 1]);
+}
+
+u32 linear_to_pixel(v3 v) {
+	u32 hex = 0xFF << 24;
+	hex |= linear_to_srgb8(v.b) << 16;
+	hex |= linear_to_srgb8(v.g) << 8;
+	hex |= linear_to_srgb8(v.r);
+
+	return hex;
+}
+
+void linear_to_pixels(v3 *colors, u32 *pixels, u32 count) {
+	u32 i = 0;
+
+#ifdef RAYTRACE_SSE2
+	// clamp and bucket index of 4 pixels (12 channels) at a time, only the
+	// table lookups are scalar
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+
+	for (; i + 4 <= count; i += 4) {
+		f32 *in = (f32 *)(colors + i);
+		alignas(16) f32 values[12];
+		alignas(16) u32 buckets[12];
+
+		for (u32 j = 0; j < 3; ++j) {
+			// max returns the second operand for NaN
+			__m128 c = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + 4 * j), zero), one);
+			_mm_store_ps(values + 4 * j, c);
+			_mm_store_si128((__m128i *)(buckets + 4 * j), _mm_srli_epi32(_mm_castps_si128(c), SRGB8_BUCKET_SHIFT));
+		}
+
+		u32 bytes[12];
+		for (u32 j = 0; j < 12; ++j) {
+			u32 byte = srgb8_table.bucket[buckets[j]];
+			bytes[j] = byte + (values[j] >= srgb8_table.threshold[byte + 1]);
+		}
+
+		for (u32 p = 0; p < 4; ++p) {
+			pixels[i + p] = 0xFF << 24 | bytes[3 * p + 2] << 16 | bytes[3 * p + 1] << 8 | bytes[3 * p];
+		}
+	}
+#endif
+
+	for (; i < count; ++i) {
+		pixels[i] = linear_to_pixel(colors[i]);
+	}
+}
+
 void map_sphere_uv(v3 p, f32 *u, f32 *v) {
 	f32 phi = atan2f(p.z, p.x);	
 	f32 theta = asinf(p.y);
@@ -143,6 +272,46 @@ Plane make_plane(f32 z, u32 material_index) {
     return plane;
 }
 
+Object make_object(Sphere *spheres, u32 num_spheres) {
+	Object object = {};
+
+	object.spheres = spheres;
+	object.num_spheres = num_spheres;
+
+	return object;
+}
+
+void instance_set_transform(Instance *instance, v3 x, v3 y, v3 z, v3 position) {
+	instance->x = x;
+	instance->y = y;
+	instance->z = z;
+	instance->position = position;
+
+	// rows of the inverse are the cross products of the columns over the determinant
+	v3 r0 = cross(y, z);
+	v3 r1 = cross(z, x);
+	v3 r2 = cross(x, y);
+	f32 inv_det = 1.0f / dot(x, r0);
+
+	instance->inv_x = vec3(r0.x, r1.x, r2.x) * inv_det;
+	instance->inv_y = vec3(r0.y, r1.y, r2.y) * inv_det;
+	instance->inv_z = vec3(r0.z, r1.z, r2.z) * inv_det;
+	instance->inv_position = -(instance->inv_x * position.x + instance->inv_y * position.y + instance->inv_z * position.z);
+}
+
+Instance make_instance(u32 object, v3 position, f32 angle, f32 scale, u32 material_index) {
+	Instance instance;
+
+	instance.object = object;
+	instance.material_index = material_index;
+
+	f32 c = cosf(angle) * scale;
+	f32 s = sinf(angle) * scale;
+	instance_set_transform(&instance, vec3(c, s, 0), vec3(-s, c, 0), vec3(0, 0, scale), position);
+
+	return instance;
+}
+
 Camera make_camera(f32 fov, v3 pos, v3 lookat, f32 focus_dist, f32 aperture, u32 width, u32 height) {
 	Camera camera;
 
@@ -185,6 +354,19 @@ RayCastConfig ray_cast_config_default() {
 	config.sky_color = vec3(0.5f, 0.7f, 1.0f);
 	config.max_bounces = 2;
 	config.rays_per_pixel = 32;
+	config.verbose = true;
+	config.perf_counters = false;
+	config.time_budget_ms = 0;
+	config.samples_per_pass = 1;
+	config.tile_size = 0;
+	config.seed = 0;
+	config.sample_offset = 0;
+	config.pool = 0;
+	config.scratch = 0;
+	config.checkpoint_path = 0;
+	config.checkpoint_interval_ms = 10000;
+	config.resume = false;
+	config.record_tile_hits = false;
 
 	return config;
 }
@@ -209,9 +391,18 @@ Ray camera_get_ray(Camera *camera, f32 s, f32 t, Random *random) {
 	return ray;
 }
 
-bool scatter(Material material, Ray *ray, lane_v3 p, lane_v3 n, lane_v3 *attenuation, Random *random) {
+// KINDS has a bit for every material kind the scene uses (Scene::material_kinds),
+// with a single one the switch folds away
+template <u32 KINDS>
+static inline bool scatter_kinds(Material material, Ray *ray, lane_v3 p, lane_v3 n, lane_v3 *attenuation, Random *random) {
+	u32 kind = material.kind;
+	if (KINDS == (1 << MATT)) {
+		kind = MATT;
+	} else if (KINDS == (1 << METALLIC)) {
+		kind = METALLIC;
+	}
 
-    switch (material.kind) {
+    switch (kind) {
 		case MATT: {
 			v3 target = p + n + random_vec3(random);
 
@@ -239,6 +430,10 @@ bool scatter(Material material, Ray *ray, lane_v3 p, lane_v3 n, lane_v3 *attenua
     return false;
 }
 
+bool scatter(Material material, Ray *ray, lane_v3 p, lane_v3 n, lane_v3 *attenuation, Random *random) {
+	return scatter_kinds<u32_max>(material, ray, p, n, attenuation, random);
+}
+
 Hit scan_hit(Scene *scene, Ray *ray) {
     Hit hit{};
     hit.t = MAX_DIST;
@@ -252,201 +447,1402 @@ Hit scan_hit(Scene *scene, Ray *ray) {
 
         if (distance > MIN_DIST && distance < hit.t) {
             hit.t = distance;
-            hit.material_index = plane.material_index;
-            hit.n = { 0, 0, 1 };
+            hit.primitive = HIT_PLANE | i;
         }
     }
 
-    for (u32 i = 0; i < scene->num_spheres; ++i) {
-    	Sphere sphere = scene->spheres[i];
-        v3 displacement = ro - sphere.center;
-        f32 a = dot(rd, rd);
-        f32 b = 2.0f * dot(rd, displacement);
-        f32 c = dot(displacement, displacement) - sphere.radius * sphere.radius;
-
-        f32 discriminant = b * b - 4.0f * a * c;
+    if (scene->instance_bvh) {
+        u32 instance, sphere;
+        if (bvh_intersect_instances(scene, ro, rd, &hit.t, &instance, &sphere)) {
+            hit.primitive = HIT_INSTANCE | sphere;
+            hit.instance = instance;
+        }
+    }
 
-        if (discriminant < 0) {
-            continue;
+    if (scene->bvh && scene->bvh->prim_count == scene->num_spheres) {
+        if (scene->wide_bvh) {
+            bvh8_intersect(scene->wide_bvh, scene->bvh, scene->spheres, ro, rd, &hit.t, &hit.primitive);
+        } else {
+            bvh_intersect(scene->bvh, scene->spheres, ro, rd, &hit.t, &hit.primitive);
         }
+        return hit;
+    }
 
-        f32 t0 = (-b + sqrt(discriminant)) / (2.0f * a);
-        f32 t1 = (-b - sqrt(discriminant)) / (2.0f * a);
+    for (u32 i = 0; i < scene->num_spheres; ++i) {
+    	Sphere sphere = scene->spheres[i];
         f32 t;
 
-        if (t0 > MIN_DIST) {
-            if (t1 > MIN_DIST) {
-                t = min(t0, t1);
-            } else {
-                t = t0;
-            }
-        } else {
-            t = t1;
+        if (!intersect_sphere(&sphere, ro, rd, &t)) {
+            continue;
         }
 
         if (t > MIN_DIST && t < hit.t) {
             hit.t = t;
-            hit.n = normalize((ro + rd * hit.t) - sphere.center);
-            hit.material_index = sphere.material_index;
+            hit.primitive = i;
         }
     }
 
     return hit;
 }
 
-u64 raytrace_tile(WorkQueue *queue, Scene *scene, u32 *data, RayCastConfig *config) {
-    if (queue->tile_index >= queue->tile_count) {
-        return 0;
-    }
+Surface hit_surface(Scene *scene, Ray *ray, Hit *hit) {
+	Surface surface;
+	surface.p = ray->origin + hit->t * ray->dir;
+
+	if (hit->primitive & HIT_PLANE) {
+		Plane *plane = &scene->planes[hit->primitive & ~HIT_PLANE];
+		surface.n = { 0, 0, 1 };
+		surface.material_index = plane->material_index;
+	} else if (hit->primitive & HIT_INSTANCE) {
+		Instance *instance = &scene->instances[hit->instance];
+		Sphere *sphere = &scene->objects[instance->object].spheres[hit->primitive & ~HIT_INSTANCE];
+
+		v3 p = surface.p;
+		v3 n = instance->inv_x * p.x + instance->inv_y * p.y + instance->inv_z * p.z + instance->inv_position - sphere->center;
+
+		// normals go back through the transpose of the inverse
+		surface.n = normalize(vec3(dot(instance->inv_x, n), dot(instance->inv_y, n), dot(instance->inv_z, n)));
+		surface.material_index = instance->material_index != INSTANCE_OBJECT_MATERIALS ? instance->material_index : sphere->material_index;
+	} else {
+		Sphere *sphere = &scene->spheres[hit->primitive];
+		surface.n = normalize((ray->origin + ray->dir * hit->t) - sphere->center);
+		surface.material_index = sphere->material_index;
+	}
+
+	return surface;
+}
+
+// BOUNCES is config->max_bounces if it is not 0, so the loop can be unrolled,
+// HITS whether hit_materials is set
+template <u32 KINDS, u32 BOUNCES, bool HITS>
+static inline v3 trace_path_kinds(Scene *scene, RayCastConfig *config, f32 u, f32 v, Random *random, u64 *bounces, u64 *hit_materials) {
+	Ray ray = camera_get_ray(&scene->camera, u, v, random);
+
+	v3 attenuation = vec3(1.0f);
+	u32 max_bounces = BOUNCES ? BOUNCES : config->max_bounces;
+
+	for (u32 i = 0; i < max_bounces; ++i) {
+		(*bounces)++;
+
+		Hit hit = scan_hit(scene, &ray);
+
+		if (hit.t < MAX_DIST) {
+			Surface surface = hit_surface(scene, &ray, &hit);
+			Material material = scene->materials[surface.material_index];
+
+			if (HITS) {
+				hit_materials[surface.material_index >> 6] |= 1ull << (surface.material_index & 63);
+			}
+
+			v3 catt;
+			if (!scatter_kinds<KINDS>(material, &ray, surface.p, surface.n, &catt, random)) {
+				attenuation = vec3(0);
+				break;
+			}
+
+			attenuation = attenuation * catt;
+		} else {
+			break;
+		}
+	}
+
+	return attenuation * config->sky_color;
+}
+
+v3 trace_path(Scene *scene, RayCastConfig *config, f32 u, f32 v, Random *random, u64 *bounces, u64 *hit_materials) {
+	if (hit_materials) {
+		return trace_path_kinds<u32_max, 0, true>(scene, config, u, v, random, bounces, hit_materials);
+	}
+	return trace_path_kinds<u32_max, 0, false>(scene, config, u, v, random, bounces, 0);
+}
+
+void cancel_token_cancel(CancelToken *token) {
+	// the time is stored first, whoever sees the flag also sees the time
+	token->cancel_time = get_real_time();
+	token->cancelled = true;
+}
+
+void cancel_token_reset(CancelToken *token) {
+	token->cancelled = false;
+	token->cancel_time = 0;
+}
+
+// with a seed every sample starts a stream of its own, otherwise the samples
+// share the tile's, which makes them depend on the order tiles are traced in
+static inline Random *sample_random(RayCastConfig *config, Tile *tile, Random *scratch, u32 pixel, u32 sample) {
+	if (!config->seed) {
+		return &tile->random;
+	}
+
+	*scratch = random_from_counter(config->seed, pixel, sample);
+	return scratch;
+}
+
+// Pixels of a tile are rendered into a buffer of the worker's own and only
+// copied out once the tile is done. Rows are padded to whole cache lines, so
+// no line is ever written by two threads, which neighbouring tiles in the
+// shared output would do at every vertical tile edge.
+#define TILE_BUFFER_ALIGN 64
+
+static void free_tile_pixels(u32 *pixels) {
+#ifdef _WIN32
+	_aligned_free(pixels);
+#else
+	free(pixels);
+#endif
+}
+
+struct TileBuffer {
+	u32 *pixels;
+	u64 capacity;
+
+	~TileBuffer() {
+		free_tile_pixels(pixels);
+	}
+};
+
+static thread_local TileBuffer tile_buffer;
+
+// followed by room for one row of linear colors, see render_tile_kinds
+static u32 *get_tile_buffer(u32 stride, u32 rows) {
+	u64 size = (u64)stride * rows + (u64)stride * (sizeof(v3) / sizeof(u32));
+
+	if (size > tile_buffer.capacity) {
+		free_tile_pixels(tile_buffer.pixels);
+#ifdef _WIN32
+		tile_buffer.pixels = (u32 *)_aligned_malloc(size * sizeof(u32), TILE_BUFFER_ALIGN);
+#else
+		tile_buffer.pixels = (u32 *)aligned_alloc(TILE_BUFFER_ALIGN, size * sizeof(u32));
+#endif
+		tile_buffer.capacity = size;
+	}
+
+	return tile_buffer.pixels;
+}
+
+// Non-temporal stores go around the cache straight to memory, for output
+// nobody reads again soon, so there is no point in owning its lines.
+static void stream_copy(u32 *dst, u32 *src, u32 count) {
+#ifdef RAYTRACE_SSE2
+	u32 i = 0;
+
+	for (; i < count && ((uintptr_t)(dst + i) & 15); ++i) {
+		_mm_stream_si32((int *)(dst + i), (int)src[i]);
+	}
+
+	for (; i + 4 <= count; i += 4) {
+		_mm_stream_si128((__m128i *)(dst + i), _mm_loadu_si128((__m128i *)(src + i)));
+	}
+
+	for (; i < count; ++i) {
+		_mm_stream_si32((int *)(dst + i), (int)src[i]);
+	}
+#else
+	memcpy(dst, src, count * sizeof(u32));
+#endif
+}
+
+// the rows done so far, also when the tile was cancelled half way
+static void commit_tile(u32 *data, u32 w, u32 first_row, Tile *tile, u32 *pixels, u32 stride, u32 rows, bool stream) {
+	for (u32 y = 0; y < rows; ++y) {
+		u32 *dst = data + (u64)(tile->y + y - first_row) * w + tile->x;
+		u32 *src = pixels + (u64)y * stride;
+
+		if (stream) {
+			stream_copy(dst, src, tile->w);
+		} else {
+			memcpy(dst, src, tile->w * sizeof(u32));
+		}
+	}
 
-    Camera *camera = &scene->camera;
-    Tile *tile = &queue->tiles[queue->tile_index];
+#ifdef RAYTRACE_SSE2
+	// streaming stores are weakly ordered, whoever is told the tile is done
+	// next has to see them
+	_mm_sfence();
+#endif
+}
 
-    u32 w = config->width;
-    u32 h = config->height;
-	v3 sky_color = config->sky_color;
+template <u32 KINDS, u32 BOUNCES>
+static u64 render_tile_kinds(Tile *tile, Scene *scene, u32 *data, RayCastConfig *config, CancelToken *cancel, u32 first_row, bool stream) {
+	u32 w = config->width;
+	u32 h = config->height;
 
-    queue->tile_index++;
+	u32 rays_per_pixel = config->rays_per_pixel;
 
-    u32 rays_per_pixel = config->rays_per_pixel;
-    u32 bounces = config->max_bounces;
+	u64 total_bounces = 0;
 
-    u64 total_bounces = 0;
+	u32 stride = (tile->w + TILE_BUFFER_ALIGN / sizeof(u32) - 1) & ~(TILE_BUFFER_ALIGN / sizeof(u32) - 1);
+	u32 *pixels = get_tile_buffer(stride, tile->h);
+	// averages of a row, encoded together once it is done
+	v3 *row = (v3 *)(pixels + (u64)stride * tile->h);
+
+	for (u32 y = 0; y < tile->h; ++y) {
+		for (u32 x = 0; x < tile->w; ++x) {
+			if (is_cancelled(cancel)) {
+				commit_tile(data, w, first_row, tile, pixels, stride, y, stream);
+				return total_bounces;
+			}
 
-    for (u32 y = 0; y < tile->h; ++y) {
-        for (u32 x = 0; x < tile->w; ++x) {
 			v3 output = vec3(0.0);
 			u32 xx = x + tile->x;
 			u32 yy = y + tile->y;
 
-        	for (u32 i = 0; i < rays_per_pixel; ++i) {
-				f32 u = (f32)xx / (f32)w;
-				f32 v = (f32)yy / (f32)h;
+			f32 u = (f32)xx / (f32)w;
+			f32 v = (f32)yy / (f32)h;
+
+			Random random;
+			for (u32 i = 0; i < rays_per_pixel; ++i) {
+				Random *r = sample_random(config, tile, &random, yy * w + xx, config->sample_offset + i);
+				output = output + trace_path_kinds<KINDS, BOUNCES, false>(scene, config, u, v, r, &total_bounces, 0);
+			}
+
+			row[x] = output / rays_per_pixel;
+		}
+
+		linear_to_pixels(row, pixels + y * stride, tile->w);
+	}
 
-                Ray ray = camera_get_ray(camera, u, v, &tile->random);
+	commit_tile(data, w, first_row, tile, pixels, stride, tile->h, stream);
 
-                v3 attenuation = vec3(1.0f);
-                Ray scattered;
+	return total_bounces;
+}
 
-                for (u32 i = 0; i < bounces; ++i) {
-					total_bounces++;
+u64 raytrace_tile(WorkQueue *queue, Scene *scene, u32 *data, RayCastConfig *config, CancelToken *cancel) {
+	u32 tile_index = queue->tile_index++;
+	if (tile_index >= queue->tile_count) {
+		return 0;
+	}
 
-                    Hit hit = scan_hit(scene, &ray);
-                    v3 p = ray.origin + hit.t * ray.dir;
+	return render_tile(&queue->tiles[tile_index], scene, data, config, cancel);
+}
 
-                    if (hit.t < MAX_DIST) {
-                        Material material = scene->materials[hit.material_index];
+template <u32 KINDS, u32 BOUNCES, bool HITS>
+static u64 accumulate_tile_kinds(Tile *tile, Scene *scene, Framebuffer *fb, RayCastConfig *config, u32 samples, u64 deadline, CancelToken *cancel, u64 *hit_materials) {
+	u32 w = fb->width;
+	u32 h = fb->height;
 
-                        v3 catt;
-                        if (!scatter(material, &ray, p, hit.n, &catt, &tile->random)) {
-                            attenuation = vec3(0);
-                            break;
-                        }
+	u64 total_bounces = 0;
 
-                        attenuation = attenuation * catt;
-                    } else {
-                        break;
-                    }
-                }
+	for (u32 y = 0; y < tile->h; ++y) {
+		if (deadline && get_real_time() >= deadline) {
+			break;
+		}
 
-                output = output + attenuation * sky_color;
+		for (u32 x = 0; x < tile->w; ++x) {
+			if (is_cancelled(cancel)) {
+				return total_bounces;
 			}
 
-            output = output / rays_per_pixel;
+			v3 output = vec3(0.0);
+			u32 xx = x + tile->x;
+			u32 yy = y + tile->y;
 
-			output = clamp(output, 0.0f, 1.0f);
-			output = linear_to_srgb(output);
-			
-            data[yy * w + xx] = rgb_to_hex(output);
-        }
-    }
+			f32 u = (f32)xx / (f32)w;
+			f32 v = (f32)yy / (f32)h;
+
+			// samples continue the count of the pixel, so passes and re-traces
+			// draw the same streams as a render in one go
+			Random random;
+			u32 first_sample = config->sample_offset + fb->samples[yy * w + xx];
+			for (u32 i = 0; i < samples; ++i) {
+				Random *r = sample_random(config, tile, &random, yy * w + xx, first_sample + i);
+				output = output + trace_path_kinds<KINDS, BOUNCES, HITS>(scene, config, u, v, r, &total_bounces, hit_materials);
+			}
+
+			fb->color[yy * w + xx] = fb->color[yy * w + xx] + output;
+			fb->samples[yy * w + xx] += samples;
+		}
+	}
 
-    return total_bounces;
+	return total_bounces;
 }
 
-void raytrace_data(Scene *scene, u32 *data, RayCastConfig *config) {
-    WorkQueue queue;
-    
-    u32 w = config->width;
-    u32 h = config->height;
-    u32 ts = w / config->cores;
+/*
+ * The tile loops are compiled for every combination of the material kinds
+ * in trace_kind_variants and the bounce counts in trace_bounce_variants, the
+ * last of each being the generic one. render_tile and accumulate_tile pick
+ * the variant for the scene and config they are given.
+ */
+
+static constexpr u32 trace_kind_variants[] = { 1 << MATT, 1 << METALLIC, (1 << MATT) | (1 << METALLIC), u32_max };
+static constexpr u32 trace_bounce_variants[] = { 2, 4, 8, 0 };
+
+typedef u64 (*RenderTileFn)(Tile *tile, Scene *scene, u32 *data, RayCastConfig *config, CancelToken *cancel, u32 first_row, bool stream);
+typedef u64 (*AccumulateTileFn)(Tile *tile, Scene *scene, Framebuffer *fb, RayCastConfig *config, u32 samples, u64 deadline, CancelToken *cancel, u64 *hit_materials);
+
+#define TRACE_BOUNCE_VARIANTS(fn, k, ...) { \
+	fn<trace_kind_variants[k], trace_bounce_variants[0], ##__VA_ARGS__>, \
+	fn<trace_kind_variants[k], trace_bounce_variants[1], ##__VA_ARGS__>, \
+	fn<trace_kind_variants[k], trace_bounce_variants[2], ##__VA_ARGS__>, \
+	fn<trace_kind_variants[k], trace_bounce_variants[3], ##__VA_ARGS__> }
+
+#define TRACE_VARIANTS(fn, ...) { \
+	TRACE_BOUNCE_VARIANTS(fn, 0, ##__VA_ARGS__), \
+	TRACE_BOUNCE_VARIANTS(fn, 1, ##__VA_ARGS__), \
+	TRACE_BOUNCE_VARIANTS(fn, 2, ##__VA_ARGS__), \
+	TRACE_BOUNCE_VARIANTS(fn, 3, ##__VA_ARGS__) }
+
+static RenderTileFn render_tile_variants[4][4] = TRACE_VARIANTS(render_tile_kinds);
+static AccumulateTileFn accumulate_tile_variants[2][4][4] = {
+	TRACE_VARIANTS(accumulate_tile_kinds, false),
+	TRACE_VARIANTS(accumulate_tile_kinds, true),
+};
+
+static u32 trace_kind_variant(Scene *scene) {
+	u32 i = 0;
+	while (i < ARR_LEN(trace_kind_variants) - 1 && trace_kind_variants[i] != scene->material_kinds) {
+		i++;
+	}
+	return i;
+}
 
-    u32 tiles_x = (w + ts - 1) / ts;
-    u32 tiles_y = (h + ts - 1) / ts;
-    u32 tiles_count = tiles_x * tiles_y;
+static u32 trace_bounce_variant(RayCastConfig *config) {
+	u32 i = 0;
+	while (i < ARR_LEN(trace_bounce_variants) - 1 && trace_bounce_variants[i] != config->max_bounces) {
+		i++;
+	}
+	return i;
+}
 
-	printf("Running raytracer on %d cores\n", config->cores);
-	printf("%d tiles (%dx%d)\n", tiles_count, ts, ts);
-	printf("%d rays per pixel, max %d bounces\n", config->rays_per_pixel, config->max_bounces);
+u64 render_tile(Tile *tile, Scene *scene, u32 *data, RayCastConfig *config, CancelToken *cancel, u32 first_row, bool stream) {
+	RenderTileFn fn = render_tile_variants[trace_kind_variant(scene)][trace_bounce_variant(config)];
+	return fn(tile, scene, data, config, cancel, first_row, stream);
+}
 
-    queue.tiles = (Tile *)malloc(tiles_count * sizeof(Tile));
-    queue.tile_count = tiles_count;
-    queue.tile_index = 0;
+u64 accumulate_tile(Tile *tile, Scene *scene, Framebuffer *fb, RayCastConfig *config, u32 samples, u64 deadline, CancelToken *cancel, u64 *hit_materials) {
+	AccumulateTileFn fn = accumulate_tile_variants[hit_materials != 0][trace_kind_variant(scene)][trace_bounce_variant(config)];
+	return fn(tile, scene, fb, config, samples, deadline, cancel, hit_materials);
+}
 
-    for (u32 y = 0; y < tiles_y; ++y) {
-        for (u32 x = 0; x < tiles_x; ++x) {
-            u32 tx = x * ts;
-            u32 ty = y * ts;
+Framebuffer make_framebuffer(u32 width, u32 height, Arena *arena) {
+	Framebuffer fb = {};
 
-            u32 tw = ts;
-            u32 th = ts;
+	fb.width = width;
+	fb.height = height;
 
-            if (tx + tw > w) {
-                tw = w - tx;
-            }
+	if (arena) {
+		u64 mark = arena_mark(arena);
+		fb.color = ARENA_PUSH_ARRAY(arena, v3, width * height);
+		fb.samples = ARENA_PUSH_ARRAY(arena, u32, width * height);
+		fb.in_arena = fb.color && fb.samples;
 
-            if (ty + th > h) {
-                th = h - ty;
-            }
+		if (!fb.in_arena) {
+			arena_reset(arena, mark);
+		}
+	}
 
-            queue.tiles[y * tiles_x + x] = {{(u32) rand()}, tx, ty, tw, th};
-        }
-    }
+	if (!fb.in_arena) {
+		fb.color = (v3 *)malloc(width * height * sizeof(v3));
+		fb.samples = (u32 *)malloc(width * height * sizeof(u32));
+	}
+
+	clear_framebuffer(&fb);
+
+	return fb;
+}
+
+void clear_framebuffer(Framebuffer *fb) {
+	memset(fb->color, 0, fb->width * fb->height * sizeof(v3));
+	memset(fb->samples, 0, fb->width * fb->height * sizeof(u32));
+}
+
+void free_framebuffer(Framebuffer *fb) {
+	if (!fb->in_arena) {
+		free(fb->color);
+		free(fb->samples);
+	}
+
+	fb->color = 0;
+	fb->samples = 0;
+}
+
+void merge_framebuffer(Framebuffer *into, Framebuffer *from) {
+	u32 count = into->width * into->height;
+
+	for (u32 i = 0; i < count; ++i) {
+		into->color[i] = into->color[i] + from->color[i];
+		into->samples[i] += from->samples[i];
+	}
+}
+
+#define RESOLVE_CHUNK 256
+
+// count consecutive pixels from index i, averaged a chunk at a time and
+// encoded together
+static void resolve_pixels(Framebuffer *fb, u32 i, u32 *data, u32 count) {
+	v3 averages[RESOLVE_CHUNK];
+
+	for (u32 done = 0; done < count; done += RESOLVE_CHUNK) {
+		u32 n = min(count - done, RESOLVE_CHUNK);
+
+		for (u32 j = 0; j < n; ++j) {
+			u32 samples = fb->samples[i + done + j];
+			averages[j] = samples ? fb->color[i + done + j] / (f32)samples : vec3(0.0);
+		}
+
+		linear_to_pixels(averages, data + done, n);
+	}
+}
+
+void resolve_framebuffer(Framebuffer *fb, u32 *data) {
+	resolve_pixels(fb, 0, data, fb->width * fb->height);
+}
+
+void resolve_framebuffer_linear(Framebuffer *fb, v3 *pixels) {
+	u32 count = fb->width * fb->height;
+
+	for (u32 i = 0; i < count; ++i) {
+		pixels[i] = fb->samples[i] ? fb->color[i] / (f32)fb->samples[i] : vec3(0.0);
+	}
+}
+
+void resolve_framebuffer_tile(Framebuffer *fb, u32 *data, Tile *tile) {
+	for (u32 y = tile->y; y < tile->y + tile->h; ++y) {
+		u32 i = y * fb->width + tile->x;
+		resolve_pixels(fb, i, data + i, tile->w);
+	}
+}
+
+Scene copy_scene(Scene *scene) {
+	Scene copy = *scene;
+	copy.arena = 0;
+
+	copy.planes = (Plane *)malloc(scene->num_planes * sizeof(Plane));
+	copy.spheres = (Sphere *)malloc(scene->num_spheres * sizeof(Sphere));
+	copy.materials = (Material *)malloc(scene->num_materials * sizeof(Material));
+
+	memcpy(copy.planes, scene->planes, scene->num_planes * sizeof(Plane));
+	memcpy(copy.spheres, scene->spheres, scene->num_spheres * sizeof(Sphere));
+	memcpy(copy.materials, scene->materials, scene->num_materials * sizeof(Material));
+
+	if (scene->bvh) {
+		copy.bvh = (Bvh *)malloc(sizeof(Bvh));
+		*copy.bvh = bvh_copy(scene->bvh);
+	}
+
+	if (scene->wide_bvh) {
+		copy.wide_bvh = (Bvh8 *)malloc(sizeof(Bvh8));
+		*copy.wide_bvh = bvh8_copy(scene->wide_bvh);
+	}
+
+	copy.objects = (Object *)malloc(scene->num_objects * sizeof(Object));
+	for (u32 i = 0; i < scene->num_objects; ++i) {
+		Object *object = &scene->objects[i];
+		Object *object_copy = &copy.objects[i];
+		*object_copy = *object;
+
+		object_copy->spheres = (Sphere *)malloc(object->num_spheres * sizeof(Sphere));
+		memcpy(object_copy->spheres, object->spheres, object->num_spheres * sizeof(Sphere));
+
+		if (object->bvh) {
+			object_copy->bvh = (Bvh *)malloc(sizeof(Bvh));
+			*object_copy->bvh = bvh_copy(object->bvh);
+		}
+	}
+
+	copy.instances = (Instance *)malloc(scene->num_instances * sizeof(Instance));
+	memcpy(copy.instances, scene->instances, scene->num_instances * sizeof(Instance));
+
+	if (scene->instance_bvh) {
+		copy.instance_bounds = (Sphere *)malloc(scene->num_instances * sizeof(Sphere));
+		memcpy(copy.instance_bounds, scene->instance_bounds, scene->num_instances * sizeof(Sphere));
+
+		copy.instance_bvh = (Bvh *)malloc(sizeof(Bvh));
+		*copy.instance_bvh = bvh_copy(scene->instance_bvh);
+	}
+
+	return copy;
+}
+
+void free_scene_copy(Scene *scene) {
+	free_scene_bvh(scene);
+
+	for (u32 i = 0; i < scene->num_objects; ++i) {
+		free(scene->objects[i].spheres);
+	}
+
+	free(scene->planes);
+	free(scene->spheres);
+	free(scene->materials);
+	free(scene->objects);
+	free(scene->instances);
+
+	scene->planes = 0;
+	scene->spheres = 0;
+	scene->materials = 0;
+	scene->objects = 0;
+	scene->instances = 0;
+}
+
+void scene_mark_dirty(Scene *scene, u32 flags) {
+	// without the indices anything may have changed, same as an overflowed list
+	if (flags & SCENE_DIRTY_SPHERES) {
+		scene->num_dirty_spheres = SCENE_MAX_DIRTY_SPHERES + 1;
+	}
+	if (flags & SCENE_DIRTY_MATERIALS) {
+		scene->num_dirty_materials = SCENE_MAX_DIRTY_MATERIALS + 1;
+	}
+
+	scene->dirty |= flags;
+}
+
+void scene_mark_sphere_dirty(Scene *scene, u32 sphere_index) {
+	if (!(scene->dirty & SCENE_DIRTY_SPHERES)) {
+		scene->num_dirty_spheres = 0;
+	}
+	scene->dirty |= SCENE_DIRTY_SPHERES;
+
+	// past the limit the list is dropped and the whole tree is refit
+	if (scene->num_dirty_spheres > SCENE_MAX_DIRTY_SPHERES) {
+		return;
+	}
 
-    u64 before = get_real_time();
+	for (u32 i = 0; i < scene->num_dirty_spheres; ++i) {
+		if (scene->dirty_spheres[i] == sphere_index) {
+			return;
+		}
+	}
+
+	if (scene->num_dirty_spheres == SCENE_MAX_DIRTY_SPHERES) {
+		scene->num_dirty_spheres++;
+		return;
+	}
+
+	scene->dirty_spheres[scene->num_dirty_spheres++] = sphere_index;
+}
+
+void scene_mark_material_dirty(Scene *scene, u32 material_index) {
+	if (!(scene->dirty & SCENE_DIRTY_MATERIALS)) {
+		scene->num_dirty_materials = 0;
+	}
+	scene->dirty |= SCENE_DIRTY_MATERIALS;
+
+	if (scene->num_dirty_materials > SCENE_MAX_DIRTY_MATERIALS) {
+		return;
+	}
+
+	for (u32 i = 0; i < scene->num_dirty_materials; ++i) {
+		if (scene->dirty_materials[i] == material_index) {
+			return;
+		}
+	}
+
+	if (scene->num_dirty_materials == SCENE_MAX_DIRTY_MATERIALS) {
+		scene->num_dirty_materials++;
+		return;
+	}
+
+	scene->dirty_materials[scene->num_dirty_materials++] = material_index;
+}
+
+static u32 used_material_kinds(Scene *scene) {
+	u32 kinds = 0;
+
+	for (u32 i = 0; i < scene->num_spheres; ++i) {
+		u32 kind = scene->materials[scene->spheres[i].material_index].kind;
+		kinds |= 1u << min(kind, 31u);
+	}
+	for (u32 i = 0; i < scene->num_planes; ++i) {
+		u32 kind = scene->materials[scene->planes[i].material_index].kind;
+		kinds |= 1u << min(kind, 31u);
+	}
+
+	// objects are counted whole if any instance keeps their materials, more
+	// kinds than needed only cost the kernels some speed
+	bool object_materials = false;
+	for (u32 i = 0; i < scene->num_instances; ++i) {
+		u32 material_index = scene->instances[i].material_index;
+		if (material_index == INSTANCE_OBJECT_MATERIALS) {
+			object_materials = true;
+		} else {
+			kinds |= 1u << min(scene->materials[material_index].kind, 31u);
+		}
+	}
+	for (u32 i = 0; object_materials && i < scene->num_objects; ++i) {
+		Object *object = &scene->objects[i];
+		for (u32 j = 0; j < object->num_spheres; ++j) {
+			u32 kind = scene->materials[object->spheres[j].material_index].kind;
+			kinds |= 1u << min(kind, 31u);
+		}
+	}
+
+	return kinds;
+}
+
+static void free_wide_bvh(Scene *scene) {
+	if (scene->wide_bvh) {
+		bvh8_free(scene->wide_bvh);
+		free(scene->wide_bvh);
+		scene->wide_bvh = 0;
+	}
+}
+
+// collapses the sphere bvh again where the wide one is faster
+static void update_wide_bvh(Scene *scene) {
+#ifdef BVH8_SCENES
+	if (scene->num_spheres >= BVH8_MIN_SPHERES) {
+		if (!scene->wide_bvh) {
+			scene->wide_bvh = (Bvh8 *)calloc(1, sizeof(Bvh8));
+		}
+		bvh8_build(scene->wide_bvh, scene->bvh);
+		return;
+	}
+#endif
+	free_wide_bvh(scene);
+}
+
+static void free_sphere_bvh(Scene *scene) {
+	free_wide_bvh(scene);
+
+	if (scene->bvh) {
+		bvh_free(scene->bvh);
+		if (!scene->arena || !arena_owns(scene->arena, scene->bvh)) {
+			free(scene->bvh);
+		}
+		scene->bvh = 0;
+	}
+}
+
+static void free_instance_bvh(Scene *scene) {
+	if (scene->instance_bvh) {
+		bvh_free(scene->instance_bvh);
+		free(scene->instance_bvh);
+		scene->instance_bvh = 0;
+	}
+
+	free(scene->instance_bounds);
+	scene->instance_bounds = 0;
+}
+
+// builds the bvh of every object that has none (all of them if `all`) and
+// returns how many were built
+static u32 update_objects(Scene *scene, bool all) {
+	u32 built = 0;
+
+	for (u32 i = 0; i < scene->num_objects; ++i) {
+		Object *object = &scene->objects[i];
+		if (object->bvh && !all) {
+			continue;
+		}
+
+		if (object->bvh) {
+			bvh_free(object->bvh);
+		} else {
+			object->bvh = (Bvh *)malloc(sizeof(Bvh));
+		}
+		bvh_build(object->bvh, object->spheres, object->num_spheres);
+
+		// around the center of the box, tighter than its corners for round objects
+		v3 center = object->num_spheres ? (object->bvh->nodes[0].bounds.min + object->bvh->nodes[0].bounds.max) * 0.5f : vec3(0);
+		f32 radius = 0;
+		for (u32 j = 0; j < object->num_spheres; ++j) {
+			Sphere *sphere = &object->spheres[j];
+			radius = max(radius, length(sphere->center - center) + sphere->radius);
+		}
+
+		object->center = center;
+		object->radius = radius;
+		built++;
+	}
+
+	return built;
+}
+
+// bounds every instance by its object's sphere in world space and builds the
+// top level over them
+static void build_instance_bvh(Scene *scene) {
+	free_instance_bvh(scene);
+
+	if (!scene->num_instances) {
+		return;
+	}
+
+	scene->instance_bounds = (Sphere *)malloc(scene->num_instances * sizeof(Sphere));
+
+	for (u32 i = 0; i < scene->num_instances; ++i) {
+		Instance *instance = &scene->instances[i];
+		Object *object = &scene->objects[instance->object];
+		v3 c = object->center;
+
+		// the longest column bounds the stretch of a rotation and scale, a
+		// skewed transform is bounded by all of them together
+		f32 lx = length2(instance->x);
+		f32 ly = length2(instance->y);
+		f32 lz = length2(instance->z);
+		f32 skew = fabsf(dot(instance->x, instance->y)) + fabsf(dot(instance->y, instance->z)) + fabsf(dot(instance->z, instance->x));
+		f32 stretch = sqrtf(skew > 1e-6f * (lx + ly + lz) ? lx + ly + lz : max(lx, max(ly, lz)));
+
+		Sphere *bounds = &scene->instance_bounds[i];
+		bounds->center = instance->x * c.x + instance->y * c.y + instance->z * c.z + instance->position;
+		bounds->radius = object->radius * stretch;
+		bounds->material_index = 0;
+	}
+
+	scene->instance_bvh = (Bvh *)malloc(sizeof(Bvh));
+	bvh_build(scene->instance_bvh, scene->instance_bounds, scene->num_instances);
+}
+
+void scene_update(Scene *scene, SceneUpdateStats *stats, ThreadPool *pool) {
+	u64 start = get_real_time();
+	u32 kind = SCENE_UPDATE_NONE;
+	u32 refit_spheres = 0;
+
+	bool full_refit = (scene->dirty & SCENE_DIRTY_SPHERES) && scene->num_dirty_spheres > SCENE_MAX_DIRTY_SPHERES;
+	bool rebuild = !scene->bvh ||
+		(scene->dirty & SCENE_DIRTY_TOPOLOGY) ||
+		scene->bvh->prim_count != scene->num_spheres ||
+		// a linear build costs about as much as the refit and keeps the tree tight
+		(scene->dynamic && full_refit);
+	bool linear = scene->dynamic || (scene->interactive && !scene->bvh);
+
+	if (rebuild) {
+		Arena *arena = scene->arena;
+		bool reuse = arena && arena_owns(arena, scene->bvh) && arena_mark(arena) == scene->bvh_end;
+
+		free_sphere_bvh(scene);
+
+		if (arena) {
+			if (reuse) {
+				arena_reset(arena, scene->bvh_mark);
+			}
+			scene->bvh_mark = arena_mark(arena);
+			scene->bvh = ARENA_PUSH_ARRAY(arena, Bvh, 1);
+		}
+
+		if (!scene->bvh) {
+			scene->bvh = (Bvh *)malloc(sizeof(Bvh));
+			arena = 0;
+		}
+
+		if (linear) {
+			bvh_build_linear(scene->bvh, scene->spheres, scene->num_spheres, pool, arena);
+		} else {
+			bvh_build(scene->bvh, scene->spheres, scene->num_spheres, arena);
+		}
+
+		if (arena) {
+			scene->bvh_end = arena_mark(arena);
+		}
+
+		kind = SCENE_UPDATE_REBUILD;
+	} else if (scene->dirty & SCENE_DIRTY_SPHERES) {
+		if (full_refit) {
+			bvh_refit(scene->bvh, scene->spheres);
+		} else {
+			for (u32 i = 0; i < scene->num_dirty_spheres; ++i) {
+				bvh_refit_sphere(scene->bvh, scene->spheres, scene->dirty_spheres[i]);
+			}
+			refit_spheres = scene->num_dirty_spheres;
+		}
+
+		kind = SCENE_UPDATE_REFIT;
+	} else if (scene->dirty & SCENE_DIRTY_MATERIALS) {
+		kind = SCENE_UPDATE_MATERIALS;
+	} else if (scene->dirty & SCENE_DIRTY_CAMERA) {
+		kind = SCENE_UPDATE_CAMERA;
+	}
+
+	if (kind == SCENE_UPDATE_REBUILD || kind == SCENE_UPDATE_REFIT) {
+		update_wide_bvh(scene);
+	}
+
+	// objects are only rebuilt when their spheres changed, moving instances
+	// around is a rebuild of the (small) top level
+	u32 objects_built = update_objects(scene, scene->dirty & SCENE_DIRTY_OBJECTS);
+	bool instances = objects_built ||
+		(scene->dirty & SCENE_DIRTY_INSTANCES) ||
+		(scene->num_instances && !scene->instance_bvh) ||
+		(scene->instance_bvh && scene->instance_bvh->prim_count != scene->num_instances);
+
+	if (instances) {
+		build_instance_bvh(scene);
+		u32 instance_kind = objects_built ? SCENE_UPDATE_REBUILD : SCENE_UPDATE_INSTANCES;
+		kind = max(kind, instance_kind);
+	}
+
+	// primitives that switch materials mark those dirty as well
+	if (rebuild || instances || (scene->dirty & SCENE_DIRTY_MATERIALS)) {
+		scene->material_kinds = used_material_kinds(scene);
+	}
+
+	scene->dirty = 0;
+	scene->num_dirty_spheres = 0;
+	scene->num_dirty_materials = 0;
+
+	if (stats) {
+		stats->kind = kind;
+		stats->refit_spheres = refit_spheres;
+		stats->linear_bvh = rebuild && linear;
+		stats->time_us = get_real_time() - start;
+	}
+}
+
+bool scene_replace_bvh(Scene *scene, Bvh *bvh) {
+	if (bvh->prim_count != scene->num_spheres) {
+		return false;
+	}
+
+	// the old tree's arena space goes back if nothing was pushed after it
+	Arena *arena = scene->arena;
+	bool reclaim = arena && arena_owns(arena, scene->bvh) && arena_mark(arena) == scene->bvh_end;
+
+	free_sphere_bvh(scene);
+	if (reclaim) {
+		arena_reset(arena, scene->bvh_mark);
+	}
+
+	bvh_refit(bvh, scene->spheres);
+	scene->bvh = bvh;
+	update_wide_bvh(scene);
+
+	return true;
+}
+
+void free_scene_bvh(Scene *scene) {
+	free_sphere_bvh(scene);
+	free_instance_bvh(scene);
+
+	for (u32 i = 0; i < scene->num_objects; ++i) {
+		Object *object = &scene->objects[i];
+		if (object->bvh) {
+			bvh_free(object->bvh);
+			free(object->bvh);
+			object->bvh = 0;
+		}
+	}
+}
+
+const char *scene_update_name(u32 kind) {
+	switch (kind) {
+		case SCENE_UPDATE_CAMERA: return "camera";
+		case SCENE_UPDATE_MATERIALS: return "materials";
+		case SCENE_UPDATE_INSTANCES: return "instances";
+		case SCENE_UPDATE_REFIT: return "refit";
+		case SCENE_UPDATE_REBUILD: return "rebuild";
+	}
+	return "none";
+}
+
+void init_work_queue(WorkQueue *queue, RayCastConfig *config, Arena *arena) {
+	u32 w = config->width;
+	u32 h = config->height;
+	u32 ts = config->tile_size ? config->tile_size : w / config->cores;
+
+	u32 tiles_x = (w + ts - 1) / ts;
+	u32 tiles_y = (h + ts - 1) / ts;
+	u32 tiles_count = tiles_x * tiles_y;
+
+	queue->tiles = arena ? ARENA_PUSH_ARRAY(arena, Tile, tiles_count) : 0;
+	queue->in_arena = queue->tiles != 0;
+	if (!queue->tiles) {
+		queue->tiles = (Tile *)malloc(tiles_count * sizeof(Tile));
+	}
+	queue->tile_count = tiles_count;
+	queue->tile_index = 0;
+
+	for (u32 y = 0; y < tiles_y; ++y) {
+		for (u32 x = 0; x < tiles_x; ++x) {
+			u32 tx = x * ts;
+			u32 ty = y * ts;
+
+			u32 tw = ts;
+			u32 th = ts;
+
+			if (tx + tw > w) {
+				tw = w - tx;
+			}
+
+			if (ty + th > h) {
+				th = h - ty;
+			}
+
+			queue->tiles[y * tiles_x + x] = {{(u32) rand()}, tx, ty, tw, th};
+		}
+	}
+}
+
+void free_work_queue(WorkQueue *queue) {
+	if (!queue->in_arena) {
+		free(queue->tiles);
+	}
+	queue->tiles = 0;
+	queue->tile_count = 0;
+}
+
+// the result goes to exactly one of data, linear or sums
+static void raytrace_image(Scene *scene, u32 *data, v3 *linear, Framebuffer *sums, RayCastConfig *config, RenderStats *stats, CancelToken *cancel) {
+	ThreadPool local_pool;
+	ThreadPool *pool = config->pool;
+	if (!pool) {
+		// the calling thread helps while waiting, so it counts as one core
+		thread_pool_init(&local_pool, config->cores - 1);
+		pool = &local_pool;
+	}
+
+	SceneUpdateStats update;
+	scene_update(scene, &update, pool);
+
+	// after the update, a rebuilt bvh may land in the scratch arena
+	Arena *scratch = config->scratch;
+	u64 scratch_mark = scratch ? arena_mark(scratch) : 0;
+
+	WorkQueue queue;
+	init_work_queue(&queue, config, scratch);
+
+	u32 w = config->width;
+	u32 h = config->height;
+	u32 tiles_count = queue.tile_count;
+
+	if (config->verbose) {
+		printf("Running raytracer on %d cores\n", config->cores);
+		if (update.kind != SCENE_UPDATE_NONE) {
+			printf("Scene update (%s%s) took %.3f ms\n", scene_update_name(update.kind), update.linear_bvh ? ", linear bvh" : "", update.time_us / 1000.0);
+		}
+		printf("%d tiles (%dx%d)\n", tiles_count, queue.tiles[0].w, queue.tiles[0].h);
+		if (config->time_budget_ms) {
+			printf("%d ms budget, up to %d rays per pixel, max %d bounces\n", config->time_budget_ms, config->rays_per_pixel, config->max_bounces);
+		} else {
+			printf("%d rays per pixel, max %d bounces\n", config->rays_per_pixel, config->max_bounces);
+		}
+	}
+
+	u64 before = get_real_time();
 	u64 before_cpu_time = get_cpu_time();
-    
-    std::vector<std::thread> threads;
 
-    std::atomic<u64> total_bounces = 0;
+	std::atomic<u64> total_bounces = 0;
+	u64 total_samples = (u64)w * h * config->rays_per_pixel;
+	u32 passes = 1;
+	u64 idle_time = 0;
+
+	std::atomic<u64> perf_totals[PERF_COUNTER_COUNT] = {};
+	std::atomic<u32> perf_available = config->perf_counters ? u32_max : 0;
+
+	// drains the queue on every core, calling tile_fn for each claimed tile
+	auto run_workers = [&](auto tile_fn, bool show_progress) {
+		thread_pool_run(pool, config->cores, [&](u32 worker) {
+			PerfCounters counters;
+			if (config->perf_counters) {
+				perf_available &= perf_counters_open(&counters);
+				perf_counters_start(&counters);
+			}
 
-    auto loop = [&]() {
-        while (queue.tile_index < queue.tile_count) {
-            total_bounces += raytrace_tile(&queue, scene, data, config);
+			while (!is_cancelled(cancel)) {
+				u32 tile_index = queue.tile_index++;
+				if (tile_index >= queue.tile_count) {
+					break;
+				}
 
-            u32 percentage = (u32)((f32)(queue.tile_index + 0) / (f32)queue.tile_count * 100);
-            printf("\rRaytrace %3d%%", percentage);
-            fflush(stdout);
-        }
-    };
+				total_bounces += tile_fn(&queue.tiles[tile_index]);
 
-    for (u32 i = 0; i < config->cores; ++i) {
-        std::thread t(loop);
+				if (config->verbose && show_progress) {
+					u32 percentage = (u32)((f32)(tile_index + 1) / (f32)queue.tile_count * 100);
+					printf("\rRaytrace %3d%%", percentage);
+					fflush(stdout);
+				}
+			}
 
-        threads.push_back(move(t));
-    }
+			if (config->perf_counters) {
+				perf_counters_stop(&counters);
+				perf_counters_close(&counters);
 
-    for (auto &t : threads) {
-        t.join();
-    }
+				perf_available &= counters.available;
+				for (u32 i = 0; i < PERF_COUNTER_COUNT; ++i) {
+					perf_totals[i] += counters.values[i];
+				}
+			}
+		});
+	};
+
+	if (config->time_budget_ms || config->checkpoint_path) {
+		Framebuffer fb = sums ? *sums : make_framebuffer(w, h, scratch);
+
+		u64 deadline = config->time_budget_ms ? before + (u64)config->time_budget_ms * 1000 : 0;
+		u32 samples_per_pass = max(config->samples_per_pass, 1);
+		u32 samples_done = 0;
+
+		passes = 0;
+
+		u64 render_hash = config->checkpoint_path ? hash_render(scene, config) : 0;
+
+		if (config->checkpoint_path && config->resume) {
+			Checkpoint checkpoint;
+
+			if (!read_checkpoint(config->checkpoint_path, &checkpoint)) {
+				if (config->verbose) printf("No checkpoint at %s, starting over\n", config->checkpoint_path);
+			} else if (checkpoint.scene_hash != render_hash || checkpoint.width != w ||
+				checkpoint.height != h || checkpoint.tile_count != tiles_count) {
+				if (config->verbose) printf("Checkpoint %s is for a different render, starting over\n", config->checkpoint_path);
+				free_checkpoint(&checkpoint);
+			} else {
+				memcpy(fb.color, checkpoint.color, w * h * sizeof(v3));
+				memcpy(fb.samples, checkpoint.samples, w * h * sizeof(u32));
+
+				for (u32 i = 0; i < tiles_count; ++i) {
+					queue.tiles[i].random = checkpoint.tile_randoms[i];
+				}
+
+				samples_done = checkpoint.samples_done;
+				passes = checkpoint.passes;
+
+				if (config->verbose) printf("Resuming at %d rays per pixel\n", samples_done);
+				free_checkpoint(&checkpoint);
+			}
+		}
+
+		// checkpoints are copied between passes and written on their own thread,
+		// a checkpoint is skipped if the previous one is still being written
+		Checkpoint snapshot = {};
+		std::thread writer;
+		std::atomic<bool> writing = false;
+		u64 last_checkpoint = get_real_time();
+
+		while (samples_done < config->rays_per_pixel) {
+			u32 samples = min(samples_per_pass, config->rays_per_pixel - samples_done);
+
+			// the first pass always completes so no pixel is left without a sample
+			u64 pass_deadline = passes ? deadline : 0;
+
+			queue.tile_index = 0;
+			run_workers([&](Tile *tile) {
+				return accumulate_tile(tile, scene, &fb, config, samples, pass_deadline, cancel);
+			}, false);
+
+			if (is_cancelled(cancel)) {
+				idle_time = get_real_time();
+				break;
+			}
+
+			samples_done += samples;
+			passes++;
+
+			if (config->verbose) {
+				printf("\rRaytrace pass %3d, %4d rays per pixel", passes, samples_done);
+				fflush(stdout);
+			}
+
+			u64 now = get_real_time();
+			bool out_of_time = deadline && now >= deadline;
+
+			if (config->checkpoint_path && !out_of_time && !writing &&
+				samples_done < config->rays_per_pixel &&
+				now - last_checkpoint >= (u64)config->checkpoint_interval_ms * 1000) {
+				if (writer.joinable()) {
+					writer.join();
+				}
+
+				if (!snapshot.color) {
+					snapshot = make_checkpoint(w, h, tiles_count);
+				}
+
+				snapshot.scene_hash = render_hash;
+				snapshot.samples_done = samples_done;
+				snapshot.passes = passes;
 
-    u64 after = get_real_time();
+				memcpy(snapshot.color, fb.color, w * h * sizeof(v3));
+				memcpy(snapshot.samples, fb.samples, w * h * sizeof(u32));
+
+				for (u32 i = 0; i < tiles_count; ++i) {
+					snapshot.tile_randoms[i] = queue.tiles[i].random;
+				}
+
+				writing = true;
+				writer = std::thread([&]() {
+					if (!write_checkpoint(config->checkpoint_path, &snapshot)) {
+						fprintf(stderr, "Could not write checkpoint %s\n", config->checkpoint_path);
+					}
+					writing = false;
+				});
+
+				last_checkpoint = now;
+			}
+
+			if (out_of_time) {
+				break;
+			}
+		}
+
+		if (writer.joinable()) {
+			writer.join();
+		}
+		free_checkpoint(&snapshot);
+
+		// a finished render has nothing left to resume
+		if (config->checkpoint_path && samples_done >= config->rays_per_pixel) {
+			remove(config->checkpoint_path);
+		}
+
+		if (data) {
+			resolve_framebuffer(&fb, data);
+		} else if (linear) {
+			resolve_framebuffer_linear(&fb, linear);
+		}
+
+		total_samples = 0;
+		for (u32 i = 0; i < w * h; ++i) {
+			total_samples += fb.samples[i];
+		}
+
+		if (!sums) {
+			free_framebuffer(&fb);
+		}
+	} else if (data) {
+		run_workers([&](Tile *tile) {
+			return render_tile(tile, scene, data, config, cancel);
+		}, true);
+
+		idle_time = get_real_time();
+	} else if (sums) {
+		run_workers([&](Tile *tile) {
+			return accumulate_tile(tile, scene, sums, config, config->rays_per_pixel, 0, cancel);
+		}, true);
+
+		idle_time = get_real_time();
+	} else {
+		// sums straight into the output, divided once every tile is done
+		Framebuffer fb = { w, h, linear, scratch ? ARENA_PUSH_ARRAY(scratch, u32, w * h) : 0 };
+		fb.in_arena = fb.samples != 0;
+		if (!fb.in_arena) {
+			fb.samples = (u32 *)malloc(w * h * sizeof(u32));
+		}
+		clear_framebuffer(&fb);
+
+		run_workers([&](Tile *tile) {
+			return accumulate_tile(tile, scene, &fb, config, config->rays_per_pixel, 0, cancel);
+		}, true);
+
+		idle_time = get_real_time();
+
+		resolve_framebuffer_linear(&fb, linear);
+		if (!fb.in_arena) {
+			free(fb.samples);
+		}
+	}
+
+	u64 after = get_real_time();
 	u64 after_cpu_time = get_cpu_time();
 	u64 diff = after - before;
 	u64 diff_cpu_time = after_cpu_time - before_cpu_time;
 
+	if (pool == &local_pool) {
+		thread_pool_destroy(&local_pool);
+	}
+
+	free_work_queue(&queue);
+	if (scratch) {
+		arena_reset(scratch, scratch_mark);
+	}
+
 	u64 bounces = total_bounces;
-	putc('\n', stdout);
-	printf("Raytracing took %llu ms\n", diff);
-    printf("Total bounces %llu\n", bounces);
-    printf("Performance %fms/bounce\n", (f64)diff / (f64)bounces);
-    printf("Performance %fcycles/bounce\n", (f64)diff_cpu_time / (f64)bounces);
+
+	if (stats) {
+		stats->time_us = diff;
+		stats->cpu_time = diff_cpu_time;
+		stats->total_bounces = bounces;
+		stats->total_samples = total_samples;
+		stats->passes = passes;
+
+		stats->cancelled = is_cancelled(cancel);
+		stats->cancel_latency_us = 0;
+		if (stats->cancelled && idle_time > cancel->cancel_time) {
+			stats->cancel_latency_us = idle_time - cancel->cancel_time;
+		}
+
+		stats->perf_available = perf_available;
+		for (u32 i = 0; i < PERF_COUNTER_COUNT; ++i) {
+			stats->perf[i] = perf_totals[i];
+		}
+	}
+
+	if (config->verbose) {
+		putc('\n', stdout);
+		if (is_cancelled(cancel)) {
+			printf("Cancelled\n");
+		}
+		printf("Raytracing took %llu ms\n", (unsigned long long)(diff / 1000));
+		if (config->time_budget_ms || config->checkpoint_path) {
+			printf("%d passes, %.1f rays per pixel on average\n", passes, (f64)total_samples / (f64)(w * h));
+		}
+		printf("Total bounces %llu\n", (unsigned long long)bounces);
+		printf("Performance %fms/bounce\n", (f64)diff / 1000.0 / (f64)bounces);
+		printf("Performance %fcycles/bounce\n", (f64)diff_cpu_time / (f64)bounces);
+
+		if (config->perf_counters) {
+			u32 available = perf_available;
+			if (!available) {
+				printf("Hardware counters unavailable\n");
+			}
+
+			for (u32 i = 0; i < PERF_COUNTER_COUNT; ++i) {
+				if (available & (1 << i)) {
+					printf("Counter %s %f/bounce\n", perf_counter_name(i), (f64)perf_totals[i] / (f64)bounces);
+				}
+			}
+
+			if ((available & (1 << PERF_CYCLES)) && (available & (1 << PERF_INSTRUCTIONS))) {
+				printf("IPC %f\n", (f64)perf_totals[PERF_INSTRUCTIONS] / (f64)perf_totals[PERF_CYCLES]);
+			}
+		}
+	}
+}
+
+void raytrace_data(Scene *scene, u32 *data, RayCastConfig *config, RenderStats *stats, CancelToken *cancel) {
+	raytrace_image(scene, data, 0, 0, config, stats, cancel);
+}
+
+void raytrace_linear(Scene *scene, v3 *pixels, RayCastConfig *config, RenderStats *stats, CancelToken *cancel) {
+	raytrace_image(scene, 0, pixels, 0, config, stats, cancel);
+}
+
+void raytrace_sums(Scene *scene, Framebuffer *sums, RayCastConfig *config, RenderStats *stats, CancelToken *cancel) {
+	raytrace_image(scene, 0, 0, sums, config, stats, cancel);
 }
 
 u32 *raytrace(Scene *scene, RayCastConfig *config) {
-    u32 *data = (u32 *)malloc(config->width * config->height * sizeof(u32));
+	u32 *data = (u32 *)malloc(config->width * config->height * sizeof(u32));
+
+	raytrace_data(scene, data, config);
+
+	return data;
+}
+
+bool raytrace_bands(Scene *scene, RayCastConfig *config, u32 *image, WriteBandFn write_band, void *user, RenderStats *stats) {
+	scene_update(scene, 0, config->pool);
+
+	RayCastConfig band_config = *config;
+	if (!band_config.tile_size) {
+		band_config.tile_size = RAYTRACE_BAND_TILE_SIZE;
+	}
+
+	Arena *scratch = config->scratch;
+	u64 scratch_mark = scratch ? arena_mark(scratch) : 0;
+
+	WorkQueue queue;
+	init_work_queue(&queue, &band_config, scratch);
+
+	u32 w = config->width;
+	u32 ts = band_config.tile_size;
+	u32 tiles_x = (w + ts - 1) / ts;
+	u32 bands = queue.tile_count / tiles_x;
+
+	if (config->verbose) {
+		printf("Running raytracer on %d cores\n", config->cores);
+		printf("%d bands of %d tiles (%dx%d)\n", bands, tiles_x, ts, ts);
+		printf("%d rays per pixel, max %d bounces\n", config->rays_per_pixel, config->max_bounces);
+	}
 
-    raytrace_data(scene, data, config);
+	ThreadPool local_pool;
+	ThreadPool *pool = config->pool;
+	if (!pool) {
+		thread_pool_init(&local_pool, config->cores - 1);
+		pool = &local_pool;
+	}
+
+	u64 before = get_real_time();
+	u64 before_cpu_time = get_cpu_time();
+	std::atomic<u64> total_bounces = 0;
+	std::atomic<bool> ok = true;
+
+	u32 *band = 0;
+
+	if (image) {
+		// one queue over all tiles, top band first, whoever finishes the
+		// last tile of a band hands it on while the others keep rendering
+		std::atomic<u32> *remaining = new std::atomic<u32>[bands];
+		for (u32 b = 0; b < bands; ++b) {
+			remaining[b] = tiles_x;
+		}
+
+		std::atomic<u32> next = 0;
+		std::atomic<u32> bands_done = 0;
+
+		thread_pool_run(pool, config->cores, [&](u32 worker) {
+			while (ok) {
+				u32 claim = next++;
+				if (claim >= queue.tile_count) {
+					break;
+				}
+
+				u32 index = queue.tile_count - 1 - claim;
+				Tile *tile = &queue.tiles[index];
+				// the last tile of a band is encoded from the cache right away
+				total_bounces += render_tile(tile, scene, image, &band_config, 0, 0, false);
+
+				u32 b = index / tiles_x;
+				if (--remaining[b] == 0) {
+					if (!write_band(user, image + (u64)tile->y * w, tile->y, tile->h)) {
+						ok = false;
+					}
+
+					if (config->verbose) {
+						printf("\rRaytrace %3d%%", (u32)((f32)++bands_done / (f32)bands * 100));
+						fflush(stdout);
+					}
+				}
+			}
+		});
+
+		delete[] remaining;
+	} else {
+		band = scratch ? ARENA_PUSH_ARRAY(scratch, u32, (u64)w * ts) : 0;
+		if (!band) {
+			band = (u32 *)malloc((u64)w * ts * sizeof(u32));
+		}
+	}
+
+	for (u32 b = bands; !image && ok && b-- > 0;) {
+		Tile *first = &queue.tiles[b * tiles_x];
+		u32 first_row = first->y;
+		u32 rows = first->h;
+
+		std::atomic<u32> next = 0;
+		thread_pool_run(pool, config->cores, [&](u32 worker) {
+			for (;;) {
+				u32 index = next++;
+				if (index >= tiles_x) {
+					break;
+				}
+
+				total_bounces += render_tile(&first[index], scene, band, &band_config, 0, first_row, false);
+			}
+		});
+
+		ok = write_band(user, band, first_row, rows);
+
+		if (config->verbose) {
+			printf("\rRaytrace %3d%%", (u32)((f32)(bands - b) / (f32)bands * 100));
+			fflush(stdout);
+		}
+	}
+
+	u64 diff = get_real_time() - before;
+	u64 diff_cpu_time = get_cpu_time() - before_cpu_time;
+
+	if (!scratch || !arena_owns(scratch, band)) {
+		free(band);
+	}
+	free_work_queue(&queue);
+	if (scratch) {
+		arena_reset(scratch, scratch_mark);
+	}
+
+	if (pool == &local_pool) {
+		thread_pool_destroy(&local_pool);
+	}
+
+	if (stats) {
+		*stats = {};
+		stats->time_us = diff;
+		stats->cpu_time = diff_cpu_time;
+		stats->total_bounces = total_bounces;
+		stats->total_samples = (u64)w * config->height * config->rays_per_pixel;
+		stats->passes = 1;
+	}
+
+	if (config->verbose) {
+		putc('\n', stdout);
+		printf("Raytracing took %llu ms\n", (unsigned long long)(diff / 1000));
+		printf("Total bounces %llu\n", (unsigned long long)(u64)total_bounces);
+	}
 
-    return data;
+	return ok;
 }
@@ -12,6 +12,9 @@
 
 #define ARR_LEN(x) (sizeof(x)/sizeof(*x))
 
+#define MIN_DIST 0.001f
+#define MAX_DIST 200
+
 #define min(a, b) (a < b ? a : b)
 #define max(a, b) (a > b ? a : b)
 
@@ -58,8 +61,21 @@ struct Ray {
 	lane_v3 dir;
 };
 
+// Only what the search for the closest hit needs, the surface is looked up
+// once it is known (hit_surface).
 struct Hit {
 	lane_f32 t;
+	// index into Scene::spheres, into Scene::planes with HIT_PLANE set, or
+	// into the spheres of the instance's object with HIT_INSTANCE set
+	lane_u32 primitive;
+	lane_u32 instance;
+};
+
+#define HIT_PLANE 0x80000000u
+#define HIT_INSTANCE 0x40000000u
+
+struct Surface {
+	lane_v3 p;
 	lane_v3 n;
 	lane_u32 material_index;
 };
@@ -70,11 +86,91 @@ struct Sphere {
 	u32 material_index;
 };
 
+// Distance along the ray to the sphere surface, the nearer root unless it is
+// behind the origin. Only a hit if it lies in (MIN_DIST, closest so far).
+inline bool intersect_sphere(Sphere *sphere, v3 ro, v3 rd, f32 *t) {
+	v3 displacement = ro - sphere->center;
+	f32 a = dot(rd, rd);
+	f32 b = 2.0f * dot(rd, displacement);
+	f32 c = dot(displacement, displacement) - sphere->radius * sphere->radius;
+
+	f32 discriminant = b * b - 4.0f * a * c;
+
+	if (discriminant < 0) {
+		return false;
+	}
+
+	f32 t0 = (-b + sqrtf(discriminant)) / (2.0f * a);
+	f32 t1 = (-b - sqrtf(discriminant)) / (2.0f * a);
+
+	if (t0 > MIN_DIST) {
+		if (t1 > MIN_DIST) {
+			*t = t0 < t1 ? t0 : t1;
+		} else {
+			*t = t0;
+		}
+	} else {
+		*t = t1;
+	}
+
+	return true;
+}
+
 struct Plane {
 	u32 material_index;
 	f32 z;
 };
 
+struct Bvh;
+struct Bvh8;
+struct Arena;
+
+// A group of spheres that can be placed many times (see Instance), in its
+// own space. scene_update builds its bvh once, instances only reference it.
+struct Object {
+	Sphere *spheres;
+	u32 num_spheres;
+
+	Bvh *bvh;
+	// bounds of all spheres, kept by scene_update
+	v3 center;
+	f32 radius;
+};
+
+#define INSTANCE_OBJECT_MATERIALS u32_max
+
+// An object placed in the scene: p_world = x * p.x + y * p.y + z * p.z + position.
+// Set the transform with instance_set_transform, which also keeps the inverse.
+struct Instance {
+	u32 object;
+	// all spheres get this material, INSTANCE_OBJECT_MATERIALS keeps their own
+	u32 material_index;
+
+	v3 x;
+	v3 y;
+	v3 z;
+	v3 position;
+
+	// world to object
+	v3 inv_x;
+	v3 inv_y;
+	v3 inv_z;
+	v3 inv_position;
+};
+
+// What changed since the last scene_update, set by whoever edits the scene.
+enum scene_dirty_flags {
+	SCENE_DIRTY_CAMERA    = 1 << 0,
+	SCENE_DIRTY_MATERIALS = 1 << 1,
+	SCENE_DIRTY_SPHERES   = 1 << 2, // moved or resized, refit the bvh
+	SCENE_DIRTY_TOPOLOGY  = 1 << 3, // spheres added or removed, rebuild the bvh
+	SCENE_DIRTY_INSTANCES = 1 << 4, // instances moved, added or removed, rebuild the top level
+	SCENE_DIRTY_OBJECTS   = 1 << 5, // spheres of objects changed, rebuild everything instanced
+};
+
+#define SCENE_MAX_DIRTY_SPHERES 64
+#define SCENE_MAX_DIRTY_MATERIALS 64
+
 struct Scene {
 	Plane *planes;
 	u32 num_planes;
@@ -85,7 +181,60 @@ struct Scene {
 	Material *materials;
 	u32 num_materials;
 
+	Object *objects;
+	u32 num_objects;
+	Instance *instances;
+	u32 num_instances;
+
 	Camera camera;
+
+	Bvh *bvh;
+	// when set the bvh is built in here, a rebuild reuses the old one's
+	// space if nothing was pushed after it
+	Arena *arena;
+	u64 bvh_mark;
+	u64 bvh_end;
+	// collapsed from bvh and traced instead of it if set, see bvh8.h
+	Bvh8 *wide_bvh;
+
+	// Spheres that are added and removed every frame, rebuilds (and full
+	// refits) use bvh_build_linear, which is many times faster than SAH.
+	bool dynamic;
+	// the first build is linear as well, so a viewer can show something
+	// before the SAH tree is done, mark SCENE_DIRTY_TOPOLOGY to get that one
+	bool interactive;
+
+	// top level over the instances, built over a bounding sphere of each
+	Bvh *instance_bvh;
+	Sphere *instance_bounds;
+
+	// a bit (1 << kind) for every material kind the primitives use, kept up
+	// to date by scene_update for the tracing kernels, 0 if unknown
+	u32 material_kinds;
+
+	u32 dirty;
+	// refit only these if SCENE_DIRTY_SPHERES is set and the list did not overflow
+	u32 dirty_spheres[SCENE_MAX_DIRTY_SPHERES];
+	u32 num_dirty_spheres;
+	// same for SCENE_DIRTY_MATERIALS, lets renders keep unaffected tiles
+	u32 dirty_materials[SCENE_MAX_DIRTY_MATERIALS];
+	u32 num_dirty_materials;
+};
+
+enum scene_update_kind {
+	SCENE_UPDATE_NONE,
+	SCENE_UPDATE_CAMERA,
+	SCENE_UPDATE_MATERIALS,
+	SCENE_UPDATE_INSTANCES,
+	SCENE_UPDATE_REFIT,
+	SCENE_UPDATE_REBUILD
+};
+
+struct SceneUpdateStats {
+	u32 kind;
+	u32 refit_spheres; // 0 for a full refit
+	bool linear_bvh;   // the rebuild used bvh_build_linear
+	u64 time_us;
 };
 
 struct Tile {
@@ -101,6 +250,19 @@ struct WorkQueue {
 	u32 tile_count;
 
 	std::atomic<u32> tile_index;
+	bool in_arena;
+};
+
+struct ThreadPool;
+
+struct Framebuffer {
+	u32 width;
+	u32 height;
+
+	// linear color summed over all samples, divided by samples on resolve
+	v3 *color;
+	u32 *samples;
+	bool in_arena;
 };
 
 struct RayCastConfig {
@@ -110,8 +272,82 @@ struct RayCastConfig {
 	u32 rays_per_pixel;
 	u32 max_bounces;
 	v3 sky_color;
+	bool verbose;
+
+	// edge length of the square tiles, 0 picks width / cores
+	u32 tile_size;
+	// every sample gets its own random stream derived from (seed, pixel,
+	// sample index), so the image is the same bit for bit whatever the
+	// threads, tile size or machine. 0 uses a stream per tile from rand()
+	u32 seed;
+	// index of the first sample, so a render can be split by sample range
+	// over several processes (see raytrace_sums), needs a seed to matter
+	u32 sample_offset;
+	bool perf_counters;
+
+	// when set, passes of samples_per_pass are traced over the whole image
+	// until the budget runs out (or rays_per_pixel is reached)
+	u32 time_budget_ms;
+	u32 samples_per_pass;
+
+	// workers to render on, a temporary pool of `cores` threads if null
+	ThreadPool *pool;
+	// the tiles and buffers of a render come from here if set and are
+	// popped again when it returns, instead of being malloc'd every time
+	Arena *scratch;
+
+	// renders progressively and saves the accumulation state to this file
+	// every checkpoint_interval_ms; resume continues from it if it matches
+	const char *checkpoint_path;
+	u32 checkpoint_interval_ms;
+	bool resume;
+
+	// render jobs keep a bitset per tile of the materials its paths hit,
+	// so material edits only re-trace those tiles (see render_job_retrace)
+	bool record_tile_hits;
 };
 
+enum perf_counter_kind {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_L1D_MISSES,
+	PERF_LLC_MISSES,
+	PERF_BRANCH_MISSES,
+
+	PERF_COUNTER_COUNT
+};
+
+struct RenderStats {
+	u64 time_us;
+	u64 cpu_time;
+	u64 total_bounces;
+	u64 total_samples;
+	u32 passes;
+
+	// set when the render was cancelled, latency is from the cancel
+	// request until every worker stopped
+	bool cancelled;
+	u64 cancel_latency_us;
+
+	// summed over all worker threads, only valid where the
+	// bit (1 << perf_counter_kind) is set in perf_available
+	u64 perf[PERF_COUNTER_COUNT];
+	u32 perf_available;
+};
+
+// Cooperative cancellation, polled by the workers between pixels and tiles.
+struct CancelToken {
+	std::atomic<bool> cancelled{false};
+	std::atomic<u64> cancel_time{0};
+};
+
+void cancel_token_cancel(CancelToken *token);
+void cancel_token_reset(CancelToken *token);
+
+inline bool is_cancelled(CancelToken *token) {
+	return token && token->cancelled.load(std::memory_order_relaxed);
+}
+
 Material make_matt(v3 albedo);
 Material make_metallic(v3 albedo);
 
@@ -121,16 +357,110 @@ Material make_metallic(v3 albedo, Texture *tex);
 Sphere make_sphere(v3 center, f32 radius, u32 material_index);
 Plane make_plane(f32 z, u32 material_index);
 
+Object make_object(Sphere *spheres, u32 num_spheres);
+// rotated by `angle` radians around z and scaled by `scale`
+Instance make_instance(u32 object, v3 position, f32 angle, f32 scale, u32 material_index = INSTANCE_OBJECT_MATERIALS);
+// the columns of the object to world transform, they have to be invertible
+void instance_set_transform(Instance *instance, v3 x, v3 y, v3 z, v3 position);
+
 Camera make_camera(f32 fov, v3 pos, v3 lookat, f32 focus_dist, f32 aperture, u32 width, u32 height);
 Camera make_camera_default(RayCastConfig *config);
 RayCastConfig ray_cast_config_default();
 
+// microseconds
+u64 get_real_time();
+u64 get_cpu_time();
+
 f32 clamp(f32 v, f32 l, f32 h);
+v3 clamp(v3 v, f32 l, f32 h);
 u32 rgb_to_hex(v3 v);
 
-u64 raytrace_tile(WorkQueue *queue, Scene *scene, u32 *data, RayCastConfig *config);
-
-void raytrace_data(Scene *scene, u32 *data, RayCastConfig *config);
+f32 linear_to_srgb(f32 l);
+v3 linear_to_srgb(v3 v);
+
+// Table based 8 bit sRGB of a linear value clamped to [0, 1], the same
+// bytes as the pow above went through rgb_to_hex. NaN becomes 0.
+u32 linear_to_srgb8(f32 l);
+// rgb_to_hex(linear_to_srgb(clamp(v, 0, 1))), SIMD over whole rows for pixels
+u32 linear_to_pixel(v3 v);
+void linear_to_pixels(v3 *colors, u32 *pixels, u32 count);
+
+Ray camera_get_ray(Camera *camera, f32 s, f32 t, Random *random);
+bool scatter(Material material, Ray *ray, lane_v3 p, lane_v3 n, lane_v3 *attenuation, Random *random);
+Hit scan_hit(Scene *scene, Ray *ray);
+// for a hit closer than MAX_DIST
+Surface hit_surface(Scene *scene, Ray *ray, Hit *hit);
+
+// from `arena` if it is set and has room, malloc'd otherwise
+Framebuffer make_framebuffer(u32 width, u32 height, Arena *arena = 0);
+void clear_framebuffer(Framebuffer *fb);
+void free_framebuffer(Framebuffer *fb);
+// adds the sums and sample counts of `from`, both of the same size
+void merge_framebuffer(Framebuffer *into, Framebuffer *from);
+void resolve_framebuffer(Framebuffer *fb, u32 *data);
+// averaged radiance, unclamped and without the sRGB curve, pixels may alias fb->color
+void resolve_framebuffer_linear(Framebuffer *fb, v3 *pixels);
+void resolve_framebuffer_tile(Framebuffer *fb, u32 *data, Tile *tile);
+
+// deep copy of the primitive and material arrays, for renders that outlive edits
+Scene copy_scene(Scene *scene);
+void free_scene_copy(Scene *scene);
+
+void scene_mark_dirty(Scene *scene, u32 flags);
+void scene_mark_sphere_dirty(Scene *scene, u32 sphere_index);
+void scene_mark_material_dirty(Scene *scene, u32 material_index);
+
+// brings the acceleration structure up to date with the dirty flags, only
+// geometry edits cost anything, camera and material edits reuse it as is.
+// Linear builds run on `pool` if it is set.
+void scene_update(Scene *scene, SceneUpdateStats *stats = 0, ThreadPool *pool = 0);
+// Puts a sphere bvh built elsewhere (say on a pool task, over a copy of the
+// spheres) in place of the scene's, which it then owns. It is refit to where
+// the spheres are now. False and nothing changes if it was built over a
+// different number of spheres.
+bool scene_replace_bvh(Scene *scene, Bvh *bvh);
+// every acceleration structure scene_update made, the objects' included
+void free_scene_bvh(Scene *scene);
+const char *scene_update_name(u32 kind);
+
+// hit_materials, if set, is a bitset that gets the material of every hit
+v3 trace_path(Scene *scene, RayCastConfig *config, f32 u, f32 v, Random *random, u64 *bounces, u64 *hit_materials = 0);
+
+void init_work_queue(WorkQueue *queue, RayCastConfig *config, Arena *arena = 0);
+void free_work_queue(WorkQueue *queue);
+
+// data starts at image row first_row, for renders that only hold a band of rows.
+// With stream the tile bypasses the cache on its way to data, leave it off
+// if the caller reads the rows right after.
+u64 render_tile(Tile *tile, Scene *scene, u32 *data, RayCastConfig *config, CancelToken *cancel = 0, u32 first_row = 0, bool stream = true);
+u64 raytrace_tile(WorkQueue *queue, Scene *scene, u32 *data, RayCastConfig *config, CancelToken *cancel = 0);
+u64 accumulate_tile(Tile *tile, Scene *scene, Framebuffer *fb, RayCastConfig *config, u32 samples, u64 deadline, CancelToken *cancel = 0, u64 *hit_materials = 0);
+
+void raytrace_data(Scene *scene, u32 *data, RayCastConfig *config, RenderStats *stats = 0, CancelToken *cancel = 0);
 u32 *raytrace(Scene *scene, RayCastConfig *config);
 
+// same as raytrace_data but keeps the linear float radiance of every pixel,
+// for HDR output (see write_exr, write_hdr, write_pfm)
+void raytrace_linear(Scene *scene, v3 *pixels, RayCastConfig *config, RenderStats *stats = 0, CancelToken *cancel = 0);
+
+// Unnormalized: adds rays_per_pixel samples per pixel to the sums and counts
+// of `sums` (config->width x height). Sample indices continue from
+// config->sample_offset plus the pixel's count, so renders of disjoint
+// sample ranges simply add up (see SampleSlice in checkpoint.h).
+void raytrace_sums(Scene *scene, Framebuffer *sums, RayCastConfig *config, RenderStats *stats = 0, CancelToken *cancel = 0);
+
+#define RAYTRACE_BAND_TILE_SIZE 64
+
+// Renders the image in bands of one row of tiles, from the top of the image
+// (the last rows) down, and hands every finished band to write_band. The
+// pixels are bottom row first like `data` everywhere else, write_band returns
+// false to stop the render.
+// Without `image`, one band is rendered at a time into a buffer that is
+// reused, so only a band is ever in memory and bands arrive in order.
+// With `image`, all tiles are rendered into it at once and write_band runs on
+// the worker that finished a band, concurrently and in any order, so the
+// bands can be encoded while the rest is still rendering.
+typedef bool (*WriteBandFn)(void *user, u32 *pixels, u32 first_row, u32 rows);
+bool raytrace_bands(Scene *scene, RayCastConfig *config, u32 *image, WriteBandFn write_band, void *user, RenderStats *stats = 0);
+
 #endif
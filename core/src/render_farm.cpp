@@ -0,0 +1,704 @@
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "thread_pool.h"
+#include "render_farm.h"
+#include "arena.h"
+#include "bvh.h"
+
+#ifndef _WIN32
+
+#define FARM_MAGIC 0x4D524146 // "FARM"
+#define FARM_VERSION 3
+#define FARM_TILE_SIZE 64
+#define FARM_MAX_BATCH 256
+#define FARM_CONNECT_TIMEOUT_MS 5000
+
+#ifdef MSG_NOSIGNAL
+#define FARM_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define FARM_SEND_FLAGS 0
+#endif
+
+// everything a worker needs to trace tiles, followed by the spheres, the
+// planes, num_materials FarmMaterials, the sphere count of every object, the
+// spheres of all objects one after the other and the instances
+struct FarmSetup {
+	u32 magic;
+	u32 version;
+
+	u32 width;
+	u32 height;
+	u32 rays_per_pixel;
+	u32 max_bounces;
+	u32 tile_size;
+	u32 seed;
+	u32 sample_offset;
+	v3 sky_color;
+	Camera camera;
+
+	u32 num_spheres;
+	u32 num_planes;
+	u32 num_materials;
+	u32 num_objects;
+	u32 num_object_spheres;
+	u32 num_instances;
+};
+
+struct FarmMaterial {
+	u32 kind;
+	v3 albedo;
+};
+
+// followed by `pixels` summed colors and sample counts, row by row
+struct FarmTileHeader {
+	u32 index;
+	u32 pixels;
+	u64 bounces;
+};
+
+struct FarmAddress {
+	sockaddr_storage addr;
+	socklen_t size;
+	const char *unix_path;
+};
+
+static bool send_all(s32 fd, const void *data, u64 size) {
+	const u8 *bytes = (const u8 *)data;
+
+	while (size) {
+		ssize_t n = send(fd, bytes, size, FARM_SEND_FLAGS);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+
+		bytes += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+static bool recv_all(s32 fd, void *data, u64 size) {
+	u8 *bytes = (u8 *)data;
+
+	while (size) {
+		ssize_t n = recv(fd, bytes, size, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+
+		bytes += n;
+		size -= n;
+	}
+
+	return true;
+}
+
+static bool parse_address(const char *address, bool passive, FarmAddress *out) {
+	*out = {};
+
+	if (!strncmp(address, "unix:", 5)) {
+		sockaddr_un *un = (sockaddr_un *)&out->addr;
+		const char *path = address + 5;
+
+		if (strlen(path) >= sizeof(un->sun_path)) {
+			return false;
+		}
+
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, path);
+		out->size = sizeof(sockaddr_un);
+		out->unix_path = path;
+		return true;
+	}
+
+	const char *colon = strrchr(address, ':');
+	if (!colon) {
+		return false;
+	}
+
+	char host[256];
+	u32 host_length = (u32)(colon - address);
+	if (host_length >= sizeof(host)) {
+		return false;
+	}
+	memcpy(host, address, host_length);
+	host[host_length] = 0;
+
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+	addrinfo *result;
+	if (getaddrinfo(host_length ? host : 0, colon + 1, &hints, &result) != 0) {
+		return false;
+	}
+
+	memcpy(&out->addr, result->ai_addr, result->ai_addrlen);
+	out->size = result->ai_addrlen;
+	freeaddrinfo(result);
+
+	return true;
+}
+
+static s32 open_listener(FarmAddress *address) {
+	s32 fd = socket(address->addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (address->unix_path) {
+		unlink(address->unix_path);
+	} else {
+		s32 yes = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	}
+
+	if (bind(fd, (sockaddr *)&address->addr, address->size) != 0 || listen(fd, 64) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+// workers may be started before the coordinator, so keep trying for a while
+static s32 connect_to(FarmAddress *address) {
+	u64 deadline = get_real_time() + FARM_CONNECT_TIMEOUT_MS * 1000ull;
+
+	for (;;) {
+		s32 fd = socket(address->addr.ss_family, SOCK_STREAM, 0);
+		if (fd < 0) {
+			return -1;
+		}
+
+		if (connect(fd, (sockaddr *)&address->addr, address->size) == 0) {
+			return fd;
+		}
+		close(fd);
+
+		if (get_real_time() >= deadline) {
+			return -1;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	}
+}
+
+struct FarmState {
+	FarmSetup setup;
+	Scene *scene;
+	Framebuffer *fb;
+
+	// the tile layout, workers build the same one from the setup
+	WorkQueue queue;
+
+	// guards next_tile and retry
+	std::mutex mutex;
+	u32 next_tile;
+	std::vector<u32> retry;
+
+	std::atomic<u32> tiles_done;
+	std::atomic<u64> bounces;
+};
+
+// tiles of lost workers first, then the ones nobody had yet
+static u32 claim_tiles(FarmState *state, u32 *tiles, u32 want) {
+	std::lock_guard<std::mutex> lock(state->mutex);
+
+	u32 count = 0;
+	while (count < want && !state->retry.empty()) {
+		tiles[count++] = state->retry.back();
+		state->retry.pop_back();
+	}
+	while (count < want && state->next_tile < state->queue.tile_count) {
+		tiles[count++] = state->next_tile++;
+	}
+
+	return count;
+}
+
+static void requeue_tiles(FarmState *state, u32 *tiles, u32 count) {
+	std::lock_guard<std::mutex> lock(state->mutex);
+	state->retry.insert(state->retry.end(), tiles, tiles + count);
+}
+
+static bool send_setup(s32 fd, FarmState *state) {
+	Scene *scene = state->scene;
+
+	bool ok = send_all(fd, &state->setup, sizeof(FarmSetup));
+	ok = ok && send_all(fd, scene->spheres, scene->num_spheres * sizeof(Sphere));
+	ok = ok && send_all(fd, scene->planes, scene->num_planes * sizeof(Plane));
+
+	for (u32 i = 0; ok && i < scene->num_materials; ++i) {
+		FarmMaterial material = { scene->materials[i].kind, scene->materials[i].albedo };
+		ok = send_all(fd, &material, sizeof(material));
+	}
+
+	for (u32 i = 0; ok && i < scene->num_objects; ++i) {
+		ok = send_all(fd, &scene->objects[i].num_spheres, sizeof(u32));
+	}
+	for (u32 i = 0; ok && i < scene->num_objects; ++i) {
+		ok = send_all(fd, scene->objects[i].spheres, scene->objects[i].num_spheres * sizeof(Sphere));
+	}
+	ok = ok && send_all(fd, scene->instances, scene->num_instances * sizeof(Instance));
+
+	return ok;
+}
+
+static void serve_worker(FarmState *state, s32 fd) {
+	u32 ts = state->setup.tile_size;
+	u32 w = state->fb->width;
+
+	v3 *colors = (v3 *)malloc(ts * ts * sizeof(v3));
+	u32 *samples = (u32 *)malloc(ts * ts * sizeof(u32));
+	u32 tiles[FARM_MAX_BATCH];
+
+	bool ok = send_setup(fd, state);
+
+	while (ok) {
+		u32 want;
+		if (!recv_all(fd, &want, sizeof(want))) {
+			break;
+		}
+		want = min(max(want, 1), FARM_MAX_BATCH);
+
+		// with nothing left to hand out, wait until the other workers either
+		// finish or drop out and leave their tiles behind
+		u32 count = 0;
+		while (!(count = claim_tiles(state, tiles, want)) && state->tiles_done < state->queue.tile_count) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+
+		if (!send_all(fd, &count, sizeof(count)) || !send_all(fd, tiles, count * sizeof(u32))) {
+			requeue_tiles(state, tiles, count);
+			break;
+		}
+
+		if (!count) {
+			break;
+		}
+
+		// results come back in the order the tiles were handed out
+		u32 received = 0;
+		for (; received < count; ++received) {
+			Tile *tile = &state->queue.tiles[tiles[received]];
+			u32 pixels = tile->w * tile->h;
+
+			FarmTileHeader header;
+			if (!recv_all(fd, &header, sizeof(header)) || header.index != tiles[received] || header.pixels != pixels) {
+				break;
+			}
+
+			if (!recv_all(fd, colors, pixels * sizeof(v3)) || !recv_all(fd, samples, pixels * sizeof(u32))) {
+				break;
+			}
+
+			for (u32 y = 0; y < tile->h; ++y) {
+				u64 row = (u64)(tile->y + y) * w + tile->x;
+				memcpy(state->fb->color + row, colors + y * tile->w, tile->w * sizeof(v3));
+				memcpy(state->fb->samples + row, samples + y * tile->w, tile->w * sizeof(u32));
+			}
+
+			state->bounces += header.bounces;
+			state->tiles_done++;
+		}
+
+		if (received < count) {
+			requeue_tiles(state, tiles + received, count - received);
+			ok = false;
+		}
+	}
+
+	close(fd);
+	free(colors);
+	free(samples);
+}
+
+bool farm_coordinate(Scene *scene, RayCastConfig *config, const char *address, Framebuffer *fb, RenderStats *stats) {
+	FarmAddress addr;
+	if (!parse_address(address, true, &addr)) {
+		fprintf(stderr, "Invalid farm address %s\n", address);
+		return false;
+	}
+
+	s32 listener = open_listener(&addr);
+	if (listener < 0) {
+		fprintf(stderr, "Could not listen on %s\n", address);
+		return false;
+	}
+
+	FarmState state;
+	state.scene = scene;
+	state.fb = fb;
+	state.next_tile = 0;
+	state.tiles_done = 0;
+	state.bounces = 0;
+
+	FarmSetup *setup = &state.setup;
+	*setup = {};
+	setup->magic = FARM_MAGIC;
+	setup->version = FARM_VERSION;
+	setup->width = config->width;
+	setup->height = config->height;
+	setup->rays_per_pixel = config->rays_per_pixel;
+	setup->max_bounces = config->max_bounces;
+	setup->tile_size = config->tile_size ? config->tile_size : FARM_TILE_SIZE;
+	// every worker has to draw the same sample streams
+	setup->seed = config->seed ? config->seed : (u32)rand() | 1;
+	setup->sample_offset = config->sample_offset;
+	setup->sky_color = config->sky_color;
+	setup->camera = scene->camera;
+	setup->num_spheres = scene->num_spheres;
+	setup->num_planes = scene->num_planes;
+	setup->num_materials = scene->num_materials;
+	setup->num_objects = scene->num_objects;
+	setup->num_instances = scene->num_instances;
+	for (u32 i = 0; i < scene->num_objects; ++i) {
+		setup->num_object_spheres += scene->objects[i].num_spheres;
+	}
+
+	RayCastConfig tile_config = *config;
+	tile_config.tile_size = setup->tile_size;
+	tile_config.seed = setup->seed;
+	init_work_queue(&state.queue, &tile_config);
+
+	if (config->verbose) {
+		printf("Coordinating %u tiles (%ux%u) on %s\n", state.queue.tile_count, setup->tile_size, setup->tile_size, address);
+		printf("%d rays per pixel, max %d bounces, seed %u\n", config->rays_per_pixel, config->max_bounces, setup->seed);
+	}
+
+	u64 before = get_real_time();
+	std::vector<std::thread> workers;
+
+	while (state.tiles_done < state.queue.tile_count) {
+		pollfd p = { listener, POLLIN, 0 };
+
+		if (poll(&p, 1, 100) > 0) {
+			s32 fd = accept(listener, 0, 0);
+			if (fd >= 0) {
+				workers.emplace_back(serve_worker, &state, fd);
+			}
+		}
+
+		if (config->verbose) {
+			printf("\rRaytrace %3d%% (%u workers)", (u32)((f32)state.tiles_done / (f32)state.queue.tile_count * 100), (u32)workers.size());
+			fflush(stdout);
+		}
+	}
+
+	close(listener);
+	if (addr.unix_path) {
+		unlink(addr.unix_path);
+	}
+
+	for (auto &t : workers) {
+		t.join();
+	}
+
+	u64 diff = get_real_time() - before;
+	free_work_queue(&state.queue);
+
+	if (stats) {
+		*stats = {};
+		stats->time_us = diff;
+		stats->total_bounces = state.bounces;
+		stats->total_samples = (u64)config->width * config->height * config->rays_per_pixel;
+		stats->passes = 1;
+	}
+
+	if (config->verbose) {
+		putc('\n', stdout);
+		printf("Raytracing took %llu ms\n", (unsigned long long)(diff / 1000));
+		printf("Total bounces %llu\n", (unsigned long long)(u64)state.bounces);
+	}
+
+	return true;
+}
+
+static bool recv_scene(s32 fd, FarmSetup *setup, Scene *scene, Arena *arena) {
+	*scene = {};
+	scene->camera = setup->camera;
+	scene->num_spheres = setup->num_spheres;
+	scene->num_planes = setup->num_planes;
+	scene->num_materials = setup->num_materials;
+	scene->num_objects = setup->num_objects;
+	scene->num_instances = setup->num_instances;
+	scene->arena = arena;
+
+	scene->spheres = ARENA_PUSH_ARRAY(arena, Sphere, setup->num_spheres);
+	scene->planes = ARENA_PUSH_ARRAY(arena, Plane, setup->num_planes);
+	scene->materials = ARENA_PUSH_ARRAY(arena, Material, setup->num_materials);
+	scene->objects = ARENA_PUSH_ARRAY(arena, Object, setup->num_objects);
+	scene->instances = ARENA_PUSH_ARRAY(arena, Instance, setup->num_instances);
+
+	if (!scene->spheres || !scene->planes || !scene->materials || !scene->objects || !scene->instances) {
+		return false;
+	}
+
+	bool ok = recv_all(fd, scene->spheres, setup->num_spheres * sizeof(Sphere));
+	ok = ok && recv_all(fd, scene->planes, setup->num_planes * sizeof(Plane));
+
+	for (u32 i = 0; ok && i < setup->num_materials; ++i) {
+		FarmMaterial material;
+		ok = recv_all(fd, &material, sizeof(material));
+
+		scene->materials[i] = {};
+		scene->materials[i].kind = material.kind;
+		scene->materials[i].albedo = material.albedo;
+	}
+
+	u32 object_spheres = 0;
+	for (u32 i = 0; ok && i < setup->num_objects; ++i) {
+		u32 count;
+		ok = recv_all(fd, &count, sizeof(count));
+		object_spheres += count;
+
+		// the counts have to add up to what the setup promised
+		ok = ok && object_spheres <= setup->num_object_spheres;
+		scene->objects[i] = make_object(ok ? ARENA_PUSH_ARRAY(arena, Sphere, count) : 0, ok ? count : 0);
+		ok = ok && scene->objects[i].spheres;
+	}
+	for (u32 i = 0; ok && i < setup->num_objects; ++i) {
+		ok = recv_all(fd, scene->objects[i].spheres, scene->objects[i].num_spheres * sizeof(Sphere));
+	}
+	ok = ok && recv_all(fd, scene->instances, setup->num_instances * sizeof(Instance));
+
+	for (u32 i = 0; ok && i < setup->num_instances; ++i) {
+		ok = scene->instances[i].object < setup->num_objects;
+	}
+	if (!ok) {
+		// nothing half received may reach the tracer
+		scene->num_objects = 0;
+		scene->num_instances = 0;
+	}
+
+	scene_mark_dirty(scene, SCENE_DIRTY_TOPOLOGY);
+	return ok;
+}
+
+bool farm_work(const char *address, u32 cores, bool verbose) {
+	FarmAddress addr;
+	if (!parse_address(address, false, &addr)) {
+		fprintf(stderr, "Invalid farm address %s\n", address);
+		return false;
+	}
+
+	s32 fd = connect_to(&addr);
+	if (fd < 0) {
+		fprintf(stderr, "Could not connect to %s\n", address);
+		return false;
+	}
+
+	FarmSetup setup;
+	if (!recv_all(fd, &setup, sizeof(setup)) || setup.magic != FARM_MAGIC || setup.version != FARM_VERSION) {
+		fprintf(stderr, "%s is not a compatible farm coordinator\n", address);
+		close(fd);
+		return false;
+	}
+
+	cores = max(cores, 1);
+
+	// everything of this render in one place, gone with one free_arena
+	u32 ts = setup.tile_size;
+	u64 pixels = (u64)setup.width * setup.height;
+	u64 tiles_count = ((setup.width + ts - 1) / ts) * ((setup.height + ts - 1) / ts);
+	u64 arena_size =
+		setup.num_spheres * sizeof(Sphere) + setup.num_planes * sizeof(Plane) + setup.num_materials * sizeof(Material) +
+		sizeof(Bvh) + bvh_arena_size(setup.num_spheres) +
+		setup.num_objects * (sizeof(Object) + ARENA_DEFAULT_ALIGN) + (u64)setup.num_object_spheres * sizeof(Sphere) +
+		setup.num_instances * sizeof(Instance) +
+		tiles_count * sizeof(Tile) +
+		(pixels + (u64)ts * ts) * (sizeof(v3) + sizeof(u32)) +
+		(1 << 16);
+	Arena arena = make_arena(arena_size, false);
+
+	Scene scene = {};
+	bool ok = ts && arena.base && recv_scene(fd, &setup, &scene, &arena);
+
+	RayCastConfig config = ray_cast_config_default();
+	config.cores = cores;
+	config.width = setup.width;
+	config.height = setup.height;
+	config.rays_per_pixel = setup.rays_per_pixel;
+	config.max_bounces = setup.max_bounces;
+	config.tile_size = setup.tile_size;
+	config.seed = setup.seed;
+	config.sample_offset = setup.sample_offset;
+	config.sky_color = setup.sky_color;
+	config.verbose = false;
+
+	WorkQueue queue;
+	init_work_queue(&queue, &config, &arena);
+
+	Framebuffer fb = make_framebuffer(setup.width, setup.height, &arena);
+
+	ThreadPool pool;
+	thread_pool_init(&pool, cores - 1);
+
+	scene_update(&scene);
+
+	v3 *colors = ARENA_PUSH_ARRAY(&arena, v3, ts * ts);
+	u32 *samples = ARENA_PUSH_ARRAY(&arena, u32, ts * ts);
+	ok = ok && colors && samples;
+
+	u32 tiles[FARM_MAX_BATCH];
+	u64 bounces[FARM_MAX_BATCH];
+	u32 tiles_traced = 0;
+
+	while (ok) {
+		// enough tiles to keep every thread busy
+		u32 want = cores;
+		u32 count;
+		if (!send_all(fd, &want, sizeof(want)) || !recv_all(fd, &count, sizeof(count)) || count > FARM_MAX_BATCH) {
+			ok = false;
+			break;
+		}
+
+		if (!count) {
+			break;
+		}
+
+		if (!recv_all(fd, tiles, count * sizeof(u32))) {
+			ok = false;
+			break;
+		}
+
+		for (u32 i = 0; i < count; ++i) {
+			if (tiles[i] >= queue.tile_count) {
+				ok = false;
+			}
+		}
+
+		std::atomic<u32> next = 0;
+		thread_pool_run(&pool, ok ? min(cores, count) : 0, [&](u32 worker) {
+			for (;;) {
+				u32 i = next++;
+				if (i >= count) {
+					break;
+				}
+
+				// cleared, so a tile traced twice draws the same samples again
+				Tile tile = queue.tiles[tiles[i]];
+				for (u32 y = 0; y < tile.h; ++y) {
+					u64 row = (u64)(tile.y + y) * fb.width + tile.x;
+					memset(fb.color + row, 0, tile.w * sizeof(v3));
+					memset(fb.samples + row, 0, tile.w * sizeof(u32));
+				}
+
+				bounces[i] = accumulate_tile(&tile, &scene, &fb, &config, config.rays_per_pixel, 0);
+			}
+		});
+
+		for (u32 i = 0; ok && i < count; ++i) {
+			Tile *tile = &queue.tiles[tiles[i]];
+
+			for (u32 y = 0; y < tile->h; ++y) {
+				u64 row = (u64)(tile->y + y) * fb.width + tile->x;
+				memcpy(colors + y * tile->w, fb.color + row, tile->w * sizeof(v3));
+				memcpy(samples + y * tile->w, fb.samples + row, tile->w * sizeof(u32));
+			}
+
+			FarmTileHeader header = { tiles[i], tile->w * tile->h, bounces[i] };
+			ok = send_all(fd, &header, sizeof(header)) &&
+				send_all(fd, colors, header.pixels * sizeof(v3)) &&
+				send_all(fd, samples, header.pixels * sizeof(u32));
+		}
+
+		tiles_traced += count;
+	}
+
+	if (verbose) {
+		printf("Traced %u tiles for %s\n", tiles_traced, address);
+	}
+
+	close(fd);
+	thread_pool_destroy(&pool);
+
+	// the queue and framebuffer only fall back to the heap if the arena was too small
+	free_framebuffer(&fb);
+	free_work_queue(&queue);
+	free_scene_bvh(&scene);
+	free_arena(&arena);
+
+	return ok;
+}
+
+u32 farm_spawn_workers(const char *address, u32 count, u32 cores) {
+	u32 started = 0;
+
+	// buffered output would otherwise be printed by every child again
+	fflush(stdout);
+	fflush(stderr);
+
+	for (u32 i = 0; i < count; ++i) {
+		pid_t pid = fork();
+
+		if (pid == 0) {
+			bool ok = farm_work(address, cores, false);
+			_exit(ok ? 0 : 1);
+		}
+
+		if (pid > 0) {
+			started++;
+		}
+	}
+
+	return started;
+}
+
+void farm_wait_workers() {
+	for (;;) {
+		if (wait(0) > 0 || errno == EINTR) {
+			continue;
+		}
+		break;
+	}
+}
+
+void farm_local_address(char *buffer, u32 size) {
+	snprintf(buffer, size, "unix:/tmp/raytracer_farm_%d.sock", (s32)getpid());
+}
+
+#else
+
+bool farm_coordinate(Scene *scene, RayCastConfig *config, const char *address, Framebuffer *fb, RenderStats *stats) {
+	fprintf(stderr, "The render farm needs POSIX sockets\n");
+	return false;
+}
+
+bool farm_work(const char *address, u32 cores, bool verbose) {
+	fprintf(stderr, "The render farm needs POSIX sockets\n");
+	return false;
+}
+
+u32 farm_spawn_workers(const char *address, u32 count, u32 cores) {
+	return 0;
+}
+
+void farm_wait_workers() {
+}
+
+void farm_local_address(char *buffer, u32 size) {
+	snprintf(buffer, size, "unix:raytracer_farm.sock");
+}
+
+#endif
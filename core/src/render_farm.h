@@ -0,0 +1,39 @@
+#ifndef RENDER_FARM_H
+#define RENDER_FARM_H
+
+#include "raycaster.h"
+
+/*
+ * Renders one frame across several processes. The coordinator sends the
+ * scene and config to every worker that connects, then hands out tiles on
+ * request; workers trace them with all their threads and send back the
+ * summed color and sample count of every pixel, which the coordinator
+ * merges into its framebuffer.
+ *
+ * Tiles are fixed by config->tile_size (64 if 0) and every sample's random
+ * stream comes from config->seed (see RayCastConfig::seed), so the image is
+ * the same however many workers there are and whichever traced which tile.
+ * Tiles of a worker that disconnects go back to the queue.
+ *
+ * Addresses are "unix:/path/to/socket" or "host:port". Peers exchange the
+ * structs as they are in memory, all of them have to run the same build.
+ * POSIX only, the functions fail everywhere else.
+ */
+
+// blocks until every tile is in fb, which has to be config->width x height
+// and cleared. Workers may connect at any time while tiles are missing.
+bool farm_coordinate(Scene *scene, RayCastConfig *config, const char *address, Framebuffer *fb, RenderStats *stats = 0);
+
+// connects (retrying for a few seconds) and traces tiles on `cores` threads
+// until the coordinator has none left
+bool farm_work(const char *address, u32 cores, bool verbose);
+
+// forks `count` processes on this machine that run farm_work, call this
+// before any threads are started. Returns how many were started.
+u32 farm_spawn_workers(const char *address, u32 count, u32 cores);
+void farm_wait_workers();
+
+// a unix socket in /tmp unique to this process, for farms on one machine
+void farm_local_address(char *buffer, u32 size);
+
+#endif
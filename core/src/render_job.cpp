@@ -0,0 +1,283 @@
+#include "render_job.h"
+
+static u32 min_tile_samples(RenderJob *job) {
+	u32 result = u32_max;
+	for (u32 i = 0; i < job->queue.tile_count; ++i) {
+		result = min(result, job->tile_samples[i]);
+	}
+	return result;
+}
+
+// bitset words for every material index the scene's primitives can hit
+static u32 hit_words(Scene *scene) {
+	u32 count = scene->num_materials;
+	for (u32 i = 0; i < scene->num_spheres; ++i) {
+		count = max(count, scene->spheres[i].material_index + 1);
+	}
+	for (u32 i = 0; i < scene->num_planes; ++i) {
+		count = max(count, scene->planes[i].material_index + 1);
+	}
+	for (u32 i = 0; i < scene->num_instances; ++i) {
+		if (scene->instances[i].material_index != INSTANCE_OBJECT_MATERIALS) {
+			count = max(count, scene->instances[i].material_index + 1);
+		}
+	}
+	for (u32 i = 0; i < scene->num_objects; ++i) {
+		for (u32 j = 0; j < scene->objects[i].num_spheres; ++j) {
+			count = max(count, scene->objects[i].spheres[j].material_index + 1);
+		}
+	}
+	return (count + 63) / 64;
+}
+
+// drops what a tile accumulated, it is traced again from its first sample
+// and the old pixels stay in `data` until its first new pass
+static void clear_tile(RenderJob *job, u32 tile_index) {
+	Tile *tile = &job->queue.tiles[tile_index];
+	u32 w = job->fb.width;
+
+	for (u32 y = tile->y; y < tile->y + tile->h; ++y) {
+		memset(job->fb.color + y * w + tile->x, 0, tile->w * sizeof(v3));
+		memset(job->fb.samples + y * w + tile->x, 0, tile->w * sizeof(u32));
+	}
+
+	if (job->tile_hits) {
+		memset(job->tile_hits + tile_index * job->hit_words, 0, job->hit_words * sizeof(u64));
+	}
+
+	job->tile_samples[tile_index] = 0;
+}
+
+static void render_job_run(RenderJob *job) {
+	RayCastConfig *config = &job->config;
+	ThreadPool *pool = config->pool;
+
+	u32 samples_per_pass = max(config->samples_per_pass, 1);
+
+	while (job->samples_done < config->rays_per_pixel && !is_cancelled(&job->cancel)) {
+		u32 target = min(job->samples_done + samples_per_pass, config->rays_per_pixel);
+
+		job->queue.tile_index = 0;
+
+		thread_pool_run(pool, config->cores, [job, config, target](u32 worker) {
+			while (!is_cancelled(&job->cancel)) {
+				u32 tile_index = job->queue.tile_index++;
+				if (tile_index >= job->queue.tile_count) {
+					break;
+				}
+
+				u32 done = job->tile_samples[tile_index];
+				if (done >= target) {
+					continue;
+				}
+
+				Tile *tile = &job->queue.tiles[tile_index];
+				u64 *hits = job->tile_hits ? job->tile_hits + tile_index * job->hit_words : 0;
+
+				accumulate_tile(tile, &job->scene, &job->fb, config, target - done, 0, &job->cancel, hits);
+
+				// a cancelled tile may be partly done, some of its pixels
+				// already have `target` samples, so it is redone as a whole
+				if (is_cancelled(&job->cancel)) {
+					clear_tile(job, tile_index);
+					break;
+				}
+
+				job->tile_samples[tile_index] = target;
+
+				std::lock_guard<std::mutex> lock(job->mutex);
+				resolve_framebuffer_tile(&job->fb, job->data, tile);
+
+				if (!job->tile_updated[tile_index]) {
+					job->tile_updated[tile_index] = true;
+					job->updated_tiles.push_back(tile_index);
+				}
+			}
+		});
+
+		if (!is_cancelled(&job->cancel)) {
+			job->samples_done = min_tile_samples(job);
+		}
+	}
+
+	job->finished = true;
+}
+
+RenderJob *render_job_start(Scene *scene, RayCastConfig *config) {
+	RenderJob *job = new RenderJob;
+
+	job->scene = copy_scene(scene);
+	// normally a no-op, the caller runs scene_update to see what an edit cost
+	scene_update(&job->scene, 0, config->pool);
+	job->config = *config;
+	job->config.cores = max(config->cores, 1);
+	job->config.verbose = false;
+
+	init_work_queue(&job->queue, &job->config);
+	job->fb = make_framebuffer(config->width, config->height);
+	job->data = (u32 *)calloc(config->width * config->height, sizeof(u32));
+	job->tile_updated.assign(job->queue.tile_count, false);
+	job->tile_samples = (u32 *)calloc(job->queue.tile_count, sizeof(u32));
+
+	job->tile_hits = 0;
+	job->hit_words = hit_words(scene);
+	if (config->record_tile_hits) {
+		job->tile_hits = (u64 *)calloc(job->queue.tile_count * job->hit_words, sizeof(u64));
+	}
+	job->retraced_tiles = job->queue.tile_count;
+
+	job->samples_done = 0;
+	job->finished = false;
+	job->cancel_latency_us = 0;
+
+	thread_pool_submit(config->pool, &job->group, [job]() {
+		render_job_run(job);
+	});
+
+	return job;
+}
+
+// objects and instances the same as when the job started, down to their
+// materials, which the tile records do not cover
+static bool same_instances(RenderJob *job, Scene *scene) {
+	Scene *old = &job->scene;
+
+	if (scene->num_objects != old->num_objects || scene->num_instances != old->num_instances) {
+		return false;
+	}
+
+	for (u32 i = 0; i < scene->num_objects; ++i) {
+		Object *object = &scene->objects[i];
+		Object *old_object = &old->objects[i];
+
+		if (object->num_spheres != old_object->num_spheres ||
+			memcmp(object->spheres, old_object->spheres, object->num_spheres * sizeof(Sphere))) {
+			return false;
+		}
+	}
+
+	return !scene->num_instances || !memcmp(scene->instances, old->instances, scene->num_instances * sizeof(Instance));
+}
+
+bool render_job_retrace(RenderJob *job, Scene *scene, u32 *materials, u32 count) {
+	if (!job->tile_hits || scene->num_materials != job->scene.num_materials || hit_words(scene) > job->hit_words) {
+		return false;
+	}
+
+	if (scene->num_spheres != job->scene.num_spheres || scene->num_planes != job->scene.num_planes) {
+		return false;
+	}
+
+	if (!same_instances(job, scene)) {
+		return false;
+	}
+
+	std::vector<u32> affected_materials(materials, materials + count);
+
+	// spheres may switch materials, the tiles that saw the old one change
+	for (u32 i = 0; i < scene->num_spheres; ++i) {
+		Sphere *sphere = &scene->spheres[i];
+		Sphere *old = &job->scene.spheres[i];
+
+		if (sphere->center.x != old->center.x || sphere->center.y != old->center.y ||
+			sphere->center.z != old->center.z || sphere->radius != old->radius) {
+			return false;
+		}
+
+		if (sphere->material_index != old->material_index) {
+			affected_materials.push_back(old->material_index);
+		}
+	}
+
+	for (u32 i = 0; i < scene->num_planes; ++i) {
+		if (scene->planes[i].z != job->scene.planes[i].z) {
+			return false;
+		}
+
+		if (scene->planes[i].material_index != job->scene.planes[i].material_index) {
+			affected_materials.push_back(job->scene.planes[i].material_index);
+		}
+	}
+
+	render_job_cancel(job);
+
+	memcpy(job->scene.materials, scene->materials, scene->num_materials * sizeof(Material));
+	memcpy(job->scene.spheres, scene->spheres, scene->num_spheres * sizeof(Sphere));
+	memcpy(job->scene.planes, scene->planes, scene->num_planes * sizeof(Plane));
+
+	// a material may have switched kind, and the tile loops are picked by them
+	scene_mark_dirty(&job->scene, SCENE_DIRTY_MATERIALS);
+	scene_update(&job->scene, 0, job->config.pool);
+
+	u32 retraced = 0;
+
+	for (u32 i = 0; i < job->queue.tile_count; ++i) {
+		u64 *hits = job->tile_hits + i * job->hit_words;
+
+		bool affected = false;
+		for (u32 m : affected_materials) {
+			if (m < job->hit_words * 64 && ((hits[m >> 6] >> (m & 63)) & 1)) {
+				affected = true;
+				break;
+			}
+		}
+
+		if (!affected) {
+			continue;
+		}
+
+		clear_tile(job, i);
+		retraced++;
+	}
+
+	job->retraced_tiles = retraced;
+	job->samples_done = min_tile_samples(job);
+	job->finished = false;
+
+	cancel_token_reset(&job->cancel);
+
+	thread_pool_submit(job->config.pool, &job->group, [job]() {
+		render_job_run(job);
+	});
+
+	return true;
+}
+
+void render_job_updates(RenderJob *job, std::function<void(Tile *tile, u32 *pixels, u32 stride)> fn) {
+	std::lock_guard<std::mutex> lock(job->mutex);
+
+	u32 stride = job->config.width;
+
+	for (u32 tile_index : job->updated_tiles) {
+		Tile *tile = &job->queue.tiles[tile_index];
+		fn(tile, job->data + tile->y * stride + tile->x, stride);
+
+		job->tile_updated[tile_index] = false;
+	}
+
+	job->updated_tiles.clear();
+}
+
+void render_job_cancel(RenderJob *job) {
+	if (is_cancelled(&job->cancel)) {
+		return;
+	}
+
+	cancel_token_cancel(&job->cancel);
+	thread_pool_wait(job->config.pool, &job->group);
+
+	job->cancel_latency_us = get_real_time() - job->cancel.cancel_time;
+}
+
+void render_job_free(RenderJob *job) {
+	render_job_cancel(job);
+
+	free_work_queue(&job->queue);
+	free_framebuffer(&job->fb);
+	free(job->data);
+	free(job->tile_samples);
+	free(job->tile_hits);
+	free_scene_copy(&job->scene);
+
+	delete job;
+}
@@ -0,0 +1,65 @@
+#ifndef RENDER_JOB_H
+#define RENDER_JOB_H
+
+#include "thread_pool.h"
+#include "raycaster.h"
+
+/*
+ * A progressive render running in the background on config->pool.
+ * The job renders passes of samples_per_pass over all tiles until
+ * rays_per_pixel is reached. Every finished tile is resolved into `data`
+ * right away and reported through render_job_updates, so a viewer can
+ * show the image refining without waiting for whole frames.
+ */
+struct RenderJob {
+	Scene scene;
+	RayCastConfig config;
+
+	WorkQueue queue;
+	Framebuffer fb;
+
+	// samples every pixel of a tile has, tiles behind the others catch up
+	// first, samples_done is the minimum over all tiles
+	u32 *tile_samples;
+
+	// with config.record_tile_hits, hit_words u64s per tile holding a bit
+	// for every material a path of the tile hit
+	u64 *tile_hits;
+	u32 hit_words;
+	u32 retraced_tiles;
+
+	std::atomic<u32> samples_done;
+	std::atomic<bool> finished;
+
+	CancelToken cancel;
+	// time from render_job_cancel until all workers were idle
+	u64 cancel_latency_us;
+
+	// guards data, updated_tiles and tile_updated
+	std::mutex mutex;
+	u32 *data;
+	std::vector<u32> updated_tiles;
+	std::vector<bool> tile_updated;
+
+	TaskGroup group;
+};
+
+// copies the scene, config->pool must be set
+RenderJob *render_job_start(Scene *scene, RayCastConfig *config);
+
+// calls fn for every tile resolved since the last call, with the tile's
+// first pixel and the row stride of the image
+void render_job_updates(RenderJob *job, std::function<void(Tile *tile, u32 *pixels, u32 stride)> fn);
+
+// After material edits, continues the job with the scene's new materials and
+// only re-traces the tiles whose paths hit one of `materials` (or the old
+// material of a sphere that switched), the rest keep their accumulation.
+// False if the job has no tile records or the edit changed more than the
+// materials of spheres and planes (objects and instances have to stay the
+// same), the caller has to start a new job then.
+bool render_job_retrace(RenderJob *job, Scene *scene, u32 *materials, u32 count);
+
+void render_job_cancel(RenderJob *job);
+void render_job_free(RenderJob *job);
+
+#endif
@@ -0,0 +1,90 @@
+#include "thread_pool.h"
+
+static void run_task(ThreadPool *pool, Task *task) {
+	task->fn();
+
+	if (--task->group->pending == 0) {
+		// lock so a waiter cannot miss the notification between its check and its wait
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->done.notify_all();
+	}
+}
+
+static void worker_loop(ThreadPool *pool) {
+	for (;;) {
+		Task task;
+		{
+			std::unique_lock<std::mutex> lock(pool->mutex);
+			pool->wake.wait(lock, [pool]() { return pool->quit || !pool->tasks.empty(); });
+
+			if (pool->tasks.empty()) {
+				return;
+			}
+
+			task = std::move(pool->tasks.front());
+			pool->tasks.pop_front();
+		}
+
+		run_task(pool, &task);
+	}
+}
+
+void thread_pool_init(ThreadPool *pool, uint32_t thread_count) {
+	pool->quit = false;
+
+	for (uint32_t i = 0; i < thread_count; ++i) {
+		pool->threads.push_back(std::thread(worker_loop, pool));
+	}
+}
+
+void thread_pool_destroy(ThreadPool *pool) {
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->quit = true;
+	}
+	pool->wake.notify_all();
+
+	for (auto &t : pool->threads) {
+		t.join();
+	}
+
+	pool->threads.clear();
+}
+
+void thread_pool_submit(ThreadPool *pool, TaskGroup *group, std::function<void()> fn) {
+	group->pending++;
+
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->tasks.push_back({ group, std::move(fn) });
+	}
+	pool->wake.notify_one();
+}
+
+void thread_pool_wait(ThreadPool *pool, TaskGroup *group) {
+	while (group->pending > 0) {
+		Task task;
+		{
+			std::unique_lock<std::mutex> lock(pool->mutex);
+			if (pool->tasks.empty()) {
+				pool->done.wait(lock, [&]() { return group->pending == 0 || !pool->tasks.empty(); });
+				continue;
+			}
+
+			task = std::move(pool->tasks.front());
+			pool->tasks.pop_front();
+		}
+
+		run_task(pool, &task);
+	}
+}
+
+void thread_pool_run(ThreadPool *pool, uint32_t count, std::function<void(uint32_t)> fn) {
+	TaskGroup group;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		thread_pool_submit(pool, &group, [&fn, i]() { fn(i); });
+	}
+
+	thread_pool_wait(pool, &group);
+}
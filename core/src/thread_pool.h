@@ -0,0 +1,50 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+/*
+ * Persistent worker threads fed from a single FIFO of tasks.
+ * Tasks are grouped by a TaskGroup so a caller can wait for just the work
+ * it submitted; a waiting thread helps by running queued tasks, which
+ * keeps nested waits from deadlocking.
+ */
+
+struct TaskGroup {
+	std::atomic<uint32_t> pending{0};
+};
+
+struct Task {
+	TaskGroup *group;
+	std::function<void()> fn;
+};
+
+struct ThreadPool {
+	std::vector<std::thread> threads;
+	std::deque<Task> tasks;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	bool quit;
+};
+
+void thread_pool_init(ThreadPool *pool, uint32_t thread_count);
+void thread_pool_destroy(ThreadPool *pool);
+
+void thread_pool_submit(ThreadPool *pool, TaskGroup *group, std::function<void()> fn);
+void thread_pool_wait(ThreadPool *pool, TaskGroup *group);
+
+// runs fn(0) .. fn(count - 1) on the pool and waits for all of them
+void thread_pool_run(ThreadPool *pool, uint32_t count, std::function<void(uint32_t)> fn);
+
+#endif
@@ -5,7 +5,25 @@
 
 #include <GLFW/glfw3.h>
 
+#include "thread_pool.h"
 #include "raycaster.h"
+#include "render_job.h"
+#include "arena.h"
+#include "bvh.h"
+
+// While editing, renders restart at a fraction of the resolution with a
+// single ray per pixel and step up to the full render whenever a level finishes.
+struct PreviewLevel {
+    u32 scale;
+    u32 rays_per_pixel; // 0 uses the configured rays per pixel
+};
+
+static PreviewLevel preview_levels[] = {
+    { 8, 1 },
+    { 4, 1 },
+    { 2, 1 },
+    { 1, 0 },
+};
 
 static void glfw_error_callback(int error, const char* description) {
     fprintf(stderr, "GLFW Error %d: %s\n", error, description);
@@ -49,18 +67,40 @@ int main(int argc, char *argv[]) {
     ImGui_ImplGlfw_InitForOpenGL(window, true);
     ImGui_ImplOpenGL3_Init(glsl_version);
 
-    u32 texture;
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    // the front texture is shown, the back one is filled by the running job
+    // and becomes the front once its first pass is complete
+    u32 textures[2];
+    glGenTextures(2, textures);
+    for (u32 i = 0; i < 2; ++i) {
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+    u32 front = 0;
+
+    // one core is left to the ui thread
+    ThreadPool pool;
+    u32 pool_threads = std::thread::hardware_concurrency();
+    thread_pool_init(&pool, pool_threads > 1 ? pool_threads - 1 : 1);
 
     RayCastConfig config = ray_cast_config_default();
     config.cores = 8;
+    config.tile_size = 64;
+    config.pool = &pool;
+    config.verbose = false;
+    config.record_tile_hits = true;
     u32 n = 10;
 
-    Scene scene;
-    scene.materials = (Material *) malloc((n+1) * sizeof(Material));
+    // spheres are added and removed in place, a rebuilt bvh takes the
+    // space of the old one as nothing is pushed after it
+    Arena scene_arena = make_arena(ARENA_LARGE_PAGE_SIZE, false);
+
+    Scene scene = {};
+    scene.arena = &scene_arena;
+    // the first preview goes out on a linear bvh, the SAH one is built on the
+    // pool meanwhile and swapped in for the next level that starts after it
+    scene.interactive = true;
+    scene.materials = ARENA_PUSH_ARRAY(&scene_arena, Material, n + 1);
 	scene.materials[0] = make_matt(vec3(0.5));
 
 	for (u32 i = 1; i < n+1; ++i) {
@@ -69,11 +109,11 @@ int main(int argc, char *argv[]) {
 
 	scene.num_materials = 2;
 
-    Plane floor = make_plane(0, 0);
-	scene.planes = &floor;
+    scene.planes = ARENA_PUSH_ARRAY(&scene_arena, Plane, 1);
+    scene.planes[0] = make_plane(0, 0);
     scene.num_planes = 1;
 
-    scene.spheres = (Sphere *) malloc(n * sizeof(Sphere));
+    scene.spheres = ARENA_PUSH_ARRAY(&scene_arena, Sphere, n);
 	for (u32 i = 0; i < n+0; ++i) {
 		scene.spheres[i] = make_sphere({0, 0, 1}, 1, 1);
 	}
@@ -86,9 +126,94 @@ int main(int argc, char *argv[]) {
     f32 focus_dist = 10;
     f32 aperture = 0.15;
 
-    u32 *data = 0;
+    RenderJob *job = 0;
+    u32 job_texture = 0;
+    u32 level = 0;
 
     bool show_config = true;
+    bool interactive = true;
+
+    u32 last_width = 0;
+    u32 last_height = 0;
+    u64 last_cancel_latency_us = 0;
+    SceneUpdateStats last_update = {};
+
+    // the SAH tree in the making, over a copy of the spheres so edits can go on
+    TaskGroup sah_group;
+    Bvh *sah_bvh = 0;
+    Sphere *sah_spheres = 0;
+    std::atomic<bool> sah_done = false;
+
+    auto start_sah_build = [&]() {
+        u32 count = scene.num_spheres;
+        sah_spheres = (Sphere *) malloc(max(count, 1u) * sizeof(Sphere));
+        memcpy(sah_spheres, scene.spheres, count * sizeof(Sphere));
+        sah_bvh = (Bvh *) malloc(sizeof(Bvh));
+        sah_done = false;
+
+        Bvh *bvh = sah_bvh;
+        Sphere *spheres = sah_spheres;
+        thread_pool_submit(&pool, &sah_group, [bvh, spheres, count, &sah_done]() {
+            bvh_build(bvh, spheres, count);
+            sah_done = true;
+        });
+    };
+
+    // a tree built over a different number of spheres than the scene has now is dropped
+    auto finish_sah_build = [&]() {
+        thread_pool_wait(&pool, &sah_group);
+
+        if (!scene_replace_bvh(&scene, sah_bvh)) {
+            bvh_free(sah_bvh);
+            free(sah_bvh);
+        }
+        free(sah_spheres);
+
+        sah_bvh = 0;
+        sah_spheres = 0;
+    };
+
+    auto start_level = [&](u32 l) {
+        PreviewLevel *preview = &preview_levels[l];
+
+        RayCastConfig level_config = config;
+        level_config.width = max(config.width / preview->scale, 1);
+        level_config.height = max(config.height / preview->scale, 1);
+        if (preview->rays_per_pixel) {
+            level_config.rays_per_pixel = preview->rays_per_pixel;
+        }
+
+        scene.camera = make_camera(fov, cam_pos, look_at, focus_dist, aperture, level_config.width, level_config.height);
+
+        if (job) {
+            render_job_cancel(job);
+            last_cancel_latency_us = job->cancel_latency_us;
+            render_job_free(job);
+        }
+
+        if (sah_bvh && sah_done) {
+            finish_sah_build();
+        }
+
+        // only record real edits, the preview ramp starts jobs on a clean scene
+        if (scene.dirty || !scene.bvh) {
+            scene_update(&scene, &last_update, &pool);
+
+            if (last_update.linear_bvh && !scene.dynamic && !sah_bvh) {
+                start_sah_build();
+            }
+        }
+        job = render_job_start(&scene, &level_config);
+        level = l;
+
+        // the new job starts out black, tiles are uploaded as they finish
+        job_texture = textures[1 - front];
+        glBindTexture(GL_TEXTURE_2D, job_texture);
+        {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, level_config.width, level_config.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, job->data);
+        }
+    };
 
     while (!glfwWindowShouldClose(window)) {
         glfwPollEvents();
@@ -104,7 +229,7 @@ int main(int argc, char *argv[]) {
             config.width = ImGui::GetContentRegionMax().x;
             config.height = ImGui::GetContentRegionMax().y;
 
-            ImGui::Image((void*)(intptr_t) texture, ImVec2((f32)config.width, (f32)config.height), ImVec2(0, 1), ImVec2(1, 0));
+            ImGui::Image((void*)(intptr_t) textures[front], ImVec2((f32)config.width, (f32)config.height), ImVec2(0, 1), ImVec2(1, 0));
 
             ImGui::End();
             ImGui::PopStyleVar();
@@ -112,20 +237,39 @@ int main(int argc, char *argv[]) {
 
 		// ImGui::ShowDemoWindow();
 
+        // restart is for config edits, which always need a new job, changed
+        // for scene edits, where the dirty flags tell what can be kept
+        bool restart = config.width != last_width || config.height != last_height;
+        bool changed = false;
+        last_width = config.width;
+        last_height = config.height;
+
         if (show_config) { 
             ImGui::Begin("Config");
 
-			ImGui::SliderInt("Threads", (s32 *) &config.cores, 0, 20);
-			ImGui::SliderInt("Spheres", (s32 *) &scene.num_spheres, 0, n);
-			ImGui::SliderInt("Materials", (s32 *) &scene.num_materials, 0, n+1);
-            ImGui::ColorEdit4("Sky Color", (float*)&config.sky_color, ImGuiColorEditFlags_NoInputs);
-            ImGui::DragFloat3("Cam Pos", (f32 *) &cam_pos, 0.1f, -10.0f, 10.0f);
-            ImGui::DragFloat3("Look At", (f32 *) &look_at, 0.1f, -10.0f, 10.0f);
-            ImGui::DragFloat("FOV", &fov, 1.0f, 5.0f, 90.0f);
-            ImGui::DragFloat("Focus Dist", &focus_dist, 1.0f, 5.0f, 40.0f);
-            ImGui::DragFloat("Aperture", &aperture, 0.005f, 0.01f, 2.0f);
-            ImGui::DragInt("Max Bounces", (s32 *) &config.max_bounces, 1.0f, 1, 20);
-            ImGui::DragInt("Rpp", (s32 *) &config.rays_per_pixel, 2.0f, 16, 1024);
+			restart |= ImGui::SliderInt("Threads", (s32 *) &config.cores, 1, 20);
+			if (ImGui::SliderInt("Spheres", (s32 *) &scene.num_spheres, 0, n)) {
+				scene_mark_dirty(&scene, SCENE_DIRTY_TOPOLOGY);
+				changed = true;
+			}
+			if (ImGui::SliderInt("Materials", (s32 *) &scene.num_materials, 0, n+1)) {
+				scene_mark_dirty(&scene, SCENE_DIRTY_MATERIALS);
+				changed = true;
+			}
+
+            bool camera_changed = false;
+            restart |= ImGui::ColorEdit4("Sky Color", (float*)&config.sky_color, ImGuiColorEditFlags_NoInputs);
+            camera_changed |= ImGui::DragFloat3("Cam Pos", (f32 *) &cam_pos, 0.1f, -10.0f, 10.0f);
+            camera_changed |= ImGui::DragFloat3("Look At", (f32 *) &look_at, 0.1f, -10.0f, 10.0f);
+            camera_changed |= ImGui::DragFloat("FOV", &fov, 1.0f, 5.0f, 90.0f);
+            camera_changed |= ImGui::DragFloat("Focus Dist", &focus_dist, 1.0f, 5.0f, 40.0f);
+            camera_changed |= ImGui::DragFloat("Aperture", &aperture, 0.005f, 0.01f, 2.0f);
+            if (camera_changed) {
+                scene_mark_dirty(&scene, SCENE_DIRTY_CAMERA);
+                changed = true;
+            }
+            restart |= ImGui::DragInt("Max Bounces", (s32 *) &config.max_bounces, 1.0f, 1, 20);
+            restart |= ImGui::DragInt("Rpp", (s32 *) &config.rays_per_pixel, 2.0f, 16, 1024);
 
 			for (s32 i = 0; i < scene.num_materials; ++i) {
 				Material *mat = &scene.materials[i];
@@ -134,10 +278,15 @@ int main(int argc, char *argv[]) {
                 
 				ImGui::PushID(i);
 
-                ImGui::RadioButton("Matt", (s32 *) &mat->kind, 0); ImGui::SameLine();
-                ImGui::RadioButton("Metallic", (s32 *) &mat->kind, 1);
+                bool material_changed = ImGui::RadioButton("Matt", (s32 *) &mat->kind, 0); ImGui::SameLine();
+                material_changed |= ImGui::RadioButton("Metallic", (s32 *) &mat->kind, 1);
+
+                material_changed |= ImGui::ColorEdit4("Albedo", (float*)&mat->albedo, ImGuiColorEditFlags_NoInputs);
 
-                ImGui::ColorEdit4("Albedo", (float*)&mat->albedo, ImGuiColorEditFlags_NoInputs);
+                if (material_changed) {
+                    scene_mark_material_dirty(&scene, i);
+                    changed = true;
+                }
 
 				ImGui::PopID();
 			}
@@ -149,25 +298,78 @@ int main(int argc, char *argv[]) {
 
                 ImGui::Text("Sphere %d", i);
 
-				ImGui::DragFloat3("Pos", (f32 *) &sp->center, 0.1f, -10.0f, 10.0f);
-				ImGui::DragFloat("Radius", &sp->radius, 0.05f, 0.1f, 5.0f);
-				ImGui::SliderInt("Material", (s32 *)&sp->material_index, 0, scene.num_materials - 1);
+				bool moved = ImGui::DragFloat3("Pos", (f32 *) &sp->center, 0.1f, -10.0f, 10.0f);
+				moved |= ImGui::DragFloat("Radius", &sp->radius, 0.05f, 0.1f, 5.0f);
+				if (moved) {
+					scene_mark_sphere_dirty(&scene, i);
+					changed = true;
+				}
+
+				// only the tiles that saw the old material change
+				u32 old_material = sp->material_index;
+				if (ImGui::SliderInt("Material", (s32 *)&sp->material_index, 0, scene.num_materials - 1)) {
+					scene_mark_material_dirty(&scene, old_material);
+					changed = true;
+				}
 
 				ImGui::PopID();
             }
 
-            if (ImGui::Button("Update")) {
+            ImGui::Checkbox("Interactive", &interactive);
+            ImGui::SameLine();
 
-                scene.camera = make_camera(fov, cam_pos, look_at, focus_dist, aperture, config.width, config.height);
+            if (ImGui::Button("Update")) {
+                start_level(interactive ? 0 : ARR_LEN(preview_levels) - 1);
+            }
 
-                free(data);
-                data = raytrace(&scene, &config);
-                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, config.width, config.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+            if (job) {
+                ImGui::SameLine();
+                ImGui::Text("%ux%u, %u / %u rays per pixel", job->config.width, job->config.height,
+                    (u32) job->samples_done, job->config.rays_per_pixel);
+            }
+            ImGui::Text("Last cancel took %.2f ms", (f32) last_cancel_latency_us / 1000.0f);
+            ImGui::Text("Last scene update (%s%s) took %.3f ms", scene_update_name(last_update.kind), last_update.linear_bvh ? ", linear bvh" : "", (f32) last_update.time_us / 1000.0f);
+            if (job) {
+                ImGui::Text("Re-traced %u / %u tiles", job->retraced_tiles, job->queue.tile_count);
             }
 
             ImGui::End();
         }
 
+        if (config.width && config.height) {
+            // material only edits keep the tiles that never saw the material
+            bool retraced = false;
+            if (interactive && changed && !restart && job && scene.dirty == SCENE_DIRTY_MATERIALS &&
+                scene.num_dirty_materials <= SCENE_MAX_DIRTY_MATERIALS) {
+                retraced = render_job_retrace(job, &scene, scene.dirty_materials, scene.num_dirty_materials);
+                if (retraced) {
+                    last_cancel_latency_us = job->cancel_latency_us;
+                    scene_update(&scene, &last_update, &pool);
+                }
+            }
+
+            if (interactive && (changed || restart) && !retraced) {
+                start_level(0);
+            } else if (job && job->finished && level + 1 < ARR_LEN(preview_levels)) {
+                start_level(level + 1);
+            }
+        }
+
+        if (job) {
+            glBindTexture(GL_TEXTURE_2D, job_texture);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, job->config.width);
+
+            render_job_updates(job, [](Tile *tile, u32 *pixels, u32 stride) {
+                glTexSubImage2D(GL_TEXTURE_2D, 0, tile->x, tile->y, tile->w, tile->h, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+            });
+
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+            if (job->samples_done > 0) {
+                front = job_texture == textures[0] ? 0 : 1;
+            }
+        }
+
         ImGui::Render();
         int display_w, display_h;
         glfwGetFramebufferSize(window, &display_w, &display_h);
@@ -179,6 +381,15 @@ int main(int argc, char *argv[]) {
         glfwSwapBuffers(window);
     }
 
+    if (job) {
+        render_job_free(job);
+    }
+    if (sah_bvh) {
+        finish_sah_build();
+    }
+    thread_pool_destroy(&pool);
+    free_arena(&scene_arena);
+
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();